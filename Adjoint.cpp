@@ -34,31 +34,36 @@ int main(int argc, char* argv[])
 
     std::sort(snapshots.begin(), snapshots.end(), [](Snapshot& a, Snapshot& b){return a.step<b.step;});
 
-    std::vector<StateVector> intermediateStates;
+    // by default the number of checkpoints grows logarithmically with the steps
+    int checkpoints = 0;
+    if (const char* fromEnvironment = std::getenv("STRATIFLOW_CHECKPOINTS"))
+    {
+        checkpoints = std::stoi(fromEnvironment);
+    }
+
     StateVector directState;
     StateVector adjointState;
 
+    // the forward evolution is evolved again with its own solver, which is kept for every interval
+    IMEXRK forwardSolver;
+
+    // each interval between snapshots has its own timestep, and is evolved again from its first snapshot
+    // with checkpoints as the adjoint needs it
     for (auto snapshot = snapshots.end(); std::prev(snapshot)!=snapshots.begin(); snapshot--)
     {
         const Snapshot& shotabove = *std::prev(snapshot);
         const Snapshot& shotbelow = *std::prev(std::prev(snapshot));
 
         std::cout << "Between " << shotbelow.time << " and " << shotabove.time << std::endl;
-        stratifloat steps = shotabove.step - shotbelow.step;
+        int steps = shotabove.step - shotbelow.step;
         stratifloat deltaT = (shotabove.time - shotbelow.time)/steps;
 
         std::cout << "Timestep " << deltaT << std::endl;
 
-        // Fill in the gaps by doing extra forward integration
         directState.LoadFromFile(shotbelow.filename);
-        directState.FixedEvolve(deltaT, steps, intermediateStates);
-
-        directState.LoadFromFile(shotabove.filename);
-        intermediateStates.push_back(directState);
 
-        // Now do adjoint integration
         adjointState.PlotAll(std::to_string(shotabove.time));
-        adjointState.AdjointEvolve(deltaT, steps, intermediateStates, adjointState);
+        adjointState.AdjointEvolve(deltaT, steps, directState, adjointState, forwardSolver, checkpoints);
     }
 
     directState.LoadFromFile(snapshots[0].filename);
@@ -1,15 +1,20 @@
 #pragma once
 #include "StateVector.h"
+#include "KrylovBasis.h"
 
+// finds the eigenvalues of largest modulus of the linearised evolution, with a Krylov-Schur iteration (Stewart 2001)
+//
+// the basis is kept at K vectors or fewer: when it is full, the Schur vectors of the largest eigenvalues
+// (with some others to speed convergence) are kept, and the rest of it is thrown away
+// it stops once the Ritz residuals of the wanted eigenvalues are small, or after maxEvaluations evolutions
 template<typename VectorType>
 class Arnoldi
 {
 public:
     Arnoldi()
-    : q(K)
-    , H(K, K-1)
+    : B(K+1, K)
     {
-        H.setZero();
+        B.setZero();
     }
 
     stratifloat Run(const VectorType& at, VectorType& result, bool removePhaseShift=true, bool getSecond=false)
@@ -22,78 +27,61 @@ public:
         phaseShift.u3 = ddx(at.u3);
         phaseShift.b = ddx(at.b);
 
-        q[0].ExciteLowWavenumbers(0.1);
+        // only the newest vector is kept whole, the others are in q
+        VectorType newest;
+        VectorType basisVector;
 
-        q[0].EnforceBCs();
+        newest.ExciteLowWavenumbers(0.1);
 
-        q[0] *= 1/q[0].Norm();
+        newest.EnforceBCs();
 
-        K = q.size();
-        for (int k=1; k<K; k++)
+        newest *= 1/newest.Norm();
+        q.Store(0, newest);
+
+        B.setZero(K+1, K);
+        basisSize = 1;
+
+        bool converged = false;
+        for (int evaluations=1; evaluations<=maxEvaluations && !converged; evaluations++)
         {
-            // Arnoldi Algorithm
-            // find orthogonal basis q1,...,qn
-            // from x, A x, A^2 x, ...
+            if (basisSize == K+1)
+            {
+                Restart();
+                q.Load(basisSize-1, newest);
+            }
 
-            // q_k = A q_k-1
-            q[k] = EvalLinearised(q[k-1]);
+            // Arnoldi Algorithm
+            // extend the orthogonal basis q1,...,qn with A q_n
+            int j = basisSize-1;
+            newest = EvalLinearised(newest);
 
             // remove component in direction of preceding vectors
-            for (int j=0; j<k; j++)
+            // this is done twice, as the basis is kept for many more steps than before a restart
+            for (int pass=0; pass<2; pass++)
             {
-                H(j,k-1) = q[j].Dot(q[k]);
-                q[k].MulAdd(-H(j,k-1), q[j]);
+                for (int i=0; i<=j; i++)
+                {
+                    q.Load(i, basisVector);
+                    stratifloat component = basisVector.Dot(newest);
+                    B(i,j) += component;
+                    newest.MulAdd(-component, basisVector);
+                }
             }
 
             // normalise
-            H(k,k-1) = q[k].Norm();
-            q[k] *= 1/H(k,k-1);
+            B(j+1,j) = newest.Norm();
+            newest *= 1/B(j+1,j);
 
             // enforce BCs
-            q[k].EnforceBCs();
-
-            MatrixX subH = H.block(0,0,k,k);
-
-            EigenSolver<MatrixX> ces(subH, false);
-            ArrayXc complexEigenvalues = ces.eigenvalues();
-            ArrayX eigenvalues = sqrt(complexEigenvalues.real()*complexEigenvalues.real()
-                                    + complexEigenvalues.imag()*complexEigenvalues.imag());
+            newest.EnforceBCs();
+            q.Store(j+1, newest);
+            basisSize++;
 
-
-            // transform phase shift into arnoldi space
-            VectorX phaseShiftTransformed = VectorX::Zero(k);
-            for (int j=0; j<k; j++)
-            {
-                phaseShiftTransformed[j] = phaseShift.Dot(q[j]);
-            }
-
-            // exclude things that look like a phase shift
-//            for (int j=0; j<k; j++)
-//            {
-//                complex proj = ces.eigenvectors().col(j).dot(phaseShiftTransformed);
-//                stratifloat prod = phaseShiftTransformed.norm()*ces.eigenvectors().col(j).norm();
-//                if (proj.real() > 0.7*prod || proj.real() < -0.7*prod)
-//                {
-//                    eigenvalues(j) = 0;
-//                }
-//            }
-
-            int maxIndex;
-            stratifloat maxCoeff = eigenvalues.maxCoeff(&maxIndex);
-            eigenvalues(maxIndex) = 0;
-
-            stratifloat maxCoeff2 = eigenvalues.maxCoeff(&maxIndex);
-            eigenvalues(maxIndex) = 0;
-
-            stratifloat maxCoeff3 = eigenvalues.maxCoeff(&maxIndex);
-
-            std::cout << "At step " << k << ", maximum growth rates: "
-                      << maxCoeff << " & "
-                      << maxCoeff2 << " & "
-                      << maxCoeff3 << std::endl;
+            converged = CheckRitzValues(evaluations);
         }
 
-        MatrixX subH = H.block(0,0,K-1,K-1);
+        int m = basisSize-1;
+        MatrixX subH = B.topLeftCorner(m, m);
 
         EigenSolver<MatrixX> ces(subH, true);
         ArrayXc complexEigenvalues = ces.eigenvalues();
@@ -110,27 +98,28 @@ public:
 
         eigenvalues(maxIndex2) = 0;
         int maxIndex3;
-        stratifloat maxCoeff3 = eigenvalues.maxCoeff(&maxIndex3);
+        eigenvalues.maxCoeff(&maxIndex3);
 
         VectorXc eigenvector = ces.eigenvectors().col(maxIndex);
         VectorXc eigenvector2 = ces.eigenvectors().col(maxIndex2);
         VectorXc eigenvector3 = ces.eigenvectors().col(maxIndex3);
 
-        
+
         // transform phase shift into arnoldi space
-        VectorX phaseShiftTransformed = VectorX::Zero(K-1);
-        for (int j=0; j<K-1; j++)
+        VectorX phaseShiftTransformed = VectorX::Zero(m);
+        for (int j=0; j<m; j++)
         {
-            phaseShiftTransformed[j] = phaseShift.Dot(q[j]);
+            q.Load(j, basisVector);
+            phaseShiftTransformed[j] = phaseShift.Dot(basisVector);
         }
-        
+
         if (removePhaseShift)
         {
             // remove any phase shift component
             eigenvector -= (eigenvector.dot(phaseShiftTransformed)/phaseShiftTransformed.squaredNorm())*phaseShiftTransformed;
             eigenvector2 -= (eigenvector2.dot(phaseShiftTransformed)/phaseShiftTransformed.squaredNorm())*phaseShiftTransformed;
             eigenvector3 -= (eigenvector3.dot(phaseShiftTransformed)/phaseShiftTransformed.squaredNorm())*phaseShiftTransformed;
-        }        
+        }
         eigenvector.normalize();
         eigenvector2.normalize();
         eigenvector3.normalize();
@@ -144,15 +133,16 @@ public:
         VectorType imag3;
 
         VectorType phaseShiftBack;
-        for (int k=0; k<K-1; k++)
+        for (int k=0; k<m; k++)
         {
-            result += eigenvector(k).real() * q[k];
-            imag1 += eigenvector(k).imag() * q[k];
-            result2 += eigenvector2(k).real() * q[k];
-            imag2 += eigenvector2(k).imag() * q[k];
-            result3 += eigenvector3(k).real() * q[k];
-            imag3 += eigenvector3(k).imag() * q[k];
-            phaseShiftBack += phaseShiftTransformed(k) * q[k];
+            q.Load(k, basisVector);
+            result += eigenvector(k).real() * basisVector;
+            imag1 += eigenvector(k).imag() * basisVector;
+            result2 += eigenvector2(k).real() * basisVector;
+            imag2 += eigenvector2(k).imag() * basisVector;
+            result3 += eigenvector3(k).real() * basisVector;
+            imag3 += eigenvector3(k).imag() * basisVector;
+            phaseShiftBack += phaseShiftTransformed(k) * basisVector;
         }
 
         result.PlotAll("eigReal");
@@ -201,9 +191,190 @@ protected:
     VectorType linearAboutStart;
 
 public:
-    int K = 1024; // max iterations
-    std::vector<VectorType> q;
-    MatrixX H; // upper Hessenberg matrix
+    int wanted = 3; // number of eigenvalues of largest modulus which have to converge
+    int K = 64; // largest basis, after which it restarts
+    int maxEvaluations = 1024;
+    stratifloat tolerance = 1e-5; // for the Ritz residuals, relative to the eigenvalue's modulus
+
+    KrylovBasis<VectorType> q;
+
+    // A q_j = sum_i B_ij q_i, where the last vector's image isn't known yet
+    // this is upper Hessenberg until the first restart, and after it the top left block is full
+    MatrixX B;
+
+private:
+    // the eigenvalues of the top left m by m block of B, largest modulus first
+    std::vector<int> ByModulus(const EigenSolver<MatrixX>& ritz, int m)
+    {
+        std::vector<int> order(m);
+        for (int n=0; n<m; n++)
+        {
+            order[n] = n;
+        }
+        std::sort(order.begin(), order.end(), [&ritz](int a, int b)
+        {
+            return std::abs(ritz.eigenvalues()[a]) > std::abs(ritz.eigenvalues()[b]);
+        });
+        return order;
+    }
+
+    // the residual of a Ritz pair (theta, V y) is |A V y - theta V y| = |b^T y|, where b is the last row of B
+    bool CheckRitzValues(int evaluations)
+    {
+        int m = basisSize-1;
+        EigenSolver<MatrixX> ritz(B.topLeftCorner(m, m), true);
+        std::vector<int> order = ByModulus(ritz, m);
+
+        bool converged = m >= wanted;
+        for (int n=0; n<std::min(wanted, m); n++)
+        {
+            VectorXc y = ritz.eigenvectors().col(order[n]);
+            complex residual = B.row(m).head(m).cast<complex>()*y;
+            converged = converged
+                     && std::abs(residual) < tolerance*std::abs(ritz.eigenvalues()[order[n]])*y.norm();
+        }
+
+        std::cout << "At step " << evaluations << ", maximum growth rates: ";
+        for (int n=0; n<std::min(3, m); n++)
+        {
+            std::cout << (n > 0 ? " & " : "") << std::abs(ritz.eigenvalues()[order[n]]);
+        }
+        std::cout << std::endl;
+
+        return converged;
+    }
+
+    // replaces the basis by the Schur vectors of the largest eigenvalues of the top left block S of B,
+    // together with the newest vector, whose image isn't known yet
+    // with S U = U T and the wanted eigenvalues ordered to the front of T, the first p columns Y of U span an
+    // invariant subspace, so A V Y = V Y T_pp + q_K (b^T Y), and the relation holds for the smaller basis
+    // without any more evaluations
+    void Restart()
+    {
+        int m = K;
+        MatrixX S = B.topLeftCorner(m, m);
+        RealSchur<MatrixX> schur(S);
+        MatrixX T = schur.matrixT();
+        MatrixX U = schur.matrixU();
+
+        // T is quasi upper triangular: a complex pair of eigenvalues is a 2 by 2 block on the diagonal
+        std::vector<SchurBlock> blocks;
+        for (int i=0; i<m; i+=blocks.back().size)
+        {
+            SchurBlock block;
+            block.size = (i+1<m && T(i+1,i) != 0) ? 2 : 1;
+            block.modulus = block.size == 1 ? std::abs(T(i,i))
+                                            : std::sqrt(std::abs(T.block(i, i, 2, 2).determinant()));
+            blocks.push_back(block);
+        }
+
+        // more than the wanted vectors are kept, which speeds up their convergence
+        // a complex pair is kept or dropped as a whole, as the two share a block
+        int keep = std::max(wanted, K/2);
+        int p = 0;
+        for (int placed=0; placed<static_cast<int>(blocks.size()) && p<keep; placed++)
+        {
+            int largest = placed;
+            for (int n=placed+1; n<static_cast<int>(blocks.size()); n++)
+            {
+                if (blocks[n].modulus > blocks[largest].modulus)
+                {
+                    largest = n;
+                }
+            }
+
+            // move it forward one block at a time
+            for (int n=largest; n>placed; n--)
+            {
+                int row = 0;
+                for (int i=0; i<n-1; i++)
+                {
+                    row += blocks[i].size;
+                }
+                SwapSchurBlocks(T, U, row, blocks[n-1].size, blocks[n].size);
+                std::swap(blocks[n-1], blocks[n]);
+            }
+
+            p += blocks[placed].size;
+        }
+
+        MatrixX Y = U.leftCols(p);
+
+        // the new vectors are made after the old ones and then moved down
+        VectorType basisVector;
+        VectorType newVector;
+        for (int n=0; n<p; n++)
+        {
+            newVector.Zero();
+            for (int i=0; i<m; i++)
+            {
+                q.Load(i, basisVector);
+                newVector.MulAdd(Y(i,n), basisVector);
+            }
+            newVector.EnforceBCs();
+            q.Store(m+1+n, newVector);
+        }
+        for (int n=0; n<p; n++)
+        {
+            q.Load(m+1+n, newVector);
+            q.Store(n, newVector);
+        }
+        q.Load(m, newVector);
+        q.Store(p, newVector);
+
+        MatrixX top = T.topLeftCorner(p, p);
+        VectorX last = (B.row(m).head(m)*Y).transpose();
+
+        B.setZero();
+        B.topLeftCorner(p, p) = top;
+        B.row(p).head(p) = last.transpose();
+
+        basisSize = p+1;
+
+        std::cout << "ARNOLDI RESTART, KEEPING " << p << " SCHUR VECTORS" << std::endl;
+    }
+
+    struct SchurBlock
+    {
+        int size;
+        stratifloat modulus; // of its eigenvalues
+    };
+
+    // swaps the neighbouring diagonal blocks of T, of sizes p and q, which start at row j,
+    // by an orthogonal similarity transform which is also applied to the Schur vectors U (Bai and Demmel 1993)
+    static void SwapSchurBlocks(MatrixX& T, MatrixX& U, int j, int p, int q)
+    {
+        MatrixX T11 = T.block(j, j, p, p);
+        MatrixX T22 = T.block(j+p, j+p, q, q);
+
+        // T11 X - X T22 = T12, so that the columns of [-X; I] span the invariant subspace of T22's eigenvalues
+        // this is solved as the equivalent p*q by p*q linear system, with X stored by columns
+        MatrixX sylvester = MatrixX::Zero(p*q, p*q);
+        for (int c=0; c<q; c++)
+        {
+            sylvester.block(c*p, c*p, p, p) += T11;
+            for (int d=0; d<q; d++)
+            {
+                sylvester.block(c*p, d*p, p, p) -= T22(d,c)*MatrixX::Identity(p, p);
+            }
+        }
+        MatrixX T12 = T.block(j, j+p, p, q);
+        VectorX x = sylvester.fullPivLu().solve(Map<VectorX>(T12.data(), p*q));
+
+        MatrixX Z(p+q, q);
+        Z.topRows(p) = -Map<MatrixX>(x.data(), p, q);
+        Z.bottomRows(q).setIdentity();
+
+        MatrixX Q = HouseholderQR<MatrixX>(Z).householderQ();
+        T.middleRows(j, p+q) = Q.transpose()*T.middleRows(j, p+q);
+        T.middleCols(j, p+q) = T.middleCols(j, p+q)*Q;
+        U.middleCols(j, p+q) = U.middleCols(j, p+q)*Q;
+
+        // this is zero apart from rounding errors
+        T.block(j+q, j, p, q).setZero();
+    }
+
+    int basisSize; // number of vectors in q which are in use
 };
 
 class BasicArnoldi : public Arnoldi<StateVector>
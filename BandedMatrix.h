@@ -0,0 +1,115 @@
+#pragma once
+
+#include "Eigen.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <algorithm>
+
+// A square matrix which is zero except on a few diagonals either side of the main one
+// Applying it to a vector is then O(N) rather than O(N^2)
+template<typename T>
+class BandedMatrix
+{
+public:
+    BandedMatrix(int N = 0, int lower = 1, int upper = 1)
+    : N(N)
+    , lower(lower)
+    , upper(upper)
+    , bands(Array<T, -1, -1>::Zero(N, lower+upper+1))
+    {
+    }
+
+    // entry (j, j+offset) is stored in row j of column offset+lower
+    // (so the start of the lower diagonals and the end of the upper diagonals are unused)
+    T& operator()(int row, int col)
+    {
+        assert(row>=0 && row<N && col>=0 && col<N);
+        assert(col-row>=-lower && col-row<=upper);
+        return bands(row, col-row+lower);
+    }
+
+    T operator()(int row, int col) const
+    {
+        assert(row>=0 && row<N && col>=0 && col<N);
+
+        if (col-row<-lower || col-row>upper)
+        {
+            return 0;
+        }
+        return bands(row, col-row+lower);
+    }
+
+    // same ordering as Eigen's MatrixBase::diagonal(offset)
+    Map<Array<T, -1, 1>> diagonal(int offset)
+    {
+        assert(offset>=-lower && offset<=upper);
+        return Map<Array<T, -1, 1>>(&bands(std::max(-offset, 0), offset+lower), N-std::abs(offset));
+    }
+
+    Map<const Array<T, -1, 1>> diagonal(int offset) const
+    {
+        assert(offset>=-lower && offset<=upper);
+        return Map<const Array<T, -1, 1>>(&bands(std::max(-offset, 0), offset+lower), N-std::abs(offset));
+    }
+
+    BandedMatrix<T>& operator*=(T scalar)
+    {
+        bands *= scalar;
+        return *this;
+    }
+
+    void ZeroRow(int row)
+    {
+        assert(row>=0 && row<N);
+        bands.row(row).setZero();
+    }
+
+    // out = this * in, where in and out must not alias
+    template<typename In, typename Out>
+    void Apply(const In& in, Out& out) const
+    {
+        assert(in.size() == N && out.size() == N);
+
+        out = bands.col(lower)*in;
+
+        for (int offset=1; offset<=upper; offset++)
+        {
+            out.head(N-offset) += bands.col(lower+offset).head(N-offset)*in.tail(N-offset);
+        }
+
+        for (int offset=1; offset<=lower; offset++)
+        {
+            out.tail(N-offset) += bands.col(lower-offset).tail(N-offset)*in.head(N-offset);
+        }
+    }
+
+    Matrix<T, -1, -1> Dense() const
+    {
+        Matrix<T, -1, -1> dense = Matrix<T, -1, -1>::Zero(N, N);
+
+        for (int offset=-lower; offset<=upper; offset++)
+        {
+            dense.diagonal(offset) = diagonal(offset).matrix();
+        }
+
+        return dense;
+    }
+
+    int rows() const
+    {
+        return N;
+    }
+
+    int cols() const
+    {
+        return N;
+    }
+
+private:
+    int N;
+    int lower; // number of subdiagonals
+    int upper; // number of superdiagonals
+
+    Array<T, -1, -1> bands;
+};
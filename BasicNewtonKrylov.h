@@ -7,10 +7,31 @@ class BasicNewtonKrylov : public NewtonKrylov<StateVector>
 {
     virtual StateVector EvalFunction(const StateVector& at) override
     {
+        // only Run calls this when derivatives are tangent linear, so this is the trajectory to linearise about
         StateVector result;
-        at.FullEvolve(T, result, false, false);
+        at.FullEvolve(T, result, false, false, false, StateVector::solver, tangentLinear ? &trajectory : nullptr);
         result -= at;
 
         return result;
     }
+
+    virtual StateVector EvalFunctionWithSolver(const StateVector& at, IMEXRK& solver) override
+    {
+        StateVector result;
+        at.FullEvolve(T, result, false, false, false, solver);
+        result -= at;
+
+        return result;
+    }
+
+    virtual StateVector EvalTangent(const StateVector& at, IMEXRK& solver) override
+    {
+        StateVector result;
+        at.TangentEvolve(trajectory, result, solver);
+        result -= at;
+
+        return result;
+    }
+
+    Trajectory trajectory;
 };
\ No newline at end of file
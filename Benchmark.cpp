@@ -0,0 +1,358 @@
+#include "IMEXRK.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Times the main kernels on their own (micro) and whole timesteps (macro)
+// The results are written as JSON so that they can be compared between versions
+//
+// usage: StratiflowBench [samples] [output file]
+// the output file defaults to $STRATIFLOW_BENCH_JSON, and then to benchmark.json
+
+namespace
+{
+struct BenchmarkResult
+{
+    std::string name;
+    std::string mode;
+    int N1;
+    int N2;
+    int N3;
+    int samples;
+    double min;    // seconds
+    double median; // seconds
+    double mean;   // seconds
+    double bytes;  // moved to and from memory, if given
+};
+
+const char* DimensionalityName(Dimensionality dimensionality)
+{
+    switch (dimensionality)
+    {
+    case Dimensionality::ThreeDimensional:
+        return "ThreeDimensional";
+    case Dimensionality::TwoAndAHalf:
+        return "TwoAndAHalf";
+    default:
+        return "TwoDimensional";
+    }
+}
+
+class Benchmarks
+{
+public:
+    Benchmarks(int samples)
+    : samples(samples)
+    {
+    }
+
+    // f is called once untimed, so that plans are made and caches are warm,
+    // and then timed separately for each sample
+    // if the bytes it moves to and from memory are given, the bandwidth of the fastest sample is printed too
+    template<typename F>
+    void Run(const std::string& name, Dimensionality mode, int N1, int N2, int N3, F f, double bytes = 0)
+    {
+        f();
+
+        std::vector<double> times(samples);
+        for (int n=0; n<samples; n++)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            f();
+            auto end = std::chrono::high_resolution_clock::now();
+
+            times[n] = std::chrono::duration<double>(end-start).count();
+        }
+
+        std::sort(times.begin(), times.end());
+
+        double total = 0;
+        for (double time : times)
+        {
+            total += time;
+        }
+
+        BenchmarkResult result = {name, DimensionalityName(mode), N1, N2, N3, samples,
+                                  times.front(), times[samples/2], total/samples, bytes};
+        results.push_back(result);
+
+        printf("%-20s %-18s %5dx%-3dx%-5d %12.3e %12.3e",
+               name.c_str(), result.mode.c_str(), N1, N2, N3, result.min, result.median);
+        if (bytes > 0)
+        {
+            printf(" %9.2f GB/s", bytes/result.min/1e9);
+        }
+        printf("\n");
+    }
+
+    void WriteJSON(const std::string& filename) const
+    {
+        FILE* file = fopen(filename.c_str(), "w");
+        if (!file)
+        {
+            fprintf(stderr, "Failed to write benchmarks to %s\n", filename.c_str());
+            return;
+        }
+
+#ifdef USE_DOUBLE
+        const char* precision = "double";
+#else
+        const char* precision = "single";
+#endif
+
+        fprintf(file, "{\n  \"precision\": \"%s\",\n  \"threads\": %d,\n  \"samples\": %d,\n  \"benchmarks\": [\n",
+                precision, omp_get_max_threads(), samples);
+        for (unsigned int n=0; n<results.size(); n++)
+        {
+            const BenchmarkResult& result = results[n];
+            fprintf(file, "    {\"name\": \"%s\", \"mode\": \"%s\", \"grid\": [%d, %d, %d], "
+                          "\"min\": %.6e, \"median\": %.6e, \"mean\": %.6e, \"bytes\": %.0f}%s\n",
+                    result.name.c_str(), result.mode.c_str(), result.N1, result.N2, result.N3,
+                    result.min, result.median, result.mean, result.bytes, n+1<results.size() ? "," : "");
+        }
+        fprintf(file, "  ]\n}\n");
+
+        fclose(file);
+    }
+
+private:
+    int samples;
+    std::vector<BenchmarkResult> results;
+};
+
+// a smooth field which is the same on every run, so timings are reproducible
+stratifloat TestFunction(stratifloat x, stratifloat y, stratifloat z)
+{
+    return sin(2*pi*x/flowParams.L1)*cos(2*pi*y/flowParams.L2)*exp(-z*z) + 0.1*cos(4*pi*x/flowParams.L1)*tanh(z);
+}
+
+// the kernels which do not need a solver, for any grid size
+// K1, K2 and K3 may be Dynamic, in which case the loaded grid is used
+template<int K1, int K2, int K3>
+void RunKernels(Benchmarks& benchmarks, Dimensionality mode)
+{
+    constexpr int KM = ModalSize(K1);
+    using Solver = Tridiagonal<stratifloat, K3>;
+
+    bool filterSpanwise = mode == Dimensionality::ThreeDimensional;
+
+    NodalField<K1, K2, K3> U(BoundaryCondition::Neumann);
+    NodalField<K1, K2, K3> V(BoundaryCondition::Neumann);
+    ModalField<K1, K2, K3> u(BoundaryCondition::Neumann, filterSpanwise);
+    ModalField<K1, K2, K3> v(BoundaryCondition::Neumann, filterSpanwise);
+
+    const int N1 = U.Size1();
+    const int N2 = U.Size2();
+    const int N3 = U.Size3();
+    const int M = u.Size1();
+
+    U.SetValue(TestFunction, flowParams.L1, flowParams.L2, flowParams.L3);
+    U.ToModal(u);
+
+    benchmarks.Run("ToModal", mode, N1, N2, N3, [&]()
+    {
+        U.ToModal(u);
+    });
+
+    benchmarks.Run("ToNodal", mode, N1, N2, N3, [&]()
+    {
+        u.ToNodal(V);
+    });
+
+    // ToNodal used to copy the whole of the field somewhere for the transform to overwrite,
+    // which now only happens when the dealiased spanwise wavenumbers have to be zero padded
+    // so these show the memory traffic saved, and the transform as it was
+    const ModalField<K1, K2, K3>& input = u;
+    TransformScratch staged;
+    staged.modal.resize(M*N2*N3);
+    auto stage = [&]()
+    {
+        ParallelFor(M, 0, N2, [&](int j1, int j2)
+        {
+            Map<ArrayXc, Aligned16>(&staged.modal[(M*j2 + j1)*N3], N3) = input.stack(j1, j2);
+        });
+    };
+    double stagedBytes = 2.0*sizeof(complex)*staged.modal.size();
+
+    benchmarks.Run("StagingCopy", mode, N1, N2, N3, stage, stagedBytes);
+
+    benchmarks.Run("ToNodalStaged", mode, N1, N2, N3, [&]()
+    {
+        stage();
+        PerformC2R(N1, N2, N3, staged.modal.data(), V.Raw(), staged);
+    });
+
+    // the solver's variables are views of a bundle, which transforms them all from where they are,
+    // so this is four fields at once, and SeparateToNodal is the same four fields one at a time
+    FieldBundle<K1, K2, K3> bundle(4, N1, N2, N3);
+    std::vector<std::unique_ptr<NodalField<K1, K2, K3>>> bundledNodal;
+    std::vector<std::unique_ptr<ModalField<K1, K2, K3>>> bundledModal;
+    std::vector<NodalField<K1, K2, K3>> separateNodal;
+    std::vector<ModalField<K1, K2, K3>> separateModal;
+    for (int k=0; k<bundle.Count(); k++)
+    {
+        bundledNodal.emplace_back(new NodalField<K1, K2, K3>(BoundaryCondition::Neumann, bundle, k));
+        bundledModal.emplace_back(new ModalField<K1, K2, K3>(BoundaryCondition::Neumann, filterSpanwise, bundle, k));
+        *bundledModal[k] = u;
+
+        separateNodal.push_back(V);
+        separateModal.push_back(u);
+    }
+
+    benchmarks.Run("BundleToNodal", mode, N1, N2, N3, [&]()
+    {
+        bundle.ToNodal();
+    });
+
+    benchmarks.Run("SeparateToNodal", mode, N1, N2, N3, [&]()
+    {
+        for (int k=0; k<bundle.Count(); k++)
+        {
+            separateModal[k].ToNodal(separateNodal[k]);
+        }
+    });
+
+    // the same operators as a Crank-Nicolson substep
+    BandedMatrix<stratifloat> secondDerivative = VerticalSecondDerivativeMatrix(flowParams.L3, N3, BoundaryCondition::Neumann);
+    DiagonalMatrix<stratifloat, -1> dim1Derivative2 = FourierSecondDerivativeMatrix(flowParams.L1, N1, 1);
+    DiagonalMatrix<stratifloat, -1> dim2Derivative2 = FourierSecondDerivativeMatrix(flowParams.L2, N2, 2);
+
+    std::vector<Solver, aligned_allocator<Solver>> solvers(M*N2);
+    stratifloat c = 0.5*0.01/flowParams.Re;
+    for (int j1=0; j1<M; j1++)
+    {
+        for (int j2=0; j2<N2; j2++)
+        {
+            BandedMatrix<stratifloat> implicit = secondDerivative;
+            implicit *= -c;
+            implicit.diagonal(0) += 1 - c*(dim1Derivative2.diagonal()(j1) + dim2Derivative2.diagonal()(j2));
+            Neumannify(implicit);
+            solvers[j1*N2+j2].compute(implicit);
+        }
+    }
+
+    benchmarks.Run("TridiagonalSolve", mode, N1, N2, N3, [&]()
+    {
+        u.Solve(solvers, v);
+    });
+
+    Matrix<stratifloat, -1, -1> denseSecondDerivative = secondDerivative.Dense();
+
+    benchmarks.Run("Dim3MatMul", mode, N1, N2, N3, [&]()
+    {
+        v = Dim3MatMul<Field<complex, KM, K2, K3>, stratifloat, complex, KM, K2, K3>(denseSecondDerivative, u);
+    });
+
+    benchmarks.Run("Dim3BandedMatMul", mode, N1, N2, N3, [&]()
+    {
+        v = Dim3BandedMatMul<Field<complex, KM, K2, K3>, stratifloat, complex, KM, K2, K3>(secondDerivative, u);
+    });
+
+    volatile stratifloat sink;
+    benchmarks.Run("InnerProd", mode, N1, N2, N3, [&]()
+    {
+        sink = InnerProd(u, v, flowParams.L3);
+    });
+}
+
+// the operations of the solver itself only exist for the grid the drivers use
+void RunSolver(Benchmarks& benchmarks)
+{
+    const int N1 = gridParams.N1;
+    const int N2 = gridParams.N2;
+    const int N3 = gridParams.N3;
+    Dimensionality mode = gridParams.dimensionality;
+
+    IMEXRK solver;
+
+    // a small perturbation on the background shear, so that the flow stays well behaved
+    NeumannNodal U1, U2, B;
+    DirichletNodal U3;
+    U1.SetValue(TestFunction, flowParams.L1, flowParams.L2, flowParams.L3);
+    U3.SetValue(TestFunction, flowParams.L1, flowParams.L2, flowParams.L3);
+    B.SetValue(TestFunction, flowParams.L1, flowParams.L2, flowParams.L3);
+    if (gridParams.ThirdDimension())
+    {
+        U2.SetValue(TestFunction, flowParams.L1, flowParams.L2, flowParams.L3);
+    }
+    U1 *= 0.01;
+    U2 *= 0.01;
+    U3 *= 0.01;
+    B *= 0.01;
+
+    solver.SetBackground(InitialU);
+    solver.SetInitial(U1, U2, U3, B);
+    solver.FilterAll();
+    solver.PopulateNodalVariables();
+    solver.RemoveDivergence(0.0f);
+
+    // the linear step is taken about the initial state
+    solver.SetBackground(solver.u1, solver.u2, solver.u3, solver.b);
+
+    NeumannModal u1 = solver.u1;
+    NeumannModal u2 = solver.u2;
+    DirichletModal u3 = solver.u3;
+    NeumannModal b = solver.b;
+
+    benchmarks.Run("RemoveDivergence", mode, N1, N2, N3, [&]()
+    {
+        solver.RemoveDivergence(0.0f);
+    });
+
+    // each sample starts from the same state, so the timesteps do the same work every time
+    benchmarks.Run("TimeStep", mode, N1, N2, N3, [&]()
+    {
+        solver.SetInitial(u1, u2, u3, b);
+        solver.PopulateNodalVariables();
+        solver.TimeStep();
+    });
+
+    benchmarks.Run("TimeStepLinear", mode, N1, N2, N3, [&]()
+    {
+        solver.SetInitial(u1, u2, u3, b);
+        solver.PopulateNodalVariables();
+        solver.TimeStepLinear();
+    });
+}
+}
+
+int main(int argc, char* argv[])
+{
+    int samples = 20;
+    if (argc > 1)
+    {
+        samples = std::stoi(argv[1]);
+    }
+
+    std::string output = "benchmark.json";
+    if (argc > 2)
+    {
+        output = argv[2];
+    }
+    else if (const char* fromEnvironment = std::getenv("STRATIFLOW_BENCH_JSON"))
+    {
+        output = fromEnvironment;
+    }
+
+    Benchmarks benchmarks(samples);
+
+    printf("%-20s %-18s %-15s %12s %12s\n", "Benchmark", "Mode", "Grid", "Min (s)", "Median (s)");
+
+    // the kernels at each dimensionality, with a similar number of points in each
+    RunKernels<256, 1, 384>(benchmarks, Dimensionality::TwoDimensional);
+    RunKernels<64, 4, 384>(benchmarks, Dimensionality::TwoAndAHalf);
+    RunKernels<64, 48, 128>(benchmarks, Dimensionality::ThreeDimensional);
+
+    // and at the grid the drivers actually use
+    RunKernels<GridN1, GridN2, GridN3>(benchmarks, gridParams.dimensionality);
+
+    RunSolver(benchmarks);
+
+    benchmarks.WriteJSON(output);
+    printf("Written to %s\n", output.c_str());
+}
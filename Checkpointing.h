@@ -0,0 +1,53 @@
+#pragma once
+
+#include <algorithm>
+
+// Binomial checkpointing (Griewank & Walther 2000, known as Revolve) for running an adjoint backwards
+// through a forward evolution, which it needs the states of in reverse order
+//
+// rather than keeping every state, a few are kept as checkpoints and the rest are evolved again from them
+// with c checkpoints, if no step is evolved more than r times, at most (c+r)!/(c!r!) steps can be reversed,
+// so both only need to grow logarithmically with the number of steps
+
+// (c+r)!/(c!r!), or a number above limit if it is larger than that
+inline long long ReversibleSteps(int checkpoints, int repeats, long long limit)
+{
+    // C(c+r, r) built up as C(c+k, k) for k = 1, ..., r, each of which is a whole number
+    long long steps = 1;
+    for (int k=1; k<=repeats && steps<=limit; k++)
+    {
+        steps = steps*(checkpoints + k)/k;
+    }
+    return steps;
+}
+
+// the fewest checkpoints to reverse the given steps with each evolved no more times than there are checkpoints
+inline int BalancedCheckpoints(int steps)
+{
+    int checkpoints = 1;
+    while (ReversibleSteps(checkpoints, checkpoints, steps) < steps)
+    {
+        checkpoints++;
+    }
+    return checkpoints;
+}
+
+// when reversing the given steps from a stored state, with free checkpoints for the states after it,
+// the number of steps to evolve forward before storing the next one
+// the steps after it are then reversed with one fewer checkpoint, and the steps before it with the same number,
+// which balances the two so that no step is evolved more times than necessary
+inline int CheckpointSplit(int steps, int free)
+{
+    // the fewest repeats r with C(free+r, r) >= steps
+    int repeats = 1;
+    long long reversible = free + 1;
+    while (reversible < steps)
+    {
+        reversible = reversible*(free + repeats + 1)/(repeats + 1);
+        repeats++;
+    }
+
+    // C(free-1+r, r)
+    long long after = reversible*free/(free + repeats);
+    return steps - static_cast<int>(std::min<long long>(after, steps-1));
+}
@@ -20,10 +20,19 @@
     #define f3_cleanup_threads      fftw_cleanup_threads
     #define f3_r2r_kind             fftw_r2r_kind
     #define f3_execute              fftw_execute
+    #define f3_execute_dft_r2c      fftw_execute_dft_r2c
+    #define f3_execute_dft_c2r      fftw_execute_dft_c2r
+    #define f3_execute_dft          fftw_execute_dft
+    #define f3_import_wisdom_from_filename fftw_import_wisdom_from_filename
+    #define f3_export_wisdom_to_filename   fftw_export_wisdom_to_filename
     #define f3_destroy_plan         fftw_destroy_plan
     #define f3_plan_many_r2r        fftw_plan_many_r2r
     #define f3_plan_many_dft_r2c    fftw_plan_many_dft_r2c
     #define f3_plan_many_dft_c2r    fftw_plan_many_dft_c2r
+    #define f3_plan_guru_dft        fftw_plan_guru_dft
+    #define f3_plan_guru_dft_r2c    fftw_plan_guru_dft_r2c
+    #define f3_plan_guru_dft_c2r    fftw_plan_guru_dft_c2r
+    #define f3_iodim                fftw_iodim
     #define f3_plan_r2r_1d          fftw_plan_r2r_1d
     #define f3_plan_dft_1d          fftw_plan_dft_1d
     #define f3_plan_dft_r2c_3d      fftw_plan_dft_r2c_3d
@@ -48,10 +57,19 @@
     #define f3_cleanup_threads      fftwf_cleanup_threads
     #define f3_r2r_kind             fftwf_r2r_kind
     #define f3_execute              fftwf_execute
+    #define f3_execute_dft_r2c      fftwf_execute_dft_r2c
+    #define f3_execute_dft_c2r      fftwf_execute_dft_c2r
+    #define f3_execute_dft          fftwf_execute_dft
+    #define f3_import_wisdom_from_filename fftwf_import_wisdom_from_filename
+    #define f3_export_wisdom_to_filename   fftwf_export_wisdom_to_filename
     #define f3_destroy_plan         fftwf_destroy_plan
     #define f3_plan_many_r2r        fftwf_plan_many_r2r
     #define f3_plan_many_dft_r2c    fftwf_plan_many_dft_r2c
     #define f3_plan_many_dft_c2r    fftwf_plan_many_dft_c2r
+    #define f3_plan_guru_dft        fftwf_plan_guru_dft
+    #define f3_plan_guru_dft_r2c    fftwf_plan_guru_dft_r2c
+    #define f3_plan_guru_dft_c2r    fftwf_plan_guru_dft_c2r
+    #define f3_iodim                fftwf_iodim
     #define f3_plan_r2r_1d          fftwf_plan_r2r_1d
     #define f3_plan_dft_1d          fftwf_plan_dft_1d
     #define f3_plan_dft_r2c_3d      fftwf_plan_dft_r2c_3d
@@ -67,6 +85,21 @@ constexpr stratifloat phi = 1.61803398874989;
 // this number should be tweaked depending on the cache size of the processor
 constexpr int LoopBlockSize = 16;
 
+// number of vertical stacks solved together, one in each simd lane, so should be a multiple of the simd width
+// more than that also overlaps the latencies of the recurrences, so it can be tweaked depending on the processor's pipeline depth
+constexpr int TridiagonalBatch = 8;
+
+// the stacks are dealt out to MPI processes in blocks of this many in the 1st dimension
+// it should be a multiple of TridiagonalBatch, so that batches are never split between processes
+constexpr int StackBlockSize = TridiagonalBatch;
+
+// least number of stacks in each task when a loop is split into tasks within a task graph
+constexpr int TaskGrainSize = 16;
+
+// number of planes transformed by each task when an FFT is split into tasks within a task graph
+// it should be a multiple of 16, so that every task's data has the same alignment
+constexpr int FFTPlanesPerTask = 32;
+
 // this is a (hopefully) cache efficient loop for transposes
 #define for3D(n1,n2,n3) \
 for (int k3 = 0; k3 < n3; k3 += LoopBlockSize) { \
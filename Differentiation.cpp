@@ -4,9 +4,9 @@
 #include "Field.h"
 #include <iomanip>
 
-MatrixX VerticalSecondDerivativeMatrix(stratifloat L, int N, BoundaryCondition originalBC)
+BandedMatrix<stratifloat> VerticalSecondDerivativeMatrix(stratifloat L, int N, BoundaryCondition originalBC)
 {
-    MatrixX D = MatrixX::Zero(N,N);
+    BandedMatrix<stratifloat> D(N, 1, 1);
 
     ArrayX DY = dz(L,N);
     ArrayX DYF = dzFractional(L,N);
@@ -33,9 +33,9 @@ MatrixX VerticalSecondDerivativeMatrix(stratifloat L, int N, BoundaryCondition o
     return D;
 }
 
-MatrixX VerticalDerivativeMatrix(stratifloat L, int N, BoundaryCondition originalBC)
+BandedMatrix<stratifloat> VerticalDerivativeMatrix(stratifloat L, int N, BoundaryCondition originalBC)
 {
-    MatrixX D = MatrixX::Zero(N,N);
+    BandedMatrix<stratifloat> D(N, 1, 1);
 
     ArrayX DY = dz(L,N);
     ArrayX DYF = dzFractional(L,N);
@@ -53,19 +53,22 @@ MatrixX VerticalDerivativeMatrix(stratifloat L, int N, BoundaryCondition origina
         for (int j=1; j<=N-1; j++)
         {
             D(j,j) = -1/DYF(j);
-            D(j,j+1) = 1/DYF(j);
+            if (j<N-1)
+            {
+                D(j,j+1) = 1/DYF(j);
+            }
         }
     }
 
     return D;
 }
 
-MatrixX NeumannReinterpolationFull(stratifloat L, int N)
+BandedMatrix<stratifloat> NeumannReinterpolationFull(stratifloat L, int N)
 {
     ArrayX diff = dz(L,N);
     ArrayX diffFrac = dzFractional(L,N);
 
-    MatrixX D = MatrixX::Zero(N,N);
+    BandedMatrix<stratifloat> D(N, 1, 1);
 
     // 2nd order interpolation
     D.diagonal(-1)          = diffFrac.tail(N-1)/(2*diff.tail(N-1));
@@ -74,9 +77,9 @@ MatrixX NeumannReinterpolationFull(stratifloat L, int N)
     return D;
 }
 
-MatrixX NeumannReinterpolationBar(stratifloat L, int N)
+BandedMatrix<stratifloat> NeumannReinterpolationBar(stratifloat L, int N)
 {
-    MatrixX D = MatrixX::Zero(N,N);
+    BandedMatrix<stratifloat> D(N, 1, 1);
 
     // quasi 2nd order interpolation
     D.diagonal(-1).setConstant(0.5);
@@ -85,12 +88,12 @@ MatrixX NeumannReinterpolationBar(stratifloat L, int N)
     return D;
 }
 
-MatrixX NeumannReinterpolationTilde(stratifloat L, int N)
+BandedMatrix<stratifloat> NeumannReinterpolationTilde(stratifloat L, int N)
 {
     ArrayX diff = dz(L,N);
     ArrayX diffFrac = dzFractional(L,N);
 
-    MatrixX D = MatrixX::Zero(N,N);
+    BandedMatrix<stratifloat> D(N, 1, 1);
 
     // quasi 2nd order interpolation
     D.diagonal(-1)          = diffFrac.head(N-1)/(2*diff.tail(N-1));
@@ -99,9 +102,9 @@ MatrixX NeumannReinterpolationTilde(stratifloat L, int N)
     return D;
 }
 
-MatrixX DirichletReinterpolation(stratifloat L, int N)
+BandedMatrix<stratifloat> DirichletReinterpolation(stratifloat L, int N)
 {
-    MatrixX D = MatrixX::Zero(N,N);
+    BandedMatrix<stratifloat> D(N, 1, 1);
 
     // 2nd order interpolation
     D.diagonal(0).setConstant(0.5);
@@ -2,14 +2,16 @@
 
 #include "Eigen.h"
 #include "Constants.h"
+#include "BandedMatrix.h"
 
 // Computes a finite difference matrix for use with nodal forms
-MatrixX VerticalSecondDerivativeMatrix(stratifloat L, int N, BoundaryCondition originalBC);
-MatrixX VerticalDerivativeMatrix(stratifloat L, int N, BoundaryCondition originalBC);
-MatrixX NeumannReinterpolationFull(stratifloat L, int N);
-MatrixX NeumannReinterpolationBar(stratifloat L, int N);
-MatrixX NeumannReinterpolationTilde(stratifloat L, int N);
-MatrixX DirichletReinterpolation(stratifloat L, int N);
+// these are all at most tridiagonal, so are stored as such
+BandedMatrix<stratifloat> VerticalSecondDerivativeMatrix(stratifloat L, int N, BoundaryCondition originalBC);
+BandedMatrix<stratifloat> VerticalDerivativeMatrix(stratifloat L, int N, BoundaryCondition originalBC);
+BandedMatrix<stratifloat> NeumannReinterpolationFull(stratifloat L, int N);
+BandedMatrix<stratifloat> NeumannReinterpolationBar(stratifloat L, int N);
+BandedMatrix<stratifloat> NeumannReinterpolationTilde(stratifloat L, int N);
+BandedMatrix<stratifloat> DirichletReinterpolation(stratifloat L, int N);
 
 DiagonalMatrix<stratifloat, -1> FourierSecondDerivativeMatrix(stratifloat L, int N, int dimension);
 DiagonalMatrix<complex, -1> FourierDerivativeMatrix(stratifloat L, int N, int dimension);
@@ -34,6 +36,26 @@ void Neumannify(M& matrix)
     matrix.coeffRef(N3-1, N3-1) = 1;
 }
 
+// the boundary rows only involve the nearest neighbours, so are entirely within the band
+template<typename T>
+void Neumannify(BandedMatrix<T>& matrix)
+{
+    int N3 = matrix.rows();
+
+    matrix.ZeroRow(0);
+    matrix.ZeroRow(1);
+    matrix.ZeroRow(N3-2);
+    matrix.ZeroRow(N3-1);
+
+    matrix(0,0) = 1;
+    matrix(1,1) = 1;
+    matrix(1,2) = -1;
+
+    matrix(N3-2, N3-3) = 1;
+    matrix(N3-2, N3-2) = -1;
+    matrix(N3-1, N3-1) = 1;
+}
+
 template<typename M>
 void Dirichlify(M& matrix)
 {
@@ -57,3 +79,15 @@ void Dirichlify(M& matrix)
     matrix.coeffRef(N3-2, N3-3) = 0;
     matrix.coeffRef(N3-2, N3-4) = 0;
 }
+
+template<typename T>
+void Dirichlify(BandedMatrix<T>& matrix)
+{
+    int N3 = matrix.rows();
+
+    for (int j : {0, 1, 2, N3-2, N3-1})
+    {
+        matrix.ZeroRow(j);
+        matrix(j,j) = 1;
+    }
+}
@@ -0,0 +1,547 @@
+#include "Distributed.h"
+#include "Parameters.h"
+#include "Profiling.h"
+
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+#include <cassert>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace
+{
+int processRank = 0;
+int processCount = 1;
+
+int gridSize[2] = {1, 1};
+
+// the processes which transpose to and from rows, which have the same stacks in the 2nd dimension,
+// and likewise columns, which have the same stacks in the 1st
+enum class ProcessGroup
+{
+    Rows,
+    Columns
+};
+
+#ifdef USE_MPI
+MPI_Comm rowsGroup = MPI_COMM_SELF;
+MPI_Comm columnsGroup = MPI_COMM_SELF;
+
+MPI_Datatype StratifloatType()
+{
+    return sizeof(stratifloat) == sizeof(double) ? MPI_DOUBLE : MPI_FLOAT;
+}
+#endif
+
+std::vector<int> Offsets(const std::vector<std::size_t>& counts)
+{
+    std::vector<int> offsets(counts.size()+1, 0);
+    for (unsigned int n=0; n<counts.size(); n++)
+    {
+        assert(offsets[n] + counts[n] <= INT_MAX);
+        offsets[n+1] = offsets[n] + counts[n];
+    }
+    return offsets;
+}
+
+#ifdef USE_MPI
+// sends sendCounts[q] bytes to each process q of the group, which are stored one after the other in the send buffer,
+// and likewise receives receiveCounts[q] bytes from each into the receive buffer
+void AllToAll(ProcessGroup group, TransposeBuffers& buffers,
+              const std::vector<std::size_t>& sendCounts, const std::vector<std::size_t>& receiveCounts)
+{
+    std::vector<int> sendOffsets = Offsets(sendCounts);
+    std::vector<int> receiveOffsets = Offsets(receiveCounts);
+    std::vector<int> sendSizes(sendCounts.begin(), sendCounts.end());
+    std::vector<int> receiveSizes(receiveCounts.begin(), receiveCounts.end());
+
+    MPI_Alltoallv(buffers.send.data(), sendSizes.data(), sendOffsets.data(), MPI_BYTE,
+                  buffers.receive.data(), receiveSizes.data(), receiveOffsets.data(), MPI_BYTE,
+                  group == ProcessGroup::Rows ? rowsGroup : columnsGroup);
+}
+#else
+// without MPI there is only one process, which sends everything to itself
+void AllToAll(ProcessGroup /*group*/, TransposeBuffers& buffers,
+              const std::vector<std::size_t>& sendCounts, const std::vector<std::size_t>& /*receiveCounts*/)
+{
+    std::memcpy(buffers.receive.data(), buffers.send.data(), sendCounts[0]);
+}
+#endif
+}
+
+#ifdef USE_MPI
+namespace
+{
+// splitting only the 1st dimension needs half the transposes, so that goes as far as there are blocks
+// of the dealiased stacks to go round, and the rest of the processes split the 2nd
+void ChooseProcessGrid()
+{
+    gridSize[0] = processCount;
+    gridSize[1] = 1;
+
+    if (const char* fromEnvironment = std::getenv("STRATIFLOW_PROCESS_GRID"))
+    {
+        int size1 = 0;
+        int size2 = 0;
+        if (std::sscanf(fromEnvironment, "%dx%d", &size1, &size2) == 2 && size1 > 0 && size2 > 0 && size1*size2 == processCount)
+        {
+            gridSize[0] = size1;
+            gridSize[1] = size2;
+            return;
+        }
+
+        if (processRank == 0)
+        {
+            fprintf(stderr, "STRATIFLOW_PROCESS_GRID=%s isn't a grid of the %d processes, so it is chosen instead\n",
+                    fromEnvironment, processCount);
+        }
+    }
+
+    // there is nothing to split in the 2nd dimension of a 2D grid
+    if (gridParams.N2 == 1)
+    {
+        return;
+    }
+
+    int blocks = (gridParams.N1/3 + StackBlockSize - 1)/StackBlockSize;
+    while (gridSize[0] > 1 && (gridSize[0] > blocks || processCount%gridSize[0] != 0))
+    {
+        gridSize[0]--;
+    }
+    gridSize[1] = processCount/gridSize[0];
+}
+}
+
+void InitialiseProcesses()
+{
+    int initialised;
+    MPI_Initialized(&initialised);
+    if (!initialised)
+    {
+        // only the main thread makes mpi calls, between the parallel regions
+        int provided;
+        MPI_Init_thread(nullptr, nullptr, MPI_THREAD_FUNNELED, &provided);
+    }
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &processRank);
+    MPI_Comm_size(MPI_COMM_WORLD, &processCount);
+
+    ChooseProcessGrid();
+    MPI_Comm_split(MPI_COMM_WORLD, ProcessGridIndex(2), ProcessGridIndex(1), &rowsGroup);
+    MPI_Comm_split(MPI_COMM_WORLD, ProcessGridIndex(1), ProcessGridIndex(2), &columnsGroup);
+}
+
+void FinaliseProcesses()
+{
+    int finalised;
+    MPI_Finalized(&finalised);
+    if (!finalised)
+    {
+        MPI_Comm_free(&rowsGroup);
+        MPI_Comm_free(&columnsGroup);
+        MPI_Finalize();
+    }
+}
+#else
+void InitialiseProcesses()
+{
+}
+
+void FinaliseProcesses()
+{
+}
+#endif
+
+int ProcessRank()
+{
+    return processRank;
+}
+
+int ProcessCount()
+{
+    return processCount;
+}
+
+int ProcessGridSize(int dimension)
+{
+    assert(dimension == 1 || dimension == 2);
+    return gridSize[dimension-1];
+}
+
+int ProcessGridIndex(int dimension, int rank)
+{
+    assert(dimension == 1 || dimension == 2);
+    return dimension == 1 ? rank%gridSize[0] : rank/gridSize[0];
+}
+
+int StackOwner(int j1, int j2)
+{
+    return (j2%gridSize[1])*gridSize[0] + (j1/StackBlockSize)%gridSize[0];
+}
+
+IndexRange OwnedPlanes(int n3, int part, int parts)
+{
+    IndexRange range;
+    range.begin = static_cast<long>(n3)*part/parts;
+    range.end = static_cast<long>(n3)*(part+1)/parts;
+    return range;
+}
+
+void StacksToRows(const void* stacks, void* rows, std::size_t elementSize, int n1, int width, int n2, int n3, TransposeBuffers& buffers)
+{
+    PROFILE(Transpose);
+
+    const char* from = static_cast<const char*>(stacks);
+    char* to = static_cast<char*>(rows);
+
+    int parts = ProcessGridSize(1);
+    OwnedStacks ours(n1);
+    OwnedRows ourRows(n2, n2, n2);
+    IndexRange ourPlanes = OwnedPlanes(n3, ProcessGridIndex(1), parts);
+
+    std::vector<std::size_t> sendCounts(parts);
+    std::vector<std::size_t> receiveCounts(parts);
+    for (int q=0; q<parts; q++)
+    {
+        sendCounts[q] = elementSize*ourRows.Count()*ours.Count()*OwnedPlanes(n3, q, parts).Size();
+        receiveCounts[q] = elementSize*ourRows.Count()*OwnedStacks(n1, q, parts).Count()*ourPlanes.Size();
+    }
+
+    std::vector<int> sendOffsets = Offsets(sendCounts);
+    std::vector<int> receiveOffsets = Offsets(receiveCounts);
+    buffers.send.resize(sendOffsets.back());
+    buffers.receive.resize(receiveOffsets.back());
+
+    // for each process, the parts of our stacks which lie in its planes
+    #pragma omp parallel for collapse(2)
+    for (int q=0; q<parts; q++)
+    {
+        for (int row=0; row<ourRows.Count(); row++)
+        {
+            IndexRange theirPlanes = OwnedPlanes(n3, q, parts);
+            std::size_t length = elementSize*theirPlanes.Size();
+
+            char* packed = buffers.send.data() + sendOffsets[q] + length*ours.Count()*row;
+            for (int n=0; n<ours.Count(); n++)
+            {
+                std::size_t stackStart = elementSize*(static_cast<std::size_t>(ours.Count()*row + n)*n3 + theirPlanes.begin);
+                std::memcpy(packed + length*n, from + stackStart, length);
+            }
+        }
+    }
+
+    AllToAll(ProcessGroup::Rows, buffers, sendCounts, receiveCounts);
+
+    std::size_t length = elementSize*ourPlanes.Size();
+
+    #pragma omp parallel for collapse(2)
+    for (int r=0; r<parts; r++)
+    {
+        for (int row=0; row<ourRows.Count(); row++)
+        {
+            OwnedStacks theirs(n1, r, parts);
+
+            const char* packed = buffers.receive.data() + receiveOffsets[r] + length*theirs.Count()*row;
+            for (int n=0; n<theirs.Count(); n++)
+            {
+                std::memcpy(to + length*(static_cast<std::size_t>(width)*row + theirs[n]), packed + length*n, length);
+            }
+        }
+    }
+
+    // no process has the rest of the row
+    if (width > n1)
+    {
+        #pragma omp parallel for
+        for (int row=0; row<ourRows.Count(); row++)
+        {
+            std::memset(to + length*(static_cast<std::size_t>(width)*row + n1), 0, length*(width - n1));
+        }
+    }
+}
+
+void RowsToStacks(const void* rows, void* stacks, std::size_t elementSize, int n1, int width, int n2, int n3, TransposeBuffers& buffers)
+{
+    PROFILE(Transpose);
+
+    const char* from = static_cast<const char*>(rows);
+    char* to = static_cast<char*>(stacks);
+
+    int parts = ProcessGridSize(1);
+    OwnedStacks ours(n1);
+    OwnedRows ourRows(n2, n2, n2);
+    IndexRange ourPlanes = OwnedPlanes(n3, ProcessGridIndex(1), parts);
+
+    std::vector<std::size_t> sendCounts(parts);
+    std::vector<std::size_t> receiveCounts(parts);
+    for (int q=0; q<parts; q++)
+    {
+        sendCounts[q] = elementSize*ourRows.Count()*OwnedStacks(n1, q, parts).Count()*ourPlanes.Size();
+        receiveCounts[q] = elementSize*ourRows.Count()*ours.Count()*OwnedPlanes(n3, q, parts).Size();
+    }
+
+    std::vector<int> sendOffsets = Offsets(sendCounts);
+    std::vector<int> receiveOffsets = Offsets(receiveCounts);
+    buffers.send.resize(sendOffsets.back());
+    buffers.receive.resize(receiveOffsets.back());
+
+    std::size_t length = elementSize*ourPlanes.Size();
+
+    // for each process, the parts of our rows which lie in its stacks
+    #pragma omp parallel for collapse(2)
+    for (int q=0; q<parts; q++)
+    {
+        for (int row=0; row<ourRows.Count(); row++)
+        {
+            OwnedStacks theirs(n1, q, parts);
+
+            char* packed = buffers.send.data() + sendOffsets[q] + length*theirs.Count()*row;
+            for (int n=0; n<theirs.Count(); n++)
+            {
+                std::memcpy(packed + length*n, from + length*(static_cast<std::size_t>(width)*row + theirs[n]), length);
+            }
+        }
+    }
+
+    AllToAll(ProcessGroup::Rows, buffers, sendCounts, receiveCounts);
+
+    #pragma omp parallel for collapse(2)
+    for (int r=0; r<parts; r++)
+    {
+        for (int row=0; row<ourRows.Count(); row++)
+        {
+            IndexRange theirPlanes = OwnedPlanes(n3, r, parts);
+            std::size_t theirLength = elementSize*theirPlanes.Size();
+
+            const char* packed = buffers.receive.data() + receiveOffsets[r] + theirLength*ours.Count()*row;
+            for (int n=0; n<ours.Count(); n++)
+            {
+                std::size_t stackStart = elementSize*(static_cast<std::size_t>(ours.Count()*row + n)*n3 + theirPlanes.begin);
+                std::memcpy(to + stackStart, packed + theirLength*n, theirLength);
+            }
+        }
+    }
+}
+
+void StacksToColumns(const void* stacks, void* columns, std::size_t elementSize, int n1, int n2, int n3, TransposeBuffers& buffers)
+{
+    PROFILE(Transpose);
+
+    const char* from = static_cast<const char*>(stacks);
+    char* to = static_cast<char*>(columns);
+
+    int parts = ProcessGridSize(2);
+    OwnedStacks ours(n1);
+    OwnedRows ourRows(n2, n2, n2);
+    IndexRange ourPlanes = OwnedPlanes(n3, ProcessGridIndex(2), parts);
+
+    std::vector<std::size_t> sendCounts(parts);
+    std::vector<std::size_t> receiveCounts(parts);
+    for (int q=0; q<parts; q++)
+    {
+        sendCounts[q] = elementSize*ourRows.Count()*ours.Count()*OwnedPlanes(n3, q, parts).Size();
+        receiveCounts[q] = elementSize*OwnedRows(n2, n2, n2, q, parts).Count()*ours.Count()*ourPlanes.Size();
+    }
+
+    std::vector<int> sendOffsets = Offsets(sendCounts);
+    std::vector<int> receiveOffsets = Offsets(receiveCounts);
+    buffers.send.resize(sendOffsets.back());
+    buffers.receive.resize(receiveOffsets.back());
+
+    // for each process, the parts of our stacks which lie in its planes
+    #pragma omp parallel for collapse(2)
+    for (int q=0; q<parts; q++)
+    {
+        for (int row=0; row<ourRows.Count(); row++)
+        {
+            IndexRange theirPlanes = OwnedPlanes(n3, q, parts);
+            std::size_t length = elementSize*theirPlanes.Size();
+
+            char* packed = buffers.send.data() + sendOffsets[q] + length*ours.Count()*row;
+            for (int n=0; n<ours.Count(); n++)
+            {
+                std::size_t stackStart = elementSize*(static_cast<std::size_t>(ours.Count()*row + n)*n3 + theirPlanes.begin);
+                std::memcpy(packed + length*n, from + stackStart, length);
+            }
+        }
+    }
+
+    AllToAll(ProcessGroup::Columns, buffers, sendCounts, receiveCounts);
+
+    std::size_t length = elementSize*ourPlanes.Size();
+
+    #pragma omp parallel for
+    for (int r=0; r<parts; r++)
+    {
+        OwnedRows theirRows(n2, n2, n2, r, parts);
+        for (int row=0; row<theirRows.Count(); row++)
+        {
+            const char* packed = buffers.receive.data() + receiveOffsets[r] + length*ours.Count()*row;
+            std::memcpy(to + length*(static_cast<std::size_t>(ours.Count())*theirRows[row]), packed, length*ours.Count());
+        }
+    }
+}
+
+void ColumnsToStacks(const void* columns, void* stacks, std::size_t elementSize, int n1, int n2, int n3, TransposeBuffers& buffers)
+{
+    PROFILE(Transpose);
+
+    const char* from = static_cast<const char*>(columns);
+    char* to = static_cast<char*>(stacks);
+
+    int parts = ProcessGridSize(2);
+    OwnedStacks ours(n1);
+    OwnedRows ourRows(n2, n2, n2);
+    IndexRange ourPlanes = OwnedPlanes(n3, ProcessGridIndex(2), parts);
+
+    std::vector<std::size_t> sendCounts(parts);
+    std::vector<std::size_t> receiveCounts(parts);
+    for (int q=0; q<parts; q++)
+    {
+        sendCounts[q] = elementSize*OwnedRows(n2, n2, n2, q, parts).Count()*ours.Count()*ourPlanes.Size();
+        receiveCounts[q] = elementSize*ourRows.Count()*ours.Count()*OwnedPlanes(n3, q, parts).Size();
+    }
+
+    std::vector<int> sendOffsets = Offsets(sendCounts);
+    std::vector<int> receiveOffsets = Offsets(receiveCounts);
+    buffers.send.resize(sendOffsets.back());
+    buffers.receive.resize(receiveOffsets.back());
+
+    std::size_t length = elementSize*ourPlanes.Size();
+
+    // for each process, the parts of our columns which lie in its stacks
+    #pragma omp parallel for
+    for (int q=0; q<parts; q++)
+    {
+        OwnedRows theirRows(n2, n2, n2, q, parts);
+        for (int row=0; row<theirRows.Count(); row++)
+        {
+            char* packed = buffers.send.data() + sendOffsets[q] + length*ours.Count()*row;
+            std::memcpy(packed, from + length*(static_cast<std::size_t>(ours.Count())*theirRows[row]), length*ours.Count());
+        }
+    }
+
+    AllToAll(ProcessGroup::Columns, buffers, sendCounts, receiveCounts);
+
+    #pragma omp parallel for collapse(2)
+    for (int r=0; r<parts; r++)
+    {
+        for (int row=0; row<ourRows.Count(); row++)
+        {
+            IndexRange theirPlanes = OwnedPlanes(n3, r, parts);
+            std::size_t theirLength = elementSize*theirPlanes.Size();
+
+            const char* packed = buffers.receive.data() + receiveOffsets[r] + theirLength*ours.Count()*row;
+            for (int n=0; n<ours.Count(); n++)
+            {
+                std::size_t stackStart = elementSize*(static_cast<std::size_t>(ours.Count()*row + n)*n3 + theirPlanes.begin);
+                std::memcpy(to + stackStart, packed + theirLength*n, theirLength);
+            }
+        }
+    }
+}
+
+void GatherStacks(const void* stacks, void* whole, std::size_t stackSize, int n1, int width, int n2Low, int n2High, int n2)
+{
+    PROFILE(Transpose);
+
+    std::vector<std::size_t> counts(processCount);
+    for (int r=0; r<processCount; r++)
+    {
+        OwnedStacks theirs(n1, ProcessGridIndex(1, r), ProcessGridSize(1));
+        OwnedRows theirRows(n2Low, n2High, n2, ProcessGridIndex(2, r), ProcessGridSize(2));
+        counts[r] = stackSize*theirs.Count()*theirRows.Count();
+    }
+    std::vector<int> offsets = Offsets(counts);
+
+    std::vector<char> received;
+    const char* from = static_cast<const char*>(stacks);
+
+#ifdef USE_MPI
+    if (processRank == 0)
+    {
+        received.resize(offsets.back());
+    }
+
+    std::vector<int> sizes(counts.begin(), counts.end());
+    MPI_Gatherv(stacks, sizes[processRank], MPI_BYTE,
+                received.data(), sizes.data(), offsets.data(), MPI_BYTE,
+                0, MPI_COMM_WORLD);
+    from = received.data();
+#endif
+
+    if (processRank != 0)
+    {
+        return;
+    }
+
+    char* to = static_cast<char*>(whole);
+    std::memset(to, 0, stackSize*width*n2);
+
+    for (int r=0; r<processCount; r++)
+    {
+        OwnedStacks theirs(n1, ProcessGridIndex(1, r), ProcessGridSize(1));
+        OwnedRows theirRows(n2Low, n2High, n2, ProcessGridIndex(2, r), ProcessGridSize(2));
+        for (int row=0; row<theirRows.Count(); row++)
+        {
+            for (int n=0; n<theirs.Count(); n++)
+            {
+                std::memcpy(to + stackSize*(static_cast<std::size_t>(width)*theirRows[row] + theirs[n]),
+                            from + offsets[r] + stackSize*(static_cast<std::size_t>(theirs.Count())*row + n),
+                            stackSize);
+            }
+        }
+    }
+}
+
+stratifloat SumOverProcesses(stratifloat value)
+{
+    SumOverProcesses(&value, 1);
+    return value;
+}
+
+#ifdef USE_MPI
+void SumOverProcesses(stratifloat* values, int count)
+{
+    if (IsDistributed())
+    {
+        MPI_Allreduce(MPI_IN_PLACE, values, count, StratifloatType(), MPI_SUM, MPI_COMM_WORLD);
+    }
+}
+
+stratifloat MaxOverProcesses(stratifloat value)
+{
+    if (IsDistributed())
+    {
+        MPI_Allreduce(MPI_IN_PLACE, &value, 1, StratifloatType(), MPI_MAX, MPI_COMM_WORLD);
+    }
+    return value;
+}
+
+void ShareFromProcess(stratifloat* values, int count, int rank)
+{
+    if (IsDistributed())
+    {
+        MPI_Bcast(values, count, StratifloatType(), rank, MPI_COMM_WORLD);
+    }
+}
+#else
+// with only one process, these have nothing to do
+void SumOverProcesses(stratifloat* /*values*/, int /*count*/)
+{
+}
+
+stratifloat MaxOverProcesses(stratifloat value)
+{
+    return value;
+}
+
+void ShareFromProcess(stratifloat* /*values*/, int /*count*/, int /*rank*/)
+{
+}
+#endif
@@ -0,0 +1,227 @@
+#pragma once
+
+#include "Constants.h"
+
+#include <cstddef>
+#include <vector>
+
+// When built with MPI, the work on each field is split between processes
+//
+// The processes are arranged in a grid of ProcessGridSize(1) by ProcessGridSize(2).
+// For everything done stack by stack (the products in physical space, the vertical derivatives and
+// the tridiagonal solves) each process owns whole stacks. In the 1st dimension they are dealt out between the
+// ProcessGridSize(1) processes in blocks of StackBlockSize, cyclically, so that the processes stay balanced when only
+// the low wavenumbers are active, and in the 2nd dimension one at a time between the ProcessGridSize(2) processes.
+// Each process only stores its own stacks (see Field), one after another in j1, then in j2.
+//
+// The horizontal FFTs need whole rows and columns instead, so PerformR2C and PerformC2R transpose the data
+// into pencils, which each have whole rows (or columns) and a range of the planes, transform those, and then transpose back.
+// If the grid is only one process wide in the 2nd dimension, each process's stacks already make up whole columns,
+// so these are slabs, with a range of whole planes each.
+
+void InitialiseProcesses();
+void FinaliseProcesses();
+
+int ProcessRank();
+int ProcessCount();
+
+inline bool IsDistributed()
+{
+    return ProcessCount() > 1;
+}
+
+// the size of the grid in the given dimension (1 or 2), which is set by STRATIFLOW_PROCESS_GRID (for example "4x2"),
+// and otherwise splits the stacks in the 1st dimension as far as there are blocks of the dealiased stacks to go round
+int ProcessGridSize(int dimension);
+
+// where a process is in the grid in the given dimension
+int ProcessGridIndex(int dimension, int rank = ProcessRank());
+
+// the stacks with j1 < n1 which a process owns, in increasing order of j1
+class OwnedStacks
+{
+public:
+    OwnedStacks(int n1, int part = ProcessGridIndex(1), int parts = ProcessGridSize(1))
+    : n1(n1)
+    , part(part)
+    , parts(parts)
+    {
+        int blocks = (n1 + StackBlockSize - 1)/StackBlockSize;
+        int ownedBlocks = blocks > part ? (blocks - part + parts - 1)/parts : 0;
+
+        count = ownedBlocks*StackBlockSize;
+
+        // the last block may be partial
+        if (blocks > 0 && (blocks-1)%parts == part)
+        {
+            count -= blocks*StackBlockSize - n1;
+        }
+    }
+
+    int Count() const
+    {
+        return count;
+    }
+
+    // j1 of the nth of these stacks
+    int operator[](int n) const
+    {
+        return ((n/StackBlockSize)*parts + part)*StackBlockSize + n%StackBlockSize;
+    }
+
+    // which of these stacks j1 is, or -1 if it isn't one of them
+    int Index(int j1) const
+    {
+        if (j1 >= n1)
+        {
+            return -1;
+        }
+
+        if (parts == 1)
+        {
+            return j1;
+        }
+
+        int block = j1/StackBlockSize;
+        if (block%parts != part)
+        {
+            return -1;
+        }
+
+        return (block/parts)*StackBlockSize + j1%StackBlockSize;
+    }
+
+private:
+    int n1;
+    int part;
+    int parts;
+    int count;
+};
+
+// the values of j2 < n2Low or >= n2High, out of n2, which a process owns, in increasing order
+class OwnedRows
+{
+public:
+    OwnedRows(int n2Low, int n2High, int n2, int part = ProcessGridIndex(2), int parts = ProcessGridSize(2))
+    : n2Low(n2Low)
+    , n2High(n2High)
+    , part(part)
+    , parts(parts)
+    , low(OwnedBelow(n2Low))
+    , count(low + OwnedBelow(n2) - OwnedBelow(n2High))
+    {
+    }
+
+    int Count() const
+    {
+        return count;
+    }
+
+    // j2 of the nth of these rows
+    int operator[](int n) const
+    {
+        if (n < low)
+        {
+            return n*parts + part;
+        }
+
+        int firstHigh = n2High + ((part - n2High%parts) + parts)%parts;
+        return firstHigh + (n - low)*parts;
+    }
+
+    // which of these rows j2 is, or -1 if it isn't one of them
+    int Index(int j2) const
+    {
+        if (j2 >= n2Low && j2 < n2High)
+        {
+            return -1;
+        }
+
+        if (parts == 1)
+        {
+            return j2 < n2Low ? j2 : j2 - (n2High - n2Low);
+        }
+
+        if (j2%parts != part)
+        {
+            return -1;
+        }
+
+        return j2 < n2Low ? j2/parts : low + OwnedBelow(j2) - OwnedBelow(n2High);
+    }
+
+private:
+    // how many of j2 < end are owned
+    int OwnedBelow(int end) const
+    {
+        return end > part ? (end - part + parts - 1)/parts : 0;
+    }
+
+    int n2Low;
+    int n2High;
+    int part;
+    int parts;
+    int low;
+    int count;
+};
+
+// which of this process's stacks j1 < n1 of every j2 < n2 stack (j1, j2) is, which must be one of them,
+// so that it is at StackIndex(j1, j2, n1, n2)*n3 in an array of them, as the transforms have (which is (n1*j2 + j1)*n3 if not distributed)
+inline std::size_t StackIndex(int j1, int j2, int n1, int n2)
+{
+    OwnedStacks stacks(n1);
+    OwnedRows rows(n2, n2, n2);
+    return static_cast<std::size_t>(stacks.Count())*rows.Index(j2) + stacks.Index(j1);
+}
+
+// the process which owns stack (j1, j2)
+int StackOwner(int j1, int j2);
+
+struct IndexRange
+{
+    int begin;
+    int end;
+
+    int Size() const
+    {
+        return end - begin;
+    }
+};
+
+// the planes (or slices of any other index) which the given one of parts processes transforms
+IndexRange OwnedPlanes(int n3, int part, int parts);
+
+// the buffers which a transpose packs what it sends into, and receives into
+// these belong to whoever transposes, as for the rest of a transform's scratch space
+struct TransposeBuffers
+{
+    std::vector<char> send;
+    std::vector<char> receive;
+};
+
+// these move data between stacks, laid out as in Field with this process's stacks j1 < n1 of every j2 < n2,
+// each of n3 values of elementSize bytes, and pencils with whole rows or columns and only some of the planes
+//
+// rows are whole in the 1st dimension, and split the planes between the processes which have the same stacks in the 2nd,
+// laid out with OwnedPlanes(n3, ProcessGridIndex(1), ProcessGridSize(1)).Size() planes contiguous, then j1 < width, then j2
+// (StacksToRows fills in zeros for n1 <= j1 < width, and RowsToStacks only sends back j1 < n1)
+void StacksToRows(const void* stacks, void* rows, std::size_t elementSize, int n1, int width, int n2, int n3, TransposeBuffers& buffers);
+void RowsToStacks(const void* rows, void* stacks, std::size_t elementSize, int n1, int width, int n2, int n3, TransposeBuffers& buffers);
+
+// columns are whole in the 2nd dimension, and split the planes between the processes which have the same stacks in the 1st,
+// laid out with OwnedPlanes(n3, ProcessGridIndex(2), ProcessGridSize(2)).Size() planes contiguous,
+// then this process's j1 < n1, then j2
+void StacksToColumns(const void* stacks, void* columns, std::size_t elementSize, int n1, int n2, int n3, TransposeBuffers& buffers);
+void ColumnsToStacks(const void* columns, void* stacks, std::size_t elementSize, int n1, int n2, int n3, TransposeBuffers& buffers);
+
+// copies every process's stacks, which are j1 < n1, and j2 < n2Low or j2 >= n2High, each of stackSize bytes,
+// given one after another as they are stored, into whole, which is every stack of width by n2, with the others zero
+// only the first process is given the whole field, and whole isn't used on the others
+void GatherStacks(const void* stacks, void* whole, std::size_t stackSize, int n1, int width, int n2Low, int n2High, int n2);
+
+stratifloat SumOverProcesses(stratifloat value);
+void SumOverProcesses(stratifloat* values, int count);
+stratifloat MaxOverProcesses(stratifloat value);
+
+// copies values from the given process to all the others
+void ShareFromProcess(stratifloat* values, int count, int rank);
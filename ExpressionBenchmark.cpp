@@ -0,0 +1,200 @@
+#include "Stratiflow.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+// Compares the compile-time expression templates in Field.h against the
+// virtual dispatch they replaced, by evaluating R1 = u1 + h*r1 + (-h)*ddx(p)
+
+namespace virtualdispatch
+{
+// a copy of the old design: each node hides its children behind a virtual stack()
+// and fields visit their stacks through a std::function
+template<typename A>
+class StackContainer
+{
+public:
+    virtual A stack(int n1, int n2) const = 0;
+};
+
+using ConstStack = Map<const Array<complex, -1, 1>, Aligned16>;
+
+class FieldNode : public StackContainer<ConstStack>
+{
+public:
+    FieldNode(const NeumannModal& field)
+    : field(field)
+    {}
+
+    virtual ConstStack stack(int n1, int n2) const override
+    {
+        return field.stack(n1, n2);
+    }
+private:
+    const NeumannModal& field;
+};
+
+template<typename A>
+class ScalarProduct : public StackContainer<CwiseBinaryOp<internal::scalar_product_op<complex, complex>, const CwiseNullaryOp<internal::scalar_constant_op<complex>,const Array<complex, -1, 1>>, const A>>
+{
+public:
+    ScalarProduct(complex scalar, const StackContainer<A>* rhs)
+    : rhs(rhs)
+    , scalar(scalar)
+    {}
+
+    virtual
+        CwiseBinaryOp<internal::scalar_product_op<complex, complex>, const CwiseNullaryOp<internal::scalar_constant_op<complex>,const Array<complex, -1, 1>>, const A>
+        stack(int n1, int n2) const override
+    {
+        return scalar*rhs->stack(n1, n2);
+    }
+private:
+    const StackContainer<A>* rhs;
+    complex scalar;
+};
+
+template<typename A>
+class Dim1MatMul : public StackContainer<CwiseBinaryOp<internal::scalar_product_op<complex, complex>, const CwiseNullaryOp<internal::scalar_constant_op<complex>,const Array<complex, -1, 1>>, const A>>
+{
+public:
+    Dim1MatMul(const DiagonalMatrix<complex, -1>& matrix, const StackContainer<A>* field)
+    : field(field)
+    , matrix(matrix)
+    {}
+
+    virtual
+        CwiseBinaryOp<internal::scalar_product_op<complex, complex>, const CwiseNullaryOp<internal::scalar_constant_op<complex>,const Array<complex, -1, 1>>, const A>
+        stack(int n1, int n2) const override
+    {
+        return matrix.diagonal()(n1)*field->stack(n1, n2);
+    }
+private:
+    const StackContainer<A>* field;
+    const DiagonalMatrix<complex, -1>& matrix;
+};
+
+template<typename A, typename B>
+class ComponentwiseSum : public StackContainer<CwiseBinaryOp<internal::scalar_sum_op<complex, complex>, const A, const B>>
+{
+public:
+    ComponentwiseSum(const StackContainer<A>* lhs, const StackContainer<B>* rhs)
+    : lhs(lhs)
+    , rhs(rhs)
+    {}
+
+    virtual
+        CwiseBinaryOp<internal::scalar_sum_op<complex, complex>, const A, const B>
+        stack(int n1, int n2) const override
+    {
+        return lhs->stack(n1, n2) + rhs->stack(n1, n2);
+    }
+private:
+    const StackContainer<A>* lhs;
+    const StackContainer<B>* rhs;
+};
+
+void ParallelPerStack(std::function<void(int j1, int j2)> f)
+{
+    int maxN1 = gridParams.N1/3;
+    int maxN2 = gridParams.N2/3;
+    int minN2 = gridParams.N2-(gridParams.N2/3)+1;
+    bool filterSpanwise = gridParams.N2>1 && gridParams.dimensionality==Dimensionality::ThreeDimensional;
+
+    #pragma omp parallel for collapse(2)
+    for (int j2=0; j2<(filterSpanwise ? maxN2 : gridParams.N2); j2++)
+    {
+        for (int j1=0; j1<maxN1; j1++)
+        {
+            f(j1, j2);
+        }
+    }
+
+    if (filterSpanwise)
+    {
+        #pragma omp parallel for collapse(2)
+        for (int j2=minN2; j2<gridParams.N2; j2++)
+        {
+            for (int j1=0; j1<maxN1; j1++)
+            {
+                f(j1, j2);
+            }
+        }
+    }
+}
+
+void Evaluate(NeumannModal& R1, const NeumannModal& u1, const NeumannModal& r1, const NeumannModal& p, stratifloat h)
+{
+    static DiagonalMatrix<complex, -1> dim1Derivative = FourierDerivativeMatrix(flowParams.L1, gridParams.N1, 1);
+
+    FieldNode U1(u1), Rhs1(r1), P(p);
+    ScalarProduct<ConstStack> hr1(h, &Rhs1);
+    Dim1MatMul<ConstStack> dpdx(dim1Derivative, &P);
+    ScalarProduct<decltype(dpdx.stack(0, 0))> hdpdx(-h, &dpdx);
+    ComponentwiseSum<ConstStack, decltype(hr1.stack(0, 0))> sum1(&U1, &hr1);
+    ComponentwiseSum<decltype(sum1.stack(0, 0)), decltype(hdpdx.stack(0, 0))> sum2(&sum1, &hdpdx);
+
+    ParallelPerStack([&R1, &sum2](int j1, int j2)
+    {
+        R1.stack(j1, j2) = sum2.stack(j1, j2);
+    });
+}
+}
+
+template<typename F>
+double TimePerEvaluation(int repetitions, F evaluate)
+{
+    // once first so that nothing is measured cold
+    evaluate();
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int n=0; n<repetitions; n++)
+    {
+        evaluate();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    return std::chrono::duration<double>(end-start).count()/repetitions;
+}
+
+int main(int argc, char* argv[])
+{
+    int repetitions = 1000;
+    if (argc > 1)
+    {
+        repetitions = std::stoi(argv[1]);
+    }
+
+    NeumannModal u1, r1, p, R1, check;
+    u1.RandomizeCoefficients(0.3);
+    r1.RandomizeCoefficients(0.3);
+    p.RandomizeCoefficients(0.3);
+
+    stratifloat h = 0.01;
+
+    double staticTime = TimePerEvaluation(repetitions, [&]()
+    {
+        R1 = u1 + h*r1 + (-h)*ddx(p);
+    });
+
+    double virtualTime = TimePerEvaluation(repetitions, [&]()
+    {
+        virtualdispatch::Evaluate(check, u1, r1, p, h);
+    });
+
+    check -= R1;
+    stratifloat difference = 0;
+    for (int j2=0; j2<check.Size2(); j2++)
+    {
+        for (int j1=0; j1<check.Size1(); j1++)
+        {
+            difference = std::max(difference, check.stack(j1, j2).abs().maxCoeff());
+        }
+    }
+
+    printf("Grid %dx%dx%d, %d threads, %d repetitions\n", gridParams.N1, gridParams.N2, gridParams.N3, omp_get_max_threads(), repetitions);
+    printf("static expression templates: %.3e s per evaluation\n", staticTime);
+    printf("virtual dispatch:            %.3e s per evaluation\n", virtualTime);
+    printf("speedup: %.2fx (max difference %.1e)\n", virtualTime/staticTime, difference);
+}
@@ -57,6 +57,27 @@ public:
         p = 0;
     }
 
+    std::size_t PackedSize() const
+    {
+        return x.PackedSize() + 1;
+    }
+
+    template<typename S>
+    S* Pack(S* into) const
+    {
+        into = x.Pack(into);
+        *into = static_cast<S>(p);
+        return into + 1;
+    }
+
+    template<typename S>
+    const S* Unpack(const S* from)
+    {
+        from = x.Unpack(from);
+        p = static_cast<stratifloat>(*from);
+        return from + 1;
+    }
+
     void LinearEvolve(stratifloat T,
                       const ExtendedStateVector& about,
                       const ExtendedStateVector& aboutResult,
@@ -1,7 +1,18 @@
 #include "FFT.h"
+#include "Parameters.h"
+#include "Profiling.h"
+#include "Distributed.h"
+#include "Tasks.h"
 
 #include <cassert>
 #include <vector>
+#include <map>
+#include <tuple>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <algorithm>
 #include <iostream>
 #include <omp.h>
 
@@ -22,6 +33,8 @@ void fftw_cleanup_threads()
 
 void Perform1DR2R(int size, const stratifloat* in, stratifloat* out, f3_r2r_kind kind)
 {
+    PROFILE(RealToRealFFT);
+
     int fftSize;
 
     if (kind == FFTW_REDFT00)
@@ -107,6 +120,8 @@ void Perform1DR2R(int size, const stratifloat* in, stratifloat* out, f3_r2r_kind
 
 void Perform1DR2R(int size, const stratifloat* in, stratifloat* out, f3_r2r_kind kind)
 {
+    PROFILE(RealToRealFFT);
+
     // the const_cast is legit when using FFTW_ESTIMATE
     auto plan = f3_plan_r2r_1d(size, const_cast<stratifloat*>(in), out, kind, FFTW_ESTIMATE);
     assert(plan);
@@ -116,8 +131,660 @@ void Perform1DR2R(int size, const stratifloat* in, stratifloat* out, f3_r2r_kind
 
 #endif
 
+namespace
+{
+enum class FFTDirection
+{
+    RealToComplex,
+    ComplexToReal,
+
+    // the stages of the pruned transforms: in the 1st direction for every j2,
+    // and in the 2nd direction, in place, for only the first few j1
+    RealToComplexRows,
+    ComplexToRealRows,
+    ForwardColumns,
+    BackwardColumns
+};
+
+// N3 planes are transformed, which are interleaved with a distance of stride between the points of each
+struct PlanKey
+{
+    FFTDirection direction;
+    int N1;
+    int N2;
+    int N3;
+    int stride;
+    int threads;
+    int inAlignment;
+    int outAlignment;
+    bool inPlace;
+
+    // the number of j1 transformed in the 2nd direction, for ForwardColumns and BackwardColumns
+    // out of place, the input only has these values of j1
+    int columns;
+
+    // and the number of j1 in each row of the output, which is N1/2+1 unless it is a distributed transform's pencil
+    int width;
+
+    bool operator<(const PlanKey& other) const
+    {
+        return std::tie(direction, N1, N2, N3, stride, threads, inAlignment, outAlignment, inPlace, columns, width)
+             < std::tie(other.direction, other.N1, other.N2, other.N3, other.stride, other.threads,
+                        other.inAlignment, other.outAlignment, other.inPlace, other.columns, other.width);
+    }
+};
+
+// new-array execution requires the same alignment as the arrays the plan was made with
+// 64 bytes covers every simd width fftw might use
+constexpr int MaxAlignment = 64;
+
+int AlignmentOf(const void* ptr)
+{
+    return reinterpret_cast<std::uintptr_t>(ptr) % MaxAlignment;
+}
+
+char* AlignWithin(std::vector<char>& buffer, int alignment)
+{
+    char* base = buffer.data();
+    return base + (alignment - AlignmentOf(base) + MaxAlignment) % MaxAlignment;
+}
+
+// this is deliberately never freed, as it has to outlive every InitialiserClass
+std::map<PlanKey, f3_plan>& Plans()
+{
+    static auto plans = new std::map<PlanKey, f3_plan>();
+    return *plans;
+}
+
+FFTStatistics statistics;
+
+#ifndef USE_CUDA
+// the 1D transforms which make up the pruned transforms, with the guru interface,
+// which can describe the rows and columns of interleaved planes
+f3_plan CreatePrunedPlan(const PlanKey& key, char* in, char* out)
+{
+    int M1 = key.N1/2+1;
+
+    // the planes are next to each other
+    f3_iodim planes = {key.N3, 1, 1};
+
+    if (key.direction == FFTDirection::ForwardColumns || key.direction == FFTDirection::BackwardColumns)
+    {
+        int inWidth = key.inPlace ? key.width : key.columns;
+        f3_iodim dims[] = {{key.N2, inWidth*key.stride, key.width*key.stride}};
+        f3_iodim howMany[] = {{key.columns, key.stride, key.stride}, planes};
+
+        return f3_plan_guru_dft(1, dims, 2, howMany,
+                                reinterpret_cast<f3_complex*>(in),
+                                reinterpret_cast<f3_complex*>(out),
+                                key.direction == FFTDirection::ForwardColumns ? FFTW_FORWARD : FFTW_BACKWARD,
+                                FFTW_PATIENT);
+    }
+
+    f3_iodim dims[] = {{key.N1, key.stride, key.stride}};
+
+    if (key.direction == FFTDirection::RealToComplexRows)
+    {
+        f3_iodim howMany[] = {{key.N2, key.N1*key.stride, M1*key.stride}, planes};
+
+        return f3_plan_guru_dft_r2c(1, dims, 2, howMany,
+                                    reinterpret_cast<stratifloat*>(in),
+                                    reinterpret_cast<f3_complex*>(out),
+                                    FFTW_PATIENT);
+    }
+
+    assert(key.direction == FFTDirection::ComplexToRealRows);
+    f3_iodim howMany[] = {{key.N2, M1*key.stride, key.N1*key.stride}, planes};
+
+    return f3_plan_guru_dft_c2r(1, dims, 2, howMany,
+                                reinterpret_cast<f3_complex*>(in),
+                                reinterpret_cast<stratifloat*>(out),
+                                FFTW_PATIENT);
+}
+#endif
+
+f3_plan CreatePlan(const PlanKey& key)
+{
+    double start = omp_get_wtime();
+
+    int dims[] = {key.N2, key.N1};
+    int odims[] = {key.N2, key.N1/2+1};
+
+    std::size_t bufferSize = std::max(sizeof(stratifloat)*key.N1, sizeof(complex)*(key.N1/2+1))*key.N2*key.stride;
+
+    // patient planning overwrites the arrays, so we use scratch space rather than the field's data
+    std::vector<char> inBuffer(bufferSize + MaxAlignment);
+    std::vector<char> outBuffer(key.inPlace ? 0 : bufferSize + MaxAlignment);
+
+    char* in = AlignWithin(inBuffer, key.inAlignment);
+    char* out = key.inPlace ? in : AlignWithin(outBuffer, key.outAlignment);
+
+    f3_plan_with_nthreads(key.threads);
+
+    f3_plan plan;
+    if (key.direction == FFTDirection::RealToComplex)
+    {
+        plan = f3_plan_many_dft_r2c(2,
+                                    dims,
+                                    key.N3,
+                                    reinterpret_cast<stratifloat*>(in),
+                                    dims,
+                                    key.stride,
+                                    1,
+                                    reinterpret_cast<f3_complex*>(out),
+                                    odims,
+                                    key.stride,
+                                    1,
+                                    FFTW_PATIENT);
+    }
+    else if (key.direction == FFTDirection::ComplexToReal)
+    {
+        plan = f3_plan_many_dft_c2r(2,
+                                    dims,
+                                    key.N3,
+                                    reinterpret_cast<f3_complex*>(in),
+                                    odims,
+                                    key.stride,
+                                    1,
+                                    reinterpret_cast<stratifloat*>(out),
+                                    dims,
+                                    key.stride,
+                                    1,
+                                    FFTW_PATIENT);
+    }
+    else
+    {
+#ifndef USE_CUDA
+        plan = CreatePrunedPlan(key, in, out);
+#else
+        assert(false);
+#endif
+    }
+    assert(plan);
+
+    f3_plan_with_nthreads(omp_get_max_threads());
+
+    statistics.plansCreated++;
+    statistics.planningTime += omp_get_wtime() - start;
+
+    return plan;
+}
+
+f3_plan GetPlan(const PlanKey& key)
+{
+    f3_plan plan;
+
+    // the fftw planner is not thread safe
+    #pragma omp critical(FFTPlans)
+    {
+        auto found = Plans().find(key);
+        if (found != Plans().end())
+        {
+            plan = found->second;
+        }
+        else
+        {
+            plan = CreatePlan(key);
+            Plans()[key] = plan;
+        }
+    }
+
+    return plan;
+}
+
+// wisdom is only valid for the same transform sizes, precision and number of threads
+// each process transforms its own number of planes, so each keeps its own wisdom
+std::string WisdomFilename()
+{
+    std::string directory = ".";
+    if (const char* fromEnvironment = std::getenv("STRATIFLOW_WISDOM_DIR"))
+    {
+        directory = fromEnvironment;
+    }
+
+#ifdef USE_DOUBLE
+    std::string precision = "double";
+#else
+    std::string precision = "single";
+#endif
+
+    std::string process;
+    if (IsDistributed())
+    {
+        process = "-process" + std::to_string(ProcessRank()) + "of" + std::to_string(ProcessCount());
+    }
+
+    return directory + "/wisdom-"
+         + std::to_string(gridParams.N1) + "x"
+         + std::to_string(gridParams.N2) + "x"
+         + std::to_string(gridParams.N3) + "-"
+         + precision + "-"
+         + std::to_string(omp_get_max_threads()) + "threads"
+         + process + ".fftw";
+}
+
+void RecordTransform(double start)
+{
+    double elapsed = omp_get_wtime() - start;
+
+    #pragma omp atomic
+    statistics.transforms++;
+
+    #pragma omp atomic
+    statistics.transformTime += elapsed;
+}
+
+// transforms planes begin to begin+count of the N3 interleaved planes, using the given number of threads
+void TransformR2C(int N1, int N2, int N3, int begin, int count, int threads, const stratifloat* in, complex* out)
+{
+    PlanKey key = {FFTDirection::RealToComplex, N1, N2, count, N3, threads,
+                   AlignmentOf(in+begin), AlignmentOf(out+begin), static_cast<const void*>(in) == out, 0, 0};
+    f3_plan plan = GetPlan(key);
+
+    double start = omp_get_wtime();
+
+    // the const_cast is legit as out of place r2c transforms preserve their input
+    f3_execute_dft_r2c(plan, const_cast<stratifloat*>(in+begin), reinterpret_cast<f3_complex*>(out+begin));
+
+    RecordTransform(start);
+}
+
+void TransformC2R(int N1, int N2, int N3, int begin, int count, int threads, complex* in, stratifloat* out)
+{
+    PlanKey key = {FFTDirection::ComplexToReal, N1, N2, count, N3, threads,
+                   AlignmentOf(in+begin), AlignmentOf(out+begin), static_cast<void*>(in) == out, 0, 0};
+    f3_plan plan = GetPlan(key);
+
+    double start = omp_get_wtime();
+
+    f3_execute_dft_c2r(plan, reinterpret_cast<f3_complex*>(in+begin), out+begin);
+
+    RecordTransform(start);
+}
+
+// the pruned transforms of planes begin to begin+count, which are always out of place
+// only the first columns values of j1 are transformed in the 2nd direction, in place in the modal array
+void TransformPrunedR2C(int N1, int N2, int N3, int columns, int begin, int count, int threads, const stratifloat* in, complex* out)
+{
+    assert(static_cast<const void*>(in) != out);
+
+    PlanKey rowsKey = {FFTDirection::RealToComplexRows, N1, N2, count, N3, threads,
+                       AlignmentOf(in+begin), AlignmentOf(out+begin), false, 0, 0};
+    f3_plan rows = GetPlan(rowsKey);
+
+    PlanKey columnsKey = {FFTDirection::ForwardColumns, N1, N2, count, N3, threads,
+                          AlignmentOf(out+begin), AlignmentOf(out+begin), true, columns, N1/2+1};
+    f3_plan columnPlan = N2 > 1 ? GetPlan(columnsKey) : nullptr;
+
+    double start = omp_get_wtime();
+
+    // the const_cast is legit as out of place r2c transforms preserve their input
+    f3_execute_dft_r2c(rows, const_cast<stratifloat*>(in+begin), reinterpret_cast<f3_complex*>(out+begin));
+    if (columnPlan)
+    {
+        f3_execute_dft(columnPlan, reinterpret_cast<f3_complex*>(out+begin), reinterpret_cast<f3_complex*>(out+begin));
+    }
+
+    RecordTransform(start);
+}
+
+void TransformPrunedC2R(int N1, int N2, int N3, int columns, int begin, int count, int threads, complex* in, stratifloat* out)
+{
+    assert(static_cast<void*>(in) != out);
+
+    PlanKey columnsKey = {FFTDirection::BackwardColumns, N1, N2, count, N3, threads,
+                          AlignmentOf(in+begin), AlignmentOf(in+begin), true, columns, N1/2+1};
+    f3_plan columnPlan = N2 > 1 ? GetPlan(columnsKey) : nullptr;
+
+    PlanKey rowsKey = {FFTDirection::ComplexToRealRows, N1, N2, count, N3, threads,
+                       AlignmentOf(in+begin), AlignmentOf(out+begin), false, 0, 0};
+    f3_plan rows = GetPlan(rowsKey);
+
+    double start = omp_get_wtime();
+
+    if (columnPlan)
+    {
+        f3_execute_dft(columnPlan, reinterpret_cast<f3_complex*>(in+begin), reinterpret_cast<f3_complex*>(in+begin));
+    }
+    f3_execute_dft_c2r(rows, reinterpret_cast<f3_complex*>(in+begin), out+begin);
+
+    RecordTransform(start);
+}
+
+// as above, but the first stage is out of place, from an input which only has the first columns values of j1,
+// so that only the scratch space is overwritten
+void TransformPrunedC2R(int N1, int N2, int N3, int columns, int begin, int count, int threads,
+                        const complex* in, complex* scratch, stratifloat* out)
+{
+    int M1 = N1/2+1;
+
+    PlanKey columnsKey = {FFTDirection::BackwardColumns, N1, N2, count, N3, threads,
+                          AlignmentOf(in+begin), AlignmentOf(scratch+begin), false, columns, M1};
+    f3_plan columnPlan = GetPlan(columnsKey);
+
+    PlanKey rowsKey = {FFTDirection::ComplexToRealRows, N1, N2, count, N3, threads,
+                       AlignmentOf(scratch+begin), AlignmentOf(out+begin), false, 0, 0};
+    f3_plan rows = GetPlan(rowsKey);
+
+    double start = omp_get_wtime();
+
+    // the const_cast is legit as out of place c2c transforms preserve their input
+    f3_execute_dft(columnPlan, reinterpret_cast<f3_complex*>(const_cast<complex*>(in+begin)),
+                   reinterpret_cast<f3_complex*>(scratch+begin));
+
+    // the rest of the wavenumbers are zero, which is split between the same threads as the transform
+    // (it can't be done once for the scratch space, as the rows stage is free to overwrite its input)
+    #pragma omp parallel for collapse(2) num_threads(threads) if(threads > 1)
+    for (int j2=0; j2<N2; j2++)
+    {
+        for (int j1=columns; j1<M1; j1++)
+        {
+            complex* stack = scratch + (M1*j2 + j1)*N3;
+            std::fill(stack + begin, stack + begin + count, 0);
+        }
+    }
+
+    f3_execute_dft_c2r(rows, reinterpret_cast<f3_complex*>(scratch+begin), out+begin);
+
+    RecordTransform(start);
+}
+
+// within a task graph the team is busy with other tasks, so rather than using fftw's own threads
+// the planes are split into tasks, each transformed by a single threaded plan
+// in place transforms are done whole, as the planes of one task overlap the data of the next
+bool TransformInTasks(const void* in, const void* out)
+{
+    return omp_in_parallel() && in != out;
+}
+
+// calls transform(begin, count, threads) for the planes, either all at once or split into tasks
+template<typename F>
+void TransformPlanes(int N3, bool inTasks, F transform)
+{
+    if (!inTasks)
+    {
+        transform(0, N3, omp_get_max_threads());
+        return;
+    }
+
+    #pragma omp taskloop grainsize(1)
+    for (int begin=0; begin<N3; begin+=FFTPlanesPerTask)
+    {
+        transform(begin, std::min(FFTPlanesPerTask, N3-begin), 1);
+    }
+}
+
+void TransformR2C(int N1, int N2, int N3, const stratifloat* in, complex* out)
+{
+    TransformPlanes(N3, TransformInTasks(in, out), [=](int begin, int count, int threads)
+    {
+        TransformR2C(N1, N2, N3, begin, count, threads, in, out);
+    });
+}
+
+void TransformC2R(int N1, int N2, int N3, complex* in, stratifloat* out)
+{
+    TransformPlanes(N3, TransformInTasks(in, out), [=](int begin, int count, int threads)
+    {
+        TransformC2R(N1, N2, N3, begin, count, threads, in, out);
+    });
+}
+
+// the distributed transforms, which transpose this process's stacks into pencils (see Distributed.h)
+// there is no task graph when distributed, so each pencil is transformed by all of this process's threads
+
+// transforms the columns of this process's stacks j1 < n1 of every j2, in place
+// if the grid is one process wide in the 2nd dimension they are already whole, and otherwise they are transposed first
+void TransformColumns(FFTDirection direction, int N1, int N2, int N3, int n1, complex* stacks, TransformScratch& scratch)
+{
+    if (N2 == 1)
+    {
+        return;
+    }
+
+    int width = OwnedStacks(n1).Count();
+    int planes = N3;
+    complex* columns = stacks;
+
+    bool transposed = ProcessGridSize(2) > 1;
+    if (transposed)
+    {
+        planes = OwnedPlanes(N3, ProcessGridIndex(2), ProcessGridSize(2)).Size();
+        scratch.modalPencils.resize(static_cast<std::size_t>(N2)*width*planes);
+        columns = scratch.modalPencils.data();
+
+        StacksToColumns(stacks, columns, sizeof(complex), n1, N2, N3, scratch.transpose);
+    }
+
+    if (width > 0 && planes > 0)
+    {
+        PlanKey key = {direction, N1, N2, planes, planes, omp_get_max_threads(),
+                       AlignmentOf(columns), AlignmentOf(columns), true, width, width};
+        f3_plan plan = GetPlan(key);
+
+        double start = omp_get_wtime();
+        f3_execute_dft(plan, reinterpret_cast<f3_complex*>(columns), reinterpret_cast<f3_complex*>(columns));
+        RecordTransform(start);
+    }
+
+    if (transposed)
+    {
+        ColumnsToStacks(columns, stacks, sizeof(complex), n1, N2, N3, scratch.transpose);
+    }
+}
+
+// transforms this process's stacks in the 1st direction, through whole rows, of which only j1 < n1 are sent back
+void TransformRowsR2C(int N1, int N2, int N3, int n1, const stratifloat* in, complex* out, TransformScratch& scratch)
+{
+    int M1 = N1/2+1;
+    int rows = OwnedRows(N2, N2, N2).Count();
+    int planes = OwnedPlanes(N3, ProcessGridIndex(1), ProcessGridSize(1)).Size();
+
+    scratch.nodalPencils.resize(static_cast<std::size_t>(rows)*N1*planes);
+    scratch.modalPencils.resize(static_cast<std::size_t>(rows)*M1*planes);
+    stratifloat* nodal = scratch.nodalPencils.data();
+    complex* modal = scratch.modalPencils.data();
+
+    StacksToRows(in, nodal, sizeof(stratifloat), N1, N1, N2, N3, scratch.transpose);
+
+    if (rows > 0 && planes > 0)
+    {
+        PlanKey key = {FFTDirection::RealToComplexRows, N1, rows, planes, planes, omp_get_max_threads(),
+                       AlignmentOf(nodal), AlignmentOf(modal), false, 0, 0};
+        f3_plan plan = GetPlan(key);
+
+        double start = omp_get_wtime();
+        f3_execute_dft_r2c(plan, nodal, reinterpret_cast<f3_complex*>(modal));
+        RecordTransform(start);
+    }
+
+    RowsToStacks(modal, out, sizeof(complex), n1, M1, N2, N3, scratch.transpose);
+}
+
+// the reverse, where the input only has j1 < n1, and the rest of each row is zero
+void TransformRowsC2R(int N1, int N2, int N3, int n1, const complex* in, stratifloat* out, TransformScratch& scratch)
+{
+    int M1 = N1/2+1;
+    int rows = OwnedRows(N2, N2, N2).Count();
+    int planes = OwnedPlanes(N3, ProcessGridIndex(1), ProcessGridSize(1)).Size();
+
+    scratch.nodalPencils.resize(static_cast<std::size_t>(rows)*N1*planes);
+    scratch.modalPencils.resize(static_cast<std::size_t>(rows)*M1*planes);
+    stratifloat* nodal = scratch.nodalPencils.data();
+    complex* modal = scratch.modalPencils.data();
+
+    StacksToRows(in, modal, sizeof(complex), n1, M1, N2, N3, scratch.transpose);
+
+    if (rows > 0 && planes > 0)
+    {
+        PlanKey key = {FFTDirection::ComplexToRealRows, N1, rows, planes, planes, omp_get_max_threads(),
+                       AlignmentOf(modal), AlignmentOf(nodal), false, 0, 0};
+        f3_plan plan = GetPlan(key);
+
+        double start = omp_get_wtime();
+        f3_execute_dft_c2r(plan, reinterpret_cast<f3_complex*>(modal), nodal);
+        RecordTransform(start);
+    }
+
+    RowsToStacks(nodal, out, sizeof(stratifloat), N1, N1, N2, N3, scratch.transpose);
+}
+
+// this process's stacks of every j2 are laid out one row of stacks after another, so going between
+// the layouts for n1 and newN1 moves each row, keeping the stacks which are in both
+// (the stacks of n1 which are j1 < newN1 come first in each row, as the stacks are in order of j1)
+void ChangeRowWidth(complex* stacks, int N2, int N3, int n1, int newN1)
+{
+    std::size_t width = static_cast<std::size_t>(OwnedStacks(n1).Count())*N3;
+    std::size_t newWidth = static_cast<std::size_t>(OwnedStacks(newN1).Count())*N3;
+    int rows = OwnedRows(N2, N2, N2).Count();
+
+    if (newWidth == width)
+    {
+        return;
+    }
+
+    // when the rows get wider they move later, so the last is moved first
+    for (int n=0; n<rows; n++)
+    {
+        int row = newWidth > width ? rows-1-n : n;
+        std::memmove(stacks + newWidth*row, stacks + width*row, sizeof(complex)*std::min(width, newWidth));
+    }
+}
+}
+
+void PerformR2C(int N1, int N2, int N3, const stratifloat* in, complex* out, TransformScratch& scratch)
+{
+    PROFILE(ForwardFFT);
+
+    if (!IsDistributed())
+    {
+        TransformR2C(N1, N2, N3, in, out);
+        return;
+    }
+
+    TransformRowsR2C(N1, N2, N3, N1/2+1, in, out, scratch);
+    TransformColumns(FFTDirection::ForwardColumns, N1, N2, N3, N1/2+1, out, scratch);
+}
+
+void PerformC2R(int N1, int N2, int N3, complex* in, stratifloat* out, TransformScratch& scratch)
+{
+    PROFILE(InverseFFT);
+
+    if (!IsDistributed())
+    {
+        TransformC2R(N1, N2, N3, in, out);
+        return;
+    }
+
+    TransformColumns(FFTDirection::BackwardColumns, N1, N2, N3, N1/2+1, in, scratch);
+    TransformRowsC2R(N1, N2, N3, N1/2+1, in, out, scratch);
+}
+
+void PerformPrunedR2C(int N1, int N2, int N3, int K1, const stratifloat* in, complex* out, TransformScratch& scratch)
+{
+    PROFILE(ForwardFFT);
+
+    if (IsDistributed())
+    {
+        // only j1 < K1 come back from the rows, and are transformed in the 2nd direction,
+        // then they are spread out to where they go in the full output, whose other values are left as they were
+        TransformRowsR2C(N1, N2, N3, K1, in, out, scratch);
+        TransformColumns(FFTDirection::ForwardColumns, N1, N2, N3, K1, out, scratch);
+        ChangeRowWidth(out, N2, N3, K1, N1/2+1);
+        return;
+    }
+
+    // the guru interface isn't used with CUDA
+#ifndef USE_CUDA
+    TransformPlanes(N3, TransformInTasks(in, out), [=](int begin, int count, int threads)
+    {
+        TransformPrunedR2C(N1, N2, N3, K1, begin, count, threads, in, out);
+    });
+#else
+    TransformR2C(N1, N2, N3, in, out);
+#endif
+}
+
+void PerformPrunedC2R(int N1, int N2, int N3, int K1, complex* in, stratifloat* out, TransformScratch& scratch)
+{
+    PROFILE(InverseFFT);
+
+    if (IsDistributed())
+    {
+        // the input can be overwritten, so the stacks j1 < K1 are gathered up at the start of it
+        ChangeRowWidth(in, N2, N3, N1/2+1, K1);
+        TransformColumns(FFTDirection::BackwardColumns, N1, N2, N3, K1, in, scratch);
+        TransformRowsC2R(N1, N2, N3, K1, in, out, scratch);
+        return;
+    }
+
+#ifndef USE_CUDA
+    TransformPlanes(N3, TransformInTasks(in, out), [=](int begin, int count, int threads)
+    {
+        TransformPrunedC2R(N1, N2, N3, K1, begin, count, threads, in, out);
+    });
+#else
+    TransformC2R(N1, N2, N3, in, out);
+#endif
+}
+
+void PerformPrunedC2R(int N1, int N2, int N3, int K1, const complex* in, stratifloat* out, TransformScratch& scratch)
+{
+    PROFILE(InverseFFT);
+
+    int M1 = N1/2+1;
+
+    if (IsDistributed())
+    {
+        // the input is left alone, so the 2nd direction is transformed in a copy
+        scratch.modal.assign(in, in + static_cast<std::size_t>(OwnedStacks(K1).Count())*OwnedRows(N2, N2, N2).Count()*N3);
+        TransformColumns(FFTDirection::BackwardColumns, N1, N2, N3, K1, scratch.modal.data(), scratch);
+        TransformRowsC2R(N1, N2, N3, K1, scratch.modal.data(), out, scratch);
+        return;
+    }
+
+    scratch.modal.resize(static_cast<std::size_t>(M1)*N2*N3);
+    complex* staged = scratch.modal.data();
+
+#ifndef USE_CUDA
+    TransformPlanes(N3, omp_in_parallel(), [=](int begin, int count, int threads)
+    {
+        TransformPrunedC2R(N1, N2, N3, K1, begin, count, threads, in, staged, out);
+    });
+#else
+    ParallelFor(M1, 0, N2, [=](int j1, int j2)
+    {
+        complex* to = staged + (M1*j2 + j1)*N3;
+        if (j1 < K1)
+        {
+            const complex* from = in + (K1*j2 + j1)*N3;
+            std::copy(from, from + N3, to);
+        }
+        else
+        {
+            std::fill(to, to + N3, 0);
+        }
+    });
+
+    TransformC2R(N1, N2, N3, staged, out);
+#endif
+}
+
+const FFTStatistics& GetFFTStatistics()
+{
+    return statistics;
+}
+
+void PrintFFTStatistics()
+{
+    printf("FFT plans: %d created in %.3fs\n", statistics.plansCreated, statistics.planningTime);
+    printf("FFT transforms: %ld executed in %.3fs\n", statistics.transforms, statistics.transformTime);
+}
+
 void Setup()
 {
+    InitialiseProcesses();
+
     // We use printf here because of weird std bugs when using cout
     printf("Setting up Stratiflow\n");
 
@@ -129,11 +796,50 @@ void Setup()
     f3_plan_with_nthreads(omp_get_max_threads());
 
     printf("Using %d threads\n", omp_get_max_threads());
+
+    if (IsDistributed())
+    {
+        printf("Process %d of %d, in a grid of %dx%d\n", ProcessRank(), ProcessCount(), ProcessGridSize(1), ProcessGridSize(2));
+    }
+
+#ifndef USE_CUDA
+    std::string wisdomFile = WisdomFilename();
+    if (f3_import_wisdom_from_filename(wisdomFile.c_str()))
+    {
+        printf("Loaded FFTW wisdom from %s\n", wisdomFile.c_str());
+    }
+#endif
 }
 
 void Cleanup()
 {
+    PrintFFTStatistics();
+
+#ifdef USE_PROFILING
+    PrintProfile();
+#endif
+
+#ifndef USE_CUDA
+    // nothing to add to the wisdom if no plans were made
+    if (statistics.plansCreated > 0)
+    {
+        std::string wisdomFile = WisdomFilename();
+        if (!f3_export_wisdom_to_filename(wisdomFile.c_str()))
+        {
+            fprintf(stderr, "Failed to save FFTW wisdom to %s\n", wisdomFile.c_str());
+        }
+    }
+#endif
+
+    for (auto& plan : Plans())
+    {
+        f3_destroy_plan(plan.second);
+    }
+    Plans().clear();
+
     f3_cleanup_threads();
+
+    FinaliseProcesses();
 }
 
 int InitialiserClass::counter;
\ No newline at end of file
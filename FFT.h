@@ -1,6 +1,10 @@
 #pragma once
 
 #include "Constants.h"
+#include "Eigen.h"
+#include "Distributed.h"
+
+#include <vector>
 
 #ifdef USE_CUDA
 #include <cufftw.h>
@@ -29,6 +33,49 @@ FFTW_REDFT00
 // this should not be a bottleneck, so we do it in a fairly inefficient way
 void Perform1DR2R(int size, const stratifloat* in, stratifloat* out, f3_r2r_kind kind);
 
+// space for a transform to work in, which it is allowed to overwrite
+// this belongs to whoever does the transform, so that several can be done at once
+struct TransformScratch
+{
+    // the size of a modal field, for the last of the transforms below, and for callers to stage the others in
+    std::vector<complex, aligned_allocator<complex>> modal;
+
+    // the pencils of a distributed transform, and what is sent between the processes to make them
+    std::vector<stratifloat, aligned_allocator<stratifloat>> nodalPencils;
+    std::vector<complex, aligned_allocator<complex>> modalPencils;
+    TransposeBuffers transpose;
+};
+
+// These do N3 interleaved 2D transforms of size N2xN1 (the layout used by Field)
+// Plans are created once per shape and alignment, then reused with the new-array interface
+// When distributed, each array only has this process's stacks of every j2, laid out as in Field (see Distributed.h)
+void PerformR2C(int N1, int N2, int N3, const stratifloat* in, complex* out, TransformScratch& scratch);
+void PerformC2R(int N1, int N2, int N3, complex* in, stratifloat* out, TransformScratch& scratch);
+
+// The same, when only the wavenumbers j1<K1 are used, as after dealiasing
+// These are done as 1D transforms in each direction, so the 2nd direction is only transformed for j1<K1:
+// the other output of PerformPrunedR2C is left part way transformed,
+// and the input of PerformPrunedC2R must be zero there
+void PerformPrunedR2C(int N1, int N2, int N3, int K1, const stratifloat* in, complex* out, TransformScratch& scratch);
+void PerformPrunedC2R(int N1, int N2, int N3, int K1, complex* in, stratifloat* out, TransformScratch& scratch);
+
+// As PerformPrunedC2R, but for a const input, which isn't overwritten, and only has the values j1<K1,
+// so that stack (j1, j2) is at (K1*j2 + j1)*N3
+// The 1st stage is out of place into scratch.modal, which is resized to the full (N1/2+1)xN2xN3, and is overwritten instead
+// (this is the only one which uses scratch.modal, so the others can be given it as their input or output)
+void PerformPrunedC2R(int N1, int N2, int N3, int K1, const complex* in, stratifloat* out, TransformScratch& scratch);
+
+struct FFTStatistics
+{
+    int plansCreated;
+    double planningTime;  // seconds
+    long transforms;
+    double transformTime; // seconds
+};
+
+const FFTStatistics& GetFFTStatistics();
+void PrintFFTStatistics();
+
 void Setup();
 void Cleanup();
 
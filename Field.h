@@ -3,10 +3,20 @@
 #include "Constants.h"
 #include "Eigen.h"
 #include "FFT.h"
+#include "BandedMatrix.h"
+#include "GridSizes.h"
+#include "Parameters.h"
+#include "Distributed.h"
+#include "Tasks.h"
 
 #include <cassert>
+#include <omp.h>
 
 #include <vector>
+#include <deque>
+#include <atomic>
+#include <type_traits>
+#include <algorithm>
 #include <utility>
 #include <functional>
 #include <iostream>
@@ -25,12 +35,28 @@ ArrayX FourierPoints(stratifloat L, int N);
 
 stratifloat Hermite(unsigned int n, stratifloat x);
 
-template<typename A, typename T, int N1, int N2, int N3>
+// Base of the expression templates, using the curiously recurring template pattern
+// so that whole expressions are resolved at compile time and can be inlined
+// Derived is the actual node (or field) type, which must provide stack(n1, n2) and BC()
+template<typename Derived, typename T, int N1, int N2, int N3>
 class StackContainer
 {
 public:
-    virtual A stack(int n1, int n2) const = 0;
-    virtual BoundaryCondition BC() const = 0;
+    const Derived& derived() const
+    {
+        return static_cast<const Derived&>(*this);
+    }
+
+    auto stack(int n1, int n2) const
+    {
+        return derived().stack(n1, n2);
+    }
+
+    BoundaryCondition BC() const
+    {
+        return derived().BC();
+    }
+
     BoundaryCondition OtherBC() const
     {
         if (BC() == BoundaryCondition::Neumann)
@@ -45,235 +71,391 @@ public:
 };
 
 template<typename A, typename T, int N1, int N2, int N3>
-class Negate : public StackContainer<CwiseUnaryOp<internal::scalar_opposite_op<T>, const A>, T, N1, N2, N3>
+class Negate : public StackContainer<Negate<A, T, N1, N2, N3>, T, N1, N2, N3>
 {
 public:
     Negate(const StackContainer<A, T, N1, N2, N3>* field)
-    : field(field)
+    : field(field->derived())
     {}
 
-    virtual
-        CwiseUnaryOp<internal::scalar_opposite_op<T>, const A>
-        stack(int n1, int n2) const override
+    auto stack(int n1, int n2) const
     {
-        return -field->stack(n1, n2);
+        return -field.stack(n1, n2);
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
-        return field->BC();
+        return field.BC();
     }
 private:
-    const StackContainer<A, T, N1, N2, N3>* field;
+    const A& field;
 };
 
 template<typename A, typename T, int N1, int N2, int N3>
-class ScalarProduct : public StackContainer<CwiseBinaryOp<internal::scalar_product_op<T, T>, const CwiseNullaryOp<internal::scalar_constant_op<T>,const Array<T, -1, 1>>, const A>, T, N1, N2, N3>
+class ScalarProduct : public StackContainer<ScalarProduct<A, T, N1, N2, N3>, T, N1, N2, N3>
 {
 public:
     ScalarProduct(T scalar, const StackContainer<A, T, N1, N2, N3>* other)
-    : scalar(scalar)
-    , rhs(other)
+    : rhs(other->derived())
+    , scalar(scalar)
     {}
 
-    virtual
-        CwiseBinaryOp<internal::scalar_product_op<T, T>, const CwiseNullaryOp<internal::scalar_constant_op<T>,const Array<T, -1, 1>>, const A>
-        stack(int n1, int n2) const override
+    auto stack(int n1, int n2) const
     {
-        return scalar*rhs->stack(n1, n2);
+        return scalar*rhs.stack(n1, n2);
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
-        return rhs->BC();
+        return rhs.BC();
     }
 private:
-    const StackContainer<A, T, N1, N2, N3>* rhs;
+    const A& rhs;
     T scalar;
 };
 
 template<typename A, typename B, typename T, int N1, int N2, int N3>
-class ComponentwiseSum : public StackContainer<CwiseBinaryOp<internal::scalar_sum_op<T, T>, const A, const B>, T, N1, N2, N3>
+class ComponentwiseSum : public StackContainer<ComponentwiseSum<A, B, T, N1, N2, N3>, T, N1, N2, N3>
 {
 public:
     ComponentwiseSum(const StackContainer<A, T, N1, N2, N3>* lhs, const StackContainer<B, T, N1, N2, N3>* rhs)
-    : lhs(lhs)
-    , rhs(rhs)
+    : lhs(lhs->derived())
+    , rhs(rhs->derived())
     {
         assert(lhs->BC() == rhs->BC());
     }
-    virtual
-        CwiseBinaryOp<internal::scalar_sum_op<T, T>, const A, const B>
-        stack(int n1, int n2) const override
+
+    auto stack(int n1, int n2) const
     {
-        return lhs->stack(n1, n2) + rhs->stack(n1, n2);
+        return lhs.stack(n1, n2) + rhs.stack(n1, n2);
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
-        return rhs->BC();
+        return rhs.BC();
     }
 private:
-    const StackContainer<A, T, N1, N2, N3>* lhs;
-    const StackContainer<B, T, N1, N2, N3>* rhs;
+    const A& lhs;
+    const B& rhs;
 };
 
 template<typename A, typename B, typename T, int N1, int N2, int N3>
-class ComponentwiseProduct : public StackContainer<CwiseBinaryOp<internal::scalar_product_op<T, T>, const A, const B>, T, N1, N2, N3>
+class ComponentwiseProduct : public StackContainer<ComponentwiseProduct<A, B, T, N1, N2, N3>, T, N1, N2, N3>
 {
 public:
     ComponentwiseProduct(const StackContainer<A, T, N1, N2, N3>* lhs, const StackContainer<B, T, N1, N2, N3>* rhs)
-    : lhs(lhs)
-    , rhs(rhs)
+    : lhs(lhs->derived())
+    , rhs(rhs->derived())
     {
         assert(lhs->BC() == rhs->BC());
     }
-    virtual
-        CwiseBinaryOp<internal::scalar_product_op<T, T>, const A, const B>
-        stack(int n1, int n2) const override
+
+    auto stack(int n1, int n2) const
     {
-        return lhs->stack(n1, n2) * rhs->stack(n1, n2);
+        return lhs.stack(n1, n2) * rhs.stack(n1, n2);
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
-        return rhs->BC();
+        return rhs.BC();
     }
 private:
-    const StackContainer<A, T, N1, N2, N3>* lhs;
-    const StackContainer<B, T, N1, N2, N3>* rhs;
+    const A& lhs;
+    const B& rhs;
 };
 
 template<typename A, typename T1, typename T2, int N1, int N2, int N3>
-class Dim1MatMul : public StackContainer<CwiseBinaryOp<internal::scalar_product_op<T1, T2>, const CwiseNullaryOp<internal::scalar_constant_op<T1>,const Array<T1, -1, 1>>, const A>, T2, N1, N2, N3>
+class Dim1MatMul : public StackContainer<Dim1MatMul<A, T1, T2, N1, N2, N3>, T2, N1, N2, N3>
 {
 public:
     Dim1MatMul(const DiagonalMatrix<T1, -1>& matrix, const StackContainer<A, T2, N1, N2, N3>& field)
-    : matrix(matrix)
-    , field(field)
+    : field(field.derived())
+    , matrix(matrix)
     {}
 
-    virtual
-        CwiseBinaryOp<internal::scalar_product_op<T1, T2>, const CwiseNullaryOp<internal::scalar_constant_op<T1>,const Array<T1, -1, 1>>, const A>
-        stack(int n1, int n2) const override
+    auto stack(int n1, int n2) const
     {
         return matrix.diagonal()(n1)*field.stack(n1, n2);
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
         return field.BC();
     }
 private:
-    const StackContainer<A, T2, N1, N2, N3>& field;
+    const A& field;
     const DiagonalMatrix<T1, -1>& matrix;
 };
 
 template<typename A, typename T1, typename T2, int N1, int N2, int N3>
-class Dim2MatMul : public StackContainer<CwiseBinaryOp<internal::scalar_product_op<T1, T2>, const CwiseNullaryOp<internal::scalar_constant_op<T1>,const Array<T1, -1, 1>>, const A>, T2, N1, N2, N3>
+class Dim2MatMul : public StackContainer<Dim2MatMul<A, T1, T2, N1, N2, N3>, T2, N1, N2, N3>
 {
 public:
     Dim2MatMul(const DiagonalMatrix<T1, -1>& matrix, const StackContainer<A, T2, N1, N2, N3>& field)
-    : matrix(matrix)
-    , field(field)
+    : field(field.derived())
+    , matrix(matrix)
     {}
 
-    virtual
-        CwiseBinaryOp<internal::scalar_product_op<T1, T2>, const CwiseNullaryOp<internal::scalar_constant_op<T1>,const Array<T1, -1, 1>>, const A>
-        stack(int n1, int n2) const override
+    auto stack(int n1, int n2) const
     {
         return matrix.diagonal()(n2)*field.stack(n1, n2);
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
         return field.BC();
     }
 private:
-    const StackContainer<A, T2, N1, N2, N3>& field;
+    const A& field;
     const DiagonalMatrix<T1, -1>& matrix;
 };
 
 template<typename A, typename T1, typename T2, int N1, int N2, int N3>
-class Dim3MatMul : public StackContainer<ArrayWrapper<const Product<Matrix<T1,-1,-1>, MatrixWrapper<A>>>, T2, N1, N2, N3>
+class Dim3MatMul : public StackContainer<Dim3MatMul<A, T1, T2, N1, N2, N3>, T2, N1, N2, N3>
 {
 public:
     Dim3MatMul(const Matrix<T1, -1, -1>& matrix, const StackContainer<A, T2, N1, N2, N3>& field)
-    : matrix(matrix)
-    , field(field)
-    , resultingBC(field.BC())
+    : Dim3MatMul(matrix, field, field.BC())
     {}
 
     Dim3MatMul(const Matrix<T1, -1, -1>& matrix, const StackContainer<A, T2, N1, N2, N3>& field, BoundaryCondition resultBC)
-    : matrix(matrix)
-    , field(field)
+    : field(field.derived())
+    , matrix(matrix)
     , resultingBC(resultBC)
     {}
 
-    virtual
-        ArrayWrapper<const Product<Matrix<T1,-1,-1>, MatrixWrapper<A>>>
-        stack(int n1, int n2) const override
+    auto stack(int n1, int n2) const
     {
         return (matrix*field.stack(n1, n2).matrix()).array();
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
         return resultingBC;
     }
 private:
-    const StackContainer<A, T2, N1, N2, N3>& field;
+    const A& field;
     const Matrix<T1, -1, -1>& matrix;
     BoundaryCondition resultingBC;
 };
 
+// the buffers which Dim3BandedMatMul applies its stencil through are kept by each thread, like TransformScratch,
+// so that building an expression doesn't allocate
+// an expression can hold several of them at once, and can be built on one thread and evaluated on others,
+// so each live instance takes a slot which no other live instance has
+// released slots go on the releasing thread's free list, so no lock is needed
+class BufferSlots
+{
+public:
+    static int Acquire()
+    {
+        std::vector<int>& free = Free();
+        if (free.empty())
+        {
+            return Next()++;
+        }
+
+        int slot = free.back();
+        free.pop_back();
+        return slot;
+    }
+
+    static void Release(int slot)
+    {
+        Free().push_back(slot);
+    }
+
+private:
+    static std::atomic<int>& Next()
+    {
+        static std::atomic<int> next(0);
+        return next;
+    }
+
+    static std::vector<int>& Free()
+    {
+        static thread_local std::vector<int> free;
+        return free;
+    }
+};
+
+template<typename S>
+struct IsMap : std::false_type {};
+
+template<typename P, int Options, typename Stride>
+struct IsMap<Map<P, Options, Stride>> : std::true_type {};
+
 template<typename A, typename T1, typename T2, int N1, int N2, int N3>
-class MatMul : public StackContainer<ArrayWrapper<const Product<Matrix<T1,-1,-1>, MatrixWrapper<A>>>, T2, N1, N2, N3>
+class Dim3BandedMatMul : public StackContainer<Dim3BandedMatMul<A, T1, T2, N1, N2, N3>, T2, N1, N2, N3>
+{
+public:
+    Dim3BandedMatMul(const BandedMatrix<T1>& matrix, const StackContainer<A, T2, N1, N2, N3>& field)
+    : Dim3BandedMatMul(matrix, field, field.BC())
+    {}
+
+    Dim3BandedMatMul(const BandedMatrix<T1>& matrix, const StackContainer<A, T2, N1, N2, N3>& field, BoundaryCondition resultBC)
+    : field(field.derived())
+    , matrix(matrix)
+    , resultingBC(resultBC)
+    , slot(BufferSlots::Acquire())
+    {}
+
+    Dim3BandedMatMul(const Dim3BandedMatMul& other)
+    : field(other.field)
+    , matrix(other.matrix)
+    , resultingBC(other.resultingBC)
+    , slot(BufferSlots::Acquire())
+    {}
+
+    Dim3BandedMatMul& operator=(const Dim3BandedMatMul&) = delete;
+
+    ~Dim3BandedMatMul()
+    {
+        BufferSlots::Release(slot);
+    }
+
+    // the stencil is applied into a buffer owned by the calling thread,
+    // which stays valid until that thread asks this instance for another stack
+    Map<const Array<T2, -1, 1>, Aligned16> stack(int n1, int n2) const
+    {
+        // a deque, so that adding slots doesn't move the buffers of the others
+        static thread_local std::deque<Array<T2, -1, 1>> inputs;
+        static thread_local std::deque<Array<T2, -1, 1>> outputs;
+        while (static_cast<int>(outputs.size()) <= slot)
+        {
+            inputs.emplace_back();
+            outputs.emplace_back();
+        }
+
+        // only allocates the first time this thread uses the slot
+        Array<T2, -1, 1>& output = outputs[slot];
+        output.resize(matrix.rows());
+
+        auto operand = field.stack(n1, n2);
+        Apply(operand, inputs[slot], output, IsMap<decltype(operand)>());
+
+        return Map<const Array<T2, -1, 1>, Aligned16>(output.data(), output.size());
+    }
+
+    BoundaryCondition BC() const
+    {
+        return resultingBC;
+    }
+private:
+    // a stack which is already in memory is read in place
+    template<typename S>
+    void Apply(const S& operand, Array<T2, -1, 1>&, Array<T2, -1, 1>& output, std::true_type) const
+    {
+        matrix.Apply(operand, output);
+    }
+
+    // but an expression is evaluated first, as the stencil reads each value several times
+    template<typename S>
+    void Apply(const S& operand, Array<T2, -1, 1>& input, Array<T2, -1, 1>& output, std::false_type) const
+    {
+        input = operand;
+        matrix.Apply(input, output);
+    }
+
+    const A& field;
+    const BandedMatrix<T1>& matrix;
+    BoundaryCondition resultingBC;
+
+    int slot;
+};
+
+template<typename A, typename T1, typename T2, int N1, int N2, int N3>
+class MatMul : public StackContainer<MatMul<A, T1, T2, N1, N2, N3>, T2, N1, N2, N3>
 {
 public:
     MatMul(const std::vector<Matrix<T1, -1, -1>>& matrices, const StackContainer<A, T2, N1, N2, N3>& field)
-    : matrices(matrices)
-    , field(field)
-    , resultingBC(field.BC())
+    : MatMul(matrices, field, field.BC())
     {}
 
     MatMul(const std::vector<Matrix<T1, -1, -1>>& matrices, const StackContainer<A, T2, N1, N2, N3>& field, BoundaryCondition resultBC)
-    : matrices(matrices)
-    , field(field)
+    : field(field.derived())
+    , matrices(matrices)
     , resultingBC(resultBC)
-    {}
+    {
+        static_assert(N2 != Dynamic, "the matrices are indexed using the compile time size");
+    }
 
-    virtual
-        ArrayWrapper<const Product<Matrix<T1,-1,-1>, MatrixWrapper<A>>>
-        stack(int n1, int n2) const override
+    auto stack(int n1, int n2) const
     {
         return (matrices[n1*N2+n2]*field.stack(n1, n2).matrix()).array();
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
         return resultingBC;
     }
 private:
-    const StackContainer<A, T2, N1, N2, N3>& field;
+    const A& field;
     const std::vector<Matrix<T1, -1, -1>>& matrices;
     BoundaryCondition resultingBC;
 };
 
 template<typename T, int N1, int N2, int N3>
-class Field : public StackContainer<Map<const Array<T, -1, 1>, Aligned16>,T,N1,N2,N3>
+class Field : public StackContainer<Field<T, N1, N2, N3>,T,N1,N2,N3>
 {
 public:
-    Field(BoundaryCondition bc)
-    : _data(N1*N2*N3, 0)
+    // the sizes only need to be given for dimensions which are Dynamic
+    Field(BoundaryCondition bc, int n1 = N1, int n2 = N2, int n3 = N3)
+    : _n1(n1)
+    , _n2(n2)
+    , _n3(n3)
+    , _base(nullptr)
+    , _interleave(1)
+    , _slot(0)
     , _bc(bc)
+    , activeN1(n1)
+    , activeN2Low(n2)
+    , activeN2High(n2)
+    , storedN1(n1)
+    , storedN2Low(n2)
+    , storedN2High(n2)
+    , storedStacks(n1)
+    , storedRows(n2, n2, n2)
     {
+        assert(n1>0 && n2>0 && n3>0);
+        assert((N1==Dynamic || n1==N1) && (N2==Dynamic || n2==N2) && (N3==Dynamic || n3==N3));
+
+        LayOutStorage();
     }
 
     Field(const Field<T, N1, N2, N3>& other)
-    : _data(other._data)
-    {
-        assert(other.BC() == BC());
+    : _n1(other._n1)
+    , _n2(other._n2)
+    , _n3(other._n3)
+    , _data(other._data)
+    , _base(_data.data())
+    , _interleave(1)
+    , _slot(0)
+    , _bc(other._bc)
+    , activeN1(other.activeN1)
+    , activeN2Low(other.activeN2Low)
+    , activeN2High(other.activeN2High)
+    , storedN1(other.storedN1)
+    , storedN2Low(other.storedN2Low)
+    , storedN2High(other.storedN2High)
+    , storedStacks(other.storedStacks)
+    , storedRows(other.storedRows)
+    , _zeros(other._zeros)
+    , _outside(other._outside)
+    {
+        // a copy of part of a bundle has its own storage
+        if (_data.empty())
+        {
+            _data.resize(static_cast<std::size_t>(storedStacks.Count())*storedRows.Count()*Size3());
+            _base = _data.data();
+            for (int row=0; row<storedRows.Count(); row++)
+            {
+                for (int n=0; n<storedStacks.Count(); n++)
+                {
+                    std::copy_n(&other.Raw()[other.StoredOffset(n, row)], Size3(), &_base[StoredOffset(n, row)]);
+                }
+            }
+        }
     }
 
     void Reset(BoundaryCondition bc)
@@ -315,7 +497,7 @@ public:
 
         // because of the way isApprox works, need to fail on both slice and stack to count
         bool failedSlice = false;
-        for (int j=0; j<N3; j++)
+        for (int j=0; j<Size3(); j++)
         {
             if (!(slice(j)+ 0.001).isApprox(other.slice(j) + 0.001, 0.05))
             {
@@ -324,9 +506,9 @@ public:
         }
         if(failedSlice)
         {
-            for (int j1=0; j1<N1; j1++)
+            for (int j1=0; j1<Size1(); j1++)
             {
-                for (int j2=0; j2<N2; j2++)
+                for (int j2=0; j2<Size2(); j2++)
                 {
                     if (!(stack(j1, j2)+0.001).isApprox(other.stack(j1, j2) + 0.001, 0.05))
                     {
@@ -376,108 +558,324 @@ public:
         return *this;
     }
 
-    using Slice = Map<Array<T, -1, -1>, Unaligned, Stride<N3*N1, N3>>;
+    // the outer stride is that of the stored stacks, which is only Size1() if the field isn't compact,
+    // and the inner stride is only Size3() if it isn't part of a bundle
+    using SliceStride = Stride<Dynamic, Dynamic>;
+    using Slice = Map<Array<T, -1, -1>, Unaligned, SliceStride>;
     using Stack = Map<Array<T, -1, 1>, Aligned16>;
-    using ConstSlice = Map<const Array<T, -1, -1>, Unaligned, Stride<N3*N1, N3>>;
+    using ConstSlice = Map<const Array<T, -1, -1>, Unaligned, SliceStride>;
     using ConstStack = Map<const Array<T, -1, 1>, Aligned16>;
 
+    // a compact or distributed field's slices only have its stored stacks, in the order they are stored
     Slice slice(int n3)
     {
-        assert(n3>=0 && n3<N3);
-        return Slice(&Raw()[n3], N1, N2);
+        assert(n3>=0 && n3<Size3());
+        return Slice(&Raw()[n3], storedStacks.Count(), storedRows.Count(),
+                     SliceStride(Size3()*_interleave*storedStacks.Count(), Size3()*_interleave));
     }
     ConstSlice slice(int n3) const
     {
-        assert(n3>=0 && n3<N3);
-        return ConstSlice(&Raw()[n3], N1, N2);
+        assert(n3>=0 && n3<Size3());
+        return ConstSlice(&Raw()[n3], storedStacks.Count(), storedRows.Count(),
+                          SliceStride(Size3()*_interleave*storedStacks.Count(), Size3()*_interleave));
     }
 
+    // the stacks which a compact field doesn't store read as zero, but mustn't be written,
+    // so code which writes should only visit the active stacks, as ParallelPerStack does
+    // those of other processes read as zero too, but writing them is allowed, so that every process can run the same code
+    // (either way the writes go to a buffer which is shared by every thread, and are discarded)
     Stack stack(int n1, int n2)
     {
-        assert(n1>=0 && n1<N1);
-        assert(n2>=0 && n2<N2);
-        return Stack(&Raw()[(N1*n2 + n1)*N3], N3);
+        assert(n1>=0 && n1<Size1());
+        assert(n2>=0 && n2<Size2());
+
+        std::ptrdiff_t offset = StackOffset(n1, n2);
+        assert(offset >= 0 || (n1 < storedN1 && (n2 < storedN2Low || n2 >= storedN2High)));
+        if (offset < 0)
+        {
+            std::fill(_outside.begin(), _outside.end(), 0);
+            return Stack(_outside.data(), Size3());
+        }
+        return Stack(&Raw()[offset], Size3());
     }
-    virtual ConstStack stack(int n1, int n2) const override
+    ConstStack stack(int n1, int n2) const
     {
-        assert(n1>=0 && n1<N1);
-        assert(n2>=0 && n2<N2);
-        return ConstStack(&Raw()[(N1*n2 + n1)*N3], N3);
+        assert(n1>=0 && n1<Size1());
+        assert(n2>=0 && n2<Size2());
+
+        std::ptrdiff_t offset = StackOffset(n1, n2);
+        return ConstStack(offset < 0 ? _zeros.data() : &Raw()[offset], Size3());
     }
 
     T& operator()(int n1, int n2, int n3)
     {
-        return Raw()[(N1*n2 + n1)*N3 + n3];
+        return stack(n1, n2)(n3);
     }
     T operator()(int n1, int n2, int n3) const
     {
-        return Raw()[(N1*n2 + n1)*N3 + n3];
+        return stack(n1, n2)(n3);
+    }
+
+    // these are compile time constants unless the size is Dynamic
+    int Size1() const
+    {
+        return N1==Dynamic ? _n1 : N1;
+    }
+    int Size2() const
+    {
+        return N2==Dynamic ? _n2 : N2;
+    }
+    int Size3() const
+    {
+        return N3==Dynamic ? _n3 : N3;
     }
 
+    // the stored stacks, so only in the full (N1, N2, N3) layout if the field isn't compact or distributed,
+    // and with those of the other fields in between if it is part of a bundle
     T* Raw()
     {
-        return _data.data();
+        return _base + _slot*Size3();
     }
     const T* Raw() const
     {
-        return _data.data();
+        return _base + _slot*Size3();
+    }
+
+    // whether this is one of the fields of a FieldBundle, whose stacks are interleaved
+    bool Interleaved() const
+    {
+        return _interleave > 1;
+    }
+
+    // the number of values in the storage of this field, or of the bundle it is part of
+    std::size_t StoredSize() const
+    {
+        return static_cast<std::size_t>(storedStacks.Count())*storedRows.Count()*Size3()*_interleave;
+    }
+
+    // whether stack (n1, n2) is stored, which it is if it is one of this process's and allowed to be nonzero
+    bool Stores(int n1, int n2) const
+    {
+        return StackOffset(n1, n2) >= 0;
+    }
+
+    // whether only the stacks which are allowed to be nonzero are stored
+    bool Compact() const
+    {
+        return storedN1 < Size1() || storedN2Low < storedN2High;
+    }
+
+    // the stacks with j1 beyond this are never operated on
+    int ActiveSize1() const
+    {
+        return activeN1;
     }
 
     void Zero()
     {
-        for(T& datum : _data)
+        if (Interleaved())
         {
-            datum = 0;
+            for (int row=0; row<storedRows.Count(); row++)
+            {
+                for (int n=0; n<storedStacks.Count(); n++)
+                {
+                    std::fill_n(&Raw()[StoredOffset(n, row)], Size3(), 0);
+                }
+            }
+            return;
         }
+
+        std::fill_n(Raw(), StoredSize(), 0);
     }
 
 
     template<typename Solver>
-    void Solve(std::vector<Solver, aligned_allocator<Solver>>& solvers, Field<T, N1, N2, N3>& result) const
+    void Solve(const std::vector<Solver, aligned_allocator<Solver>>& solvers, Field<T, N1, N2, N3>& result) const
     {
-        assert(solvers.size() == N1*N2);
-        ParallelPerStack(
-            [&solvers,&result,this](int j1, int j2)
+        assert(solvers.size() == static_cast<std::size_t>(Size1()*Size2()));
+        ParallelPerBatch(TridiagonalBatch,
+            [&solvers,&result,this](int j1, int count, int j2)
             {
-                Dim3Solve(solvers[j1*N2+j2], j1, j2, result);
+                Dim3Solve(solvers, j1, count, j2, result);
             }
         );
     }
 
     template<typename Solver>
-    void Solve(Solver& solver, Field<T, N1, N2, N3>& result) const
+    void Solve(const Solver& solver, Field<T, N1, N2, N3>& result) const
     {
+        assert(solver.rows() == Size3());
         ParallelPerStack(
             [&solver,&result,this](int j1, int j2)
             {
-                Dim3Solve(solver, j1, j2, result);
+                solver.solve(stack(j1, j2).data(), result.stack(j1, j2).data());
             }
         );
     }
 
-    virtual void ParallelPerStack(std::function<void(int j1, int j2)> f) const
+    // calls f(j1, j2) for every stack which is allowed to be nonzero, split between threads
+    // (and only for this process's stacks if there are several)
+    template<typename F>
+    void ParallelPerStack(F f) const
+    {
+        OwnedStacks owned(activeN1);
+        OwnedRows rows = ActiveRows();
+
+        ParallelFor(owned.Count(), 0, rows.Count(), [&f, &owned, &rows](int n, int row)
+        {
+            f(owned[n], rows[row]);
+        });
+    }
+
+    // as above, but passes up to batchSize consecutive stacks in the 1st dimension at a time
+    template<typename F>
+    void ParallelPerBatch(int batchSize, F f) const
+    {
+        // so that the stacks within a batch are consecutive
+        assert(StackBlockSize%batchSize == 0);
+
+        OwnedStacks owned(activeN1);
+        OwnedRows rows = ActiveRows();
+        int batches = (owned.Count()+batchSize-1)/batchSize;
+
+        ParallelFor(batches, 0, rows.Count(), [&f, &owned, &rows, batchSize](int batch, int row)
+        {
+            int n = batch*batchSize;
+            f(owned[n], std::min(batchSize, owned.Count()-n), rows[row]);
+        });
+    }
+
+    // the number of real values in this process's stacks which are allowed to be nonzero
+    std::size_t PackedSize() const
+    {
+        return static_cast<std::size_t>(OwnedStacks(activeN1).Count())*ActiveRows().Count()*ValuesPerStack();
+    }
+
+    // copies those values out one stack after another, converted to S, so that fields can be stored compactly
+    // returns the end of what was written
+    template<typename S>
+    S* Pack(S* into) const
+    {
+        OwnedStacks owned(activeN1);
+        OwnedRows rows = ActiveRows();
+        int values = ValuesPerStack();
+
+        ParallelFor(owned.Count(), 0, rows.Count(), [=, &owned, &rows](int n, int row)
+        {
+            const stratifloat* from = reinterpret_cast<const stratifloat*>(stack(owned[n], rows[row]).data());
+            S* to = into + (static_cast<std::size_t>(row)*owned.Count() + n)*values;
+            for (int j=0; j<values; j++)
+            {
+                to[j] = static_cast<S>(from[j]);
+            }
+        });
+
+        return into + PackedSize();
+    }
+
+    // the reverse of Pack, which leaves the other stacks as they are
+    template<typename S>
+    const S* Unpack(const S* from)
+    {
+        OwnedStacks owned(activeN1);
+        OwnedRows rows = ActiveRows();
+        int values = ValuesPerStack();
+
+        ParallelFor(owned.Count(), 0, rows.Count(), [=, &owned, &rows](int n, int row)
+        {
+            stratifloat* to = reinterpret_cast<stratifloat*>(stack(owned[n], rows[row]).data());
+            const S* packed = from + (static_cast<std::size_t>(row)*owned.Count() + n)*values;
+            for (int j=0; j<values; j++)
+            {
+                to[j] = static_cast<stratifloat>(packed[j]);
+            }
+        });
+
+        return from + PackedSize();
+    }
+
+    // unpacks (1-fraction)*first + fraction*second from two arrays written by Pack, without unpacking either
+    template<typename S>
+    void UnpackInterpolated(const S* first, const S* second, stratifloat fraction)
     {
-        #pragma omp parallel for collapse(2)
-        for (int j2=0; j2<N2; j2++)
+        OwnedStacks owned(activeN1);
+        OwnedRows rows = ActiveRows();
+        int values = ValuesPerStack();
+
+        ParallelFor(owned.Count(), 0, rows.Count(), [=, &owned, &rows](int n, int row)
         {
-            for (int j1=0; j1<N1; j1++)
+            stratifloat* to = reinterpret_cast<stratifloat*>(stack(owned[n], rows[row]).data());
+            std::size_t offset = (static_cast<std::size_t>(row)*owned.Count() + n)*values;
+            for (int j=0; j<values; j++)
             {
-                f(j1, j2);
+                to[j] = (1-fraction)*static_cast<stratifloat>(first[offset+j])
+                      + fraction*static_cast<stratifloat>(second[offset+j]);
             }
+        });
+    }
+
+    void Save(std::ofstream& filestream) const
+    {
+        // every process has to take part, but only the first has the whole field to write
+        if (IsDistributed())
+        {
+            Field<T, N1, N2, N3> whole(BC(), Size1(), Size2(), Size3());
+            Gather(whole);
+
+            if (ProcessRank() == 0)
+            {
+                filestream.write(reinterpret_cast<const char*>(whole.Raw()), sizeof(T)*whole.StoredSize());
+            }
+            return;
+        }
+
+        if (Compact() || Interleaved())
+        {
+            // the file has the full layout either way, so the stacks which aren't stored are written as zeros
+            for (int j2=0; j2<Size2(); j2++)
+            {
+                for (int j1=0; j1<Size1(); j1++)
+                {
+                    filestream.write(reinterpret_cast<const char*>(stack(j1, j2).data()), sizeof(T)*Size3());
+                }
+            }
+        }
+        else
+        {
+            filestream.write(reinterpret_cast<const char*>(Raw()), sizeof(T)*StoredSize());
         }
     }
 
-    void Save(std::ofstream& filestream)
+    // copies every process's stacks into whole, which must be the same size, on the first process,
+    // where it is made to store every stack, so this is only for saving and plotting
+    // on the others whole is left as it is, but every process has to take part
+    void Gather(Field<T, N1, N2, N3>& whole) const
     {
-        filestream.write(reinterpret_cast<char*>(Raw()), sizeof(T)*N1*N2*N3);
+        assert(whole.Size1() == Size1() && whole.Size2() == Size2() && whole.Size3() == Size3());
+        assert(!whole.Interleaved() && !whole.Compact());
+
+        // the stacks of one field have to be together to be sent
+        if (Interleaved())
+        {
+            Field<T, N1, N2, N3> own(*this);
+            own.Gather(whole);
+            return;
+        }
+
+        if (ProcessRank() == 0)
+        {
+            whole.StoreEveryStack();
+        }
+
+        GatherStacks(Raw(), whole.Raw(), sizeof(T)*Size3(), storedN1, Size1(), storedN2Low, storedN2High, Size2());
     }
 
     void ZeroEnds()
     {
         slice(0).setZero();
         slice(1).setZero();
-        slice(N3-1).setZero();
-        slice(N3-2).setZero();
+        slice(Size3()-1).setZero();
+        slice(Size3()-2).setZero();
 
         if (BC() == BoundaryCondition::Dirichlet)
         {
@@ -491,7 +889,7 @@ public:
 
         if (BC() == BoundaryCondition::Neumann)
         {
-            slice(N3-1) = slice(N3-2);
+            slice(Size3()-1) = slice(Size3()-2);
         }
         else
         {
@@ -499,51 +897,162 @@ public:
         }
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
         return _bc;
     }
 
+protected:
+    // only the stacks with j1<activeN1, and j2<activeN2Low or j2>=activeN2High, are operated on
+    // this lets derived fields skip stacks which are always zero
+    // if compact, they are also the only stacks which are stored, which discards the values of the others
+    void SetActiveStacks(int n1, int n2Low, int n2High, bool compact = false)
+    {
+        activeN1 = n1;
+        activeN2Low = n2Low;
+        activeN2High = n2High;
+
+        if (compact)
+        {
+            storedN1 = n1;
+            storedN2Low = n2Low;
+            storedN2High = n2High;
+
+            storedStacks = OwnedStacks(storedN1);
+            storedRows = OwnedRows(storedN2Low, storedN2High, Size2());
+            LayOutStorage();
+        }
+    }
+
+    // stores the stacks of every process, rather than only this one's, which discards the values
+    // these are still only operated on by this process, so this is for a whole field to gather into
+    void StoreEveryStack()
+    {
+        assert(!Interleaved());
+
+        storedStacks = OwnedStacks(storedN1, 0, 1);
+        storedRows = OwnedRows(storedN2Low, storedN2High, Size2(), 0, 1);
+        LayOutStorage();
+    }
+
+    // makes this field slot of the count which are interleaved in the storage at base, giving up its own
+    // the active stacks must already be set, as the storage is laid out as for those
+    void ShareStorage(T* base, int count, int slot)
+    {
+        assert(slot < count);
+
+        std::vector<T, aligned_allocator<T>>().swap(_data);
+        _base = base;
+        _interleave = count;
+        _slot = slot;
+    }
+
 private:
+    int ValuesPerStack() const
+    {
+        return Size3()*sizeof(T)/sizeof(stratifloat);
+    }
 
-    template<typename Solver>
-    void Dim3Solve(Solver& solver, int j1, int j2, Field<stratifloat, N1, N2, N3>& result) const
+    // this process's active values of j2
+    OwnedRows ActiveRows() const
+    {
+        return OwnedRows(activeN2Low, activeN2High, Size2());
+    }
+
+    // allocates the stored stacks, which are zero
+    void LayOutStorage()
     {
-        assert(solver.rows() == N3);
+        _data.assign(static_cast<std::size_t>(storedStacks.Count())*storedRows.Count()*Size3(), 0);
+        _base = _data.data();
 
-        Matrix<stratifloat, N3, 1> col = stack(j1, j2);
-        Matrix<stratifloat, N3, 1> res = solver.solve(col);
-        result.stack(j1, j2) = res;
+        if (static_cast<long>(storedStacks.Count())*storedRows.Count() < static_cast<long>(Size1())*Size2())
+        {
+            _zeros.assign(Size3(), 0);
+            _outside.assign(Size3(), 0);
+        }
+    }
+
+    // where stack (n1, n2) starts in _data, or -1 if it isn't stored
+    std::ptrdiff_t StackOffset(int n1, int n2) const
+    {
+        int n = storedStacks.Index(n1);
+        int row = storedRows.Index(n2);
+        if (n < 0 || row < 0)
+        {
+            return -1;
+        }
+
+        return StoredOffset(n, row);
+    }
+
+    // where the nth stored stack of the given stored row starts
+    std::ptrdiff_t StoredOffset(int n, int row) const
+    {
+        return (static_cast<std::ptrdiff_t>(storedStacks.Count())*row + n)*Size3()*_interleave;
     }
 
     template<typename Solver>
-    void Dim3Solve(Solver& solver, int j1, int j2, Field<complex, N1, N2, N3>& result) const
+    void Dim3Solve(const std::vector<Solver, aligned_allocator<Solver>>& solvers, int j1, int count, int j2, Field<T, N1, N2, N3>& result) const
     {
-        assert(solver.rows() == N3);
+        assert(solvers[0].rows() == Size3());
+        assert(count <= TridiagonalBatch);
 
-        Matrix<stratifloat, N3, 1> col = stack(j1, j2).real();
-        Matrix<stratifloat, N3, 1> res = solver.solve(col);
-        result.stack(j1, j2).real() = res;
+        // count is at least 1, but the compiler can't tell that the first lane is always set
+        const Solver* batchSolvers[TridiagonalBatch] = {};
+        const T* in[TridiagonalBatch] = {};
+        T* out[TridiagonalBatch] = {};
 
-        col = stack(j1, j2).imag();
-        res = solver.solve(col);
-        result.stack(j1, j2).imag() = res;
+        for (int lane=0; lane<count; lane++)
+        {
+            batchSolvers[lane] = &solvers[(j1+lane)*Size2()+j2];
+            in[lane] = stack(j1+lane, j2).data();
+            out[lane] = result.stack(j1+lane, j2).data();
+        }
+
+        Solver::solveBatch(batchSolvers, in, out, count);
     }
 
+    // only used for dimensions which are Dynamic
+    int _n1;
+    int _n2;
+    int _n3;
 
-    // stored in column-major ordering of size (N1, N2, N3)
+    // stored in column-major ordering of size (N1, N2, N3), or if compact or distributed, of only the stored stacks
+    // this is empty if the values are in a FieldBundle instead
     std::vector<T, aligned_allocator<T>> _data;
 
+    // where the values are, which for part of a bundle is shared with its other fields,
+    // with each stack followed by the same stack of the next field
+    T* _base;
+    int _interleave;
+    int _slot;
+
     BoundaryCondition _bc;
 
+    int activeN1;
+    int activeN2Low;
+    int activeN2High;
+
+    // the same as the active stacks if compact, and otherwise all of them
+    int storedN1;
+    int storedN2Low;
+    int storedN2High;
+
+    // of those, the ones which are stored, which are only this process's unless the field stores every stack
+    OwnedStacks storedStacks;
+    OwnedRows storedRows;
+
+    // what the stacks which aren't stored read as, and where writes to them go
+    std::vector<T, aligned_allocator<T>> _zeros;
+    std::vector<T, aligned_allocator<T>> _outside;
 };
 
 template<typename T, int N1, int N2, int N3>
-class Field1D : public StackContainer<Map<const Array<T, -1, 1>, Aligned16>, T, N1, N2, N3>
+class Field1D : public StackContainer<Field1D<T, N1, N2, N3>, T, N1, N2, N3>
 {
 public:
-    Field1D(BoundaryCondition bc)
-    : _data(N3)
+    Field1D(BoundaryCondition bc, int n3 = Extent(N3, gridParams.N3))
+    : _data(n3)
     , _bc(bc)
     {
         _data.setZero();
@@ -586,21 +1095,18 @@ public:
         return *this;
     }
 
-    virtual Map<const Array<T, -1, 1>, Aligned16> stack(int n1, int n2) const override
+    Map<const Array<T, -1, 1>, Aligned16> stack(int n1, int n2) const
     {
-        return Map<const Array<T, -1, 1>, Aligned16>(Raw(), N3);
+        return Map<const Array<T, -1, 1>, Aligned16>(Raw(), Size3());
     }
 
 
     template<typename Solver>
-    void Solve(Solver& solver, Field1D<T, N1, N2, N3>& result) const
+    void Solve(const Solver& solver, Field1D<T, N1, N2, N3>& result) const
     {
-        assert(solver.rows() == N3);
+        assert(solver.rows() == Size3());
 
-        Matrix<T, N3, 1> in = Get();
-        Matrix<T, N3, 1> out(N3);
-        out = solver.solve(in);
-        result.Get() = out;
+        solver.solve(Raw(), result.Raw());
     }
 
     T* Raw()
@@ -612,6 +1118,11 @@ public:
         return _data.data();
     }
 
+    int Size3() const
+    {
+        return N3==Dynamic ? _data.size() : N3;
+    }
+
     Array<T, -1, 1>& Get()
     {
         return _data;
@@ -626,8 +1137,8 @@ public:
     {
         Get()(0) = 0;
         Get()(1) = 0;
-        Get()(N3-2) = 0;
-        Get()(N3-1) = 0;
+        Get()(Size3()-2) = 0;
+        Get()(Size3()-1) = 0;
 
         if (BC() == BoundaryCondition::Dirichlet)
         {
@@ -635,7 +1146,7 @@ public:
         }
     }
 
-    virtual BoundaryCondition BC() const override
+    BoundaryCondition BC() const
     {
         return _bc;
     }
@@ -660,8 +1171,8 @@ public:
 
     void SetValue(std::function<stratifloat(stratifloat)> f, stratifloat L3)
     {
-        ArrayX z = VerticalPointsFractional(L3, N3);
-        for (int j3=0; j3<N3; j3++)
+        ArrayX z = VerticalPointsFractional(L3, this->Size3());
+        for (int j3=0; j3<this->Size3(); j3++)
         {
             this->Get()(j3) = f(z(j3));
         }
@@ -670,14 +1181,14 @@ public:
         {
             this->Get()(1)=this->Get()(2);
             this->Get()(0)=this->Get()(1);
-            this->Get()(N3-2)=this->Get()(N3-3);
-            this->Get()(N3-1)=this->Get()(N3-2);
+            this->Get()(this->Size3()-2)=this->Get()(this->Size3()-3);
+            this->Get()(this->Size3()-1)=this->Get()(this->Size3()-2);
         }
         else
         {
             this->Get()(1)=-this->Get()(2);
             this->Get()(0)=this->Get()(1);
-            this->Get()(N3-1)=-this->Get()(N3-2);
+            this->Get()(this->Size3()-1)=-this->Get()(this->Size3()-2);
         }
     }
 
@@ -696,6 +1207,23 @@ public:
 template<int N1, int N2, int N3>
 class ModalField;
 
+template<int N1, int N2, int N3>
+class FieldBundle;
+
+// whether modal fields only store the wavenumbers which the dealiasing keeps, which is a third less memory,
+// and so a third less to read and write in every operation, with the rest zero padded only for the FFTs
+// this can be turned off by setting STRATIFLOW_COMPACT_MODAL=0 to compare against
+inline bool CompactModalStorage()
+{
+    static const bool enabled = []()
+    {
+        const char* setting = std::getenv("STRATIFLOW_COMPACT_MODAL");
+        return setting == nullptr || std::string(setting) != "0";
+    }();
+
+    return enabled;
+}
+
 template<int N1, int N2, int N3>
 class NodalField : public Field<stratifloat, N1, N2, N3>
 {
@@ -707,63 +1235,79 @@ public:
         return *this;
     }
 
-    NodalField(BoundaryCondition bc)
-    : Field<stratifloat, N1, N2, N3>(bc)
+    NodalField(BoundaryCondition bc,
+               int n1 = Extent(N1, gridParams.N1),
+               int n2 = Extent(N2, gridParams.N2),
+               int n3 = Extent(N3, gridParams.N3))
+    : Field<stratifloat, N1, N2, N3>(bc, n1, n2, n3)
     {
-        int dims[] = {N2, N1};
-        int odims[] = {N2, N1/2+1};
-
-        std::vector<stratifloat, aligned_allocator<stratifloat>> inputData(N1*N2*N3);
-        std::vector<complex, aligned_allocator<complex>> outputData((N1/2+1)*N2*N3);
-
-        auto plan = f3_plan_many_dft_r2c(2,
-                                        dims,
-                                        N3,
-                                        inputData.data(),
-                                        dims,
-                                        N3,
-                                        1,
-                                        reinterpret_cast<f3_complex*>(outputData.data()),
-                                        odims,
-                                        N3,
-                                        1,
-                                        FFTW_PATIENT);
+    }
 
+    // field k of the bundle, whose storage this is a view of
+    // if the bundle has fewer fields, this has its own storage, so that which are bundled can depend on the grid
+    NodalField(BoundaryCondition bc, FieldBundle<N1, N2, N3>& bundle, int k)
+    : Field<stratifloat, N1, N2, N3>(bc, bundle.NodalSize1(), bundle.Size2(), bundle.Size3())
+    {
+        if (k < bundle.Count())
+        {
+            this->ShareStorage(bundle.Attach(this, k), bundle.Count(), k);
+        }
     }
 
+    // without a scratch space, each thread uses its own, as for ModalField::ToNodal
+    // a compact field only keeps the dealiased wavenumbers, so is always filtered
     void ToModal(ModalField<N1,N2,N3>& other, bool filter = true) const
+    {
+        static thread_local TransformScratch scratch;
+        ToModal(other, scratch, filter);
+    }
+
+    // a compact field only stores the wavenumbers which the filter keeps, so it can't be given filter = false
+    void ToModal(ModalField<N1,N2,N3>& other, TransformScratch& scratch, bool filter = true) const
     {
         assert(other.BC() == this->BC());
+        assert(filter || !other.Compact());
 
-        // do FFT in 1st and 2nd dimensions
+        // the transforms need the stacks of one field together, so part of a bundle goes through a copy
+        if (this->Interleaved() || other.Interleaved())
+        {
+            NodalField<N1, N2, N3> from(*this);
+            ModalField<N1, N2, N3> to(other);
+            from.ToModal(to, scratch, filter);
+            other = to;
+            return;
+        }
+
+        if (other.Compact())
+        {
+            // transform into the full size, and normalise the retained wavenumbers as we copy them out
+            // as only those are kept, the rest needn't be transformed in the 2nd dimension
+            int M1 = other.Size1();
+            scratch.modal.resize(OwnedStacks(M1).Count()*OwnedRows(this->Size2(), this->Size2(), this->Size2()).Count()*this->Size3());
+            PerformPrunedR2C(this->Size1(), this->Size2(), this->Size3(), other.ActiveSize1(), this->Raw(), scratch.modal.data(), scratch);
+
+            stratifloat scale = 1/static_cast<stratifloat>(this->Size1()*this->Size2());
+            other.ParallelPerStack([&other, &scratch, M1, scale, this](int j1, int j2)
+            {
+                const complex* from = &scratch.modal[StackIndex(j1, j2, M1, this->Size2())*this->Size3()];
+                other.stack(j1, j2) = scale*Map<const ArrayXc, Aligned16>(from, this->Size3());
+            });
+            return;
+        }
 
-        int dims[] = {N2, N1};
-        int odims[] = {N2, N1/2+1};
-        auto plan = f3_plan_many_dft_r2c(2,
-                                        dims,
-                                        N3,
-                                        const_cast<stratifloat*>(this->Raw()),
-                                        dims,
-                                        N3,
-                                        1,
-                                        reinterpret_cast<f3_complex*>(other.Raw()),
-                                        odims,
-                                        N3,
-                                        1,
-                                        FFTW_PATIENT);
-        f3_execute(plan);
-        f3_destroy_plan(plan);
+        // do FFT in 1st and 2nd dimensions
+        PerformR2C(this->Size1(), this->Size2(), this->Size3(), this->Raw(), other.Raw(), scratch);
 
         if (filter)
         {
-            other *= 1/static_cast<stratifloat>(N1*N2);
+            other *= 1/static_cast<stratifloat>(this->Size1()*this->Size2());
             other.Filter();
         }
         else
         {
-            for (int j=0; j<N3*N2*(N1/2+1); j++)
+            for (std::size_t j=0; j<other.StoredSize(); j++)
             {
-                other.Raw()[j] *= 1/static_cast<stratifloat>(N1*N2);
+                other.Raw()[j] *= 1/static_cast<stratifloat>(this->Size1()*this->Size2());
             }
         }
     }
@@ -772,28 +1316,33 @@ public:
     {
         stratifloat max = 0;
 
-        for (int j3=0; j3<N3; j3++)
+        OwnedStacks owned(this->Size1());
+        OwnedRows rows(this->Size2(), this->Size2(), this->Size2());
+        for (int row=0; row<rows.Count(); row++)
         {
-            stratifloat norm = this->slice(j3).matrix().template lpNorm<Infinity>();
-            if (norm > max)
+            for (int n=0; n<owned.Count(); n++)
             {
-                max = norm;
+                stratifloat norm = this->stack(owned[n], rows[row]).abs().maxCoeff();
+                if (norm > max)
+                {
+                    max = norm;
+                }
             }
         }
 
-        return max;
+        return MaxOverProcesses(max);
     }
 
     void SetValue(std::function<stratifloat(stratifloat)> f, stratifloat L3)
     {
-        ArrayX z = VerticalPointsFractional(L3, N3);
+        ArrayX z = VerticalPointsFractional(L3, this->Size3());
 
         if (this->BC() == BoundaryCondition::Dirichlet)
         {
-            z = VerticalPoints(L3,N3);
+            z = VerticalPoints(L3,this->Size3());
         }
 
-        for (int j3=0; j3<N3; j3++)
+        for (int j3=0; j3<this->Size3(); j3++)
         {
             this->slice(j3).setConstant(f(z(j3)));
         }
@@ -802,36 +1351,39 @@ public:
         {
             this->slice(1)=this->slice(2);
             this->slice(0)=this->slice(1);
-            this->slice(N3-2)=this->slice(N3-3);
-            this->slice(N3-1)=this->slice(N3-2);
+            this->slice(this->Size3()-2)=this->slice(this->Size3()-3);
+            this->slice(this->Size3()-1)=this->slice(this->Size3()-2);
         }
         else
         {
             this->slice(1)=-this->slice(2);
             this->slice(0)=this->slice(1);
-            this->slice(N3-1)=-this->slice(N3-2);
+            this->slice(this->Size3()-1)=-this->slice(this->Size3()-2);
         }
     }
 
     void SetValue(std::function<stratifloat(stratifloat,stratifloat,stratifloat)> f, stratifloat L1, stratifloat L2, stratifloat L3, bool imposeVelBC=false)
     {
-        ArrayX x = FourierPoints(L1, N1);
-        ArrayX y = FourierPoints(L2, N2);
+        ArrayX x = FourierPoints(L1, this->Size1());
+        ArrayX y = FourierPoints(L2, this->Size2());
 
-        ArrayX z = VerticalPointsFractional(L3, N3);
+        ArrayX z = VerticalPointsFractional(L3, this->Size3());
 
         if (this->BC() == BoundaryCondition::Dirichlet)
         {
-            z = VerticalPoints(L3,N3);
+            z = VerticalPoints(L3,this->Size3());
         }
 
-        for (int j1=0; j1<N1; j1++)
+        // only this process's stacks are stored
+        OwnedStacks owned(this->Size1());
+        OwnedRows rows(this->Size2(), this->Size2(), this->Size2());
+        for (int n=0; n<owned.Count(); n++)
         {
-            for (int j2=0; j2<N2; j2++)
+            for (int row=0; row<rows.Count(); row++)
             {
-                for (int j3=0; j3<N3; j3++)
+                for (int j3=0; j3<this->Size3(); j3++)
                 {
-                    (*this)(j1,j2,j3) = f(x(j1), y(j2), z(j3));
+                    (*this)(owned[n],rows[row],j3) = f(x(owned[n]), y(rows[row]), z(j3));
                 }
             }
         }
@@ -842,22 +1394,22 @@ public:
             if (imposeVelBC)
             {
                 this->slice(1)=this->slice(2);
-                this->slice(N3-2)=this->slice(N3-3);
+                this->slice(this->Size3()-2)=this->slice(this->Size3()-3);
 
                 this->slice(0)=this->slice(1);
-                this->slice(N3-1)=this->slice(N3-2);
+                this->slice(this->Size3()-1)=this->slice(this->Size3()-2);
             }
             else
             {
                 this->slice(0).setZero();
-                this->slice(N3-1).setZero();
+                this->slice(this->Size3()-1).setZero();
             }
         }
         else
         {
             this->slice(1)=-this->slice(2);
             this->slice(0)=this->slice(1);
-            this->slice(N3-1)=-this->slice(N3-2);
+            this->slice(this->Size3()-1)=-this->slice(this->Size3()-2);
         }
     }
 
@@ -872,14 +1424,14 @@ public:
 
     void Antisymmetrise()
     {
-        for (int j1=1; j1<N1/2; j1++)
+        for (int j1=1; j1<this->Size1()/2; j1++)
         {
-            int otherj1 = N1-j1;
-            for (int j2=0; j2<N2; j2++)
+            int otherj1 = this->Size1()-j1;
+            for (int j2=0; j2<this->Size2(); j2++)
             {
-                for (int j3=0; j3<N3/2; j3++)
+                for (int j3=0; j3<this->Size3()/2; j3++)
                 {
-                    int otherj3 = N3-j3;
+                    int otherj3 = this->Size3()-j3;
 
                     if (this->BC() == BoundaryCondition::Neumann)
                     {
@@ -902,20 +1454,51 @@ public:
 
     void Load(std::ifstream& filestream, bool twoDimensional = false)
     {
+        if (this->Interleaved())
+        {
+            NodalField<N1, N2, N3> loaded(this->BC(), this->Size1(), this->Size2(), this->Size3());
+            loaded.Load(filestream, twoDimensional);
+            *this = loaded;
+            return;
+        }
+
+        // each process reads its own stacks from where they are in the file, and then goes to the end of the field
+        if (IsDistributed())
+        {
+            std::streampos start = filestream.tellg();
+            std::size_t stackSize = sizeof(stratifloat)*this->Size3();
+
+            OwnedStacks owned(this->Size1());
+            OwnedRows rows(this->Size2(), this->Size2(), this->Size2());
+            for (int row=0; row<rows.Count(); row++)
+            {
+                // a 2D file only has the first plane, which is duplicated spanwise
+                int j2 = twoDimensional ? 0 : rows[row];
+                for (int n=0; n<owned.Count(); n++)
+                {
+                    filestream.seekg(start + static_cast<std::streamoff>(stackSize*(this->Size1()*j2 + owned[n])));
+                    filestream.read(reinterpret_cast<char*>(this->stack(owned[n], rows[row]).data()), stackSize);
+                }
+            }
+
+            filestream.seekg(start + static_cast<std::streamoff>(stackSize*this->Size1()*(twoDimensional ? 1 : this->Size2())));
+            return;
+        }
+
         if (twoDimensional)
         {
             // load into first plane
-            filestream.read(reinterpret_cast<char*>(this->Raw()), sizeof(stratifloat)*N1*N3);
+            filestream.read(reinterpret_cast<char*>(this->Raw()), sizeof(stratifloat)*this->Size1()*this->Size3());
 
             // then duplicate spanwise
-            for (int n=1; n<N2; n++)
+            for (int n=1; n<this->Size2(); n++)
             {
-                std::memcpy(&this->operator()(0,n,0), &this->operator()(0,n-1,0), sizeof(stratifloat)*N1*N3);
+                std::memcpy(&this->operator()(0,n,0), &this->operator()(0,n-1,0), sizeof(stratifloat)*this->Size1()*this->Size3());
             }
         }
         else
         {
-            filestream.read(reinterpret_cast<char*>(this->Raw()), sizeof(stratifloat)*N1*N2*N3);
+            filestream.read(reinterpret_cast<char*>(this->Raw()), sizeof(stratifloat)*this->Size1()*this->Size2()*this->Size3());
         }
     }
 
@@ -923,100 +1506,137 @@ public:
 };
 
 template<int N1, int N2, int N3>
-class ModalField : public Field<complex, N1/2+1, N2, N3>
+class ModalField : public Field<complex, ModalSize(N1), N2, N3>
 {
-    static constexpr int actualN1 = N1/2 + 1;
-
     bool filterSpanwise;
+    int _nodalN1;
 public:
     template<typename A>
-    const ModalField<N1, N2, N3>& operator=(const StackContainer<A,complex, N1/2+1, N2, N3>& other)
+    const ModalField<N1, N2, N3>& operator=(const StackContainer<A,complex, ModalSize(N1), N2, N3>& other)
     {
-        Field<complex, N1/2+1, N2, N3>::operator=(other);
+        Field<complex, ModalSize(N1), N2, N3>::operator=(other);
         return *this;
     }
 
-    ModalField(BoundaryCondition bc, bool filterSpanwise)
-    : Field<complex, N1/2+1, N2, N3>(bc), filterSpanwise(filterSpanwise)
+    // the sizes are those of the corresponding nodal field
+    // whether only the dealiased stacks are stored is normally left to STRATIFLOW_COMPACT_MODAL
+    ModalField(BoundaryCondition bc, bool filterSpanwise,
+               int n1 = Extent(N1, gridParams.N1),
+               int n2 = Extent(N2, gridParams.N2),
+               int n3 = Extent(N3, gridParams.N3),
+               bool compact = CompactModalStorage())
+    : Field<complex, ModalSize(N1), N2, N3>(bc, n1/2+1, n2, n3), filterSpanwise(filterSpanwise), _nodalN1(n1)
     {
-        inputData.resize(actualN1*N2*N3);
-
-        std::vector<stratifloat, aligned_allocator<stratifloat>> outputData(N1*N2*N3);
-
-        int dims[] = {N2, N1};
-        int idims[] = {N2, actualN1};
-
-        auto plan = f3_plan_many_dft_c2r(2,
-                                dims,
-                                N3,
-                                reinterpret_cast<f3_complex*>(inputData.data()),
-                                idims,
-                                N3,
-                                1,
-                                outputData.data(),
-                                dims,
-                                N3,
-                                1,
-                                FFTW_PATIENT);
-
+        // everything else is removed by the 2/3 dealiasing rule
+        if (this->Size2()>1 && filterSpanwise)
+        {
+            this->SetActiveStacks(NodalSize1()/3, this->Size2()/3, this->Size2()-(this->Size2()/3)+1, compact);
+        }
+        else
+        {
+            this->SetActiveStacks(NodalSize1()/3, this->Size2(), this->Size2(), compact);
+        }
     }
 
+    // field k of the bundle, or with its own storage if there isn't one, as for NodalField
+    ModalField(BoundaryCondition bc, bool filterSpanwise, FieldBundle<N1, N2, N3>& bundle, int k)
+    : ModalField(bc, filterSpanwise, bundle.NodalSize1(), bundle.Size2(), bundle.Size3(), bundle.Compact())
+    {
+        if (k < bundle.Count())
+        {
+            this->ShareStorage(bundle.Attach(this, k), bundle.Count(), k);
+        }
+    }
 
+    // without a scratch space, each thread uses its own
+    // so this must not be used by tasks which may run while the same thread is part way through another transform
     void ToNodal(NodalField<N1, N2, N3>& other) const
+    {
+        static thread_local TransformScratch scratch;
+        ToNodal(other, scratch);
+    }
+
+    void ToNodal(NodalField<N1, N2, N3>& other, TransformScratch& scratch) const
     {
         assert(other.BC() == this->BC());
 
-        // do IFT in 1st and 2nd dimensions
+        // the transforms need the stacks of one field together, so part of a bundle goes through a copy
+        if (this->Interleaved() || other.Interleaved())
+        {
+            ModalField<N1, N2, N3> from(*this);
+            NodalField<N1, N2, N3> to(other);
+            from.ToNodal(to, scratch);
+            other = to;
+            return;
+        }
 
-        // make a copy of the input data as it is modified by the transform
-        #pragma omp parallel for
-        for (unsigned int j=0; j<actualN1*N2*N3; j++)
+        // do IFT in 1st and 2nd dimensions
+        // unless only the dealiased spanwise wavenumbers are stored, the stored stacks make up whole columns
+        // in the 2nd dimension, so the first stage reads them where they are, and only the scratch space is overwritten
+        // (the wavenumbers beyond those stored are zero, and so aren't transformed in the 2nd dimension)
+        if (!this->Compact() || this->Size2() == 1 || !filterSpanwise)
         {
-            inputData[j] = this->Raw()[j];
+            int stored1 = this->Compact() ? this->ActiveSize1() : this->Size1();
+            PerformPrunedC2R(NodalSize1(), this->Size2(), this->Size3(), stored1, this->Raw(), other.Raw(), scratch);
+            return;
         }
 
-        int dims[] = {N2, N1};
-        int idims[] = {N2, actualN1};
-        auto plan = f3_plan_many_dft_c2r(2,
-                                        dims,
-                                        N3,
-                                        reinterpret_cast<f3_complex*>(inputData.data()),
-                                        idims,
-                                        N3,
-                                        1,
-                                        other.Raw(),
-                                        dims,
-                                        N3,
-                                        1,
-                                        FFTW_PATIENT);
-        f3_execute(plan);
-        f3_destroy_plan(plan);
+        // otherwise they are zero padded into the scratch space, which is transformed in place
+        OwnedStacks owned(this->Size1());
+        OwnedRows rows(this->Size2(), this->Size2(), this->Size2());
+        scratch.modal.resize(static_cast<std::size_t>(owned.Count())*rows.Count()*this->Size3());
+        ParallelFor(owned.Count(), 0, rows.Count(), [&scratch, &owned, &rows, this](int n, int row)
+        {
+            complex* to = &scratch.modal[(static_cast<std::size_t>(owned.Count())*row + n)*this->Size3()];
+            Map<ArrayXc, Aligned16>(to, this->Size3()) = this->stack(owned[n], rows[row]);
+        });
+
+        PerformPrunedC2R(NodalSize1(), this->Size2(), this->Size3(), this->ActiveSize1(), scratch.modal.data(), other.Raw(), scratch);
+    }
+
+    // size of the 1st dimension in physical space
+    int NodalSize1() const
+    {
+        return N1==Dynamic ? _nodalN1 : N1;
+    }
+
+    bool FiltersSpanwise() const
+    {
+        return filterSpanwise;
     }
 
     void Filter()
     {
-        if (N1>2)
+        // the wavenumbers which would be removed aren't stored
+        if (this->Compact())
+        {
+            return;
+        }
+
+        // only this process's stacks are stored, of which those j1 < first come first
+        OwnedStacks owned(this->Size1());
+        OwnedRows rows(this->Size2(), this->Size2(), this->Size2());
+
+        if (NodalSize1()>2)
         {
-            #pragma omp parallel for collapse(2)
-            for (int j2=0; j2<N2; j2++)
+            int kept = OwnedStacks(NodalSize1()/3).Count();
+            ParallelFor(owned.Count()-kept, 0, rows.Count(), [this, &owned, &rows, kept](int n, int row)
             {
-                for (int j1=N1/3; j1<actualN1; j1++)
-                {
-                    this->stack(j1, j2).setZero();
-                }
-            }
+                this->stack(owned[kept+n], rows[row]).setZero();
+            });
         }
 
-        if (N2>2 && filterSpanwise)
+        if (this->Size2()>2 && filterSpanwise)
         {
-            #pragma omp parallel for collapse(2)
-            for (int j2=(N2/3); j2<=N2-(N2/3); j2++)
+            int low = this->Size2()/3;
+            int high = this->Size2()-(this->Size2()/3)+1;
+            ParallelFor(owned.Count(), 0, rows.Count(), [this, &owned, &rows, low, high](int n, int row)
             {
-                for (int j1=0; j1<actualN1; j1++)
+                if (rows[row] >= low && rows[row] < high)
                 {
-                    this->stack(j1, j2).setZero();
+                    this->stack(owned[n], rows[row]).setZero();
                 }
-            }
+            });
         }
     }
 
@@ -1031,9 +1651,9 @@ public:
         std::uniform_real_distribution<stratifloat> rng(-1.0,1.0);
 
         int j3min = 1;
-        int j3max = N3-1;
+        int j3max = this->Size3()-1;
         this->slice(0).setZero();
-        this->slice(N3-1).setZero();
+        this->slice(this->Size3()-1).setZero();
 
         if (this->BC() == BoundaryCondition::Dirichlet)
         {
@@ -1042,27 +1662,37 @@ public:
             this->slice(1).setZero();
         }
 
-        for (int j1=0; j1<0.5*cutoff*N1; j1++)
+        for (int j1=0; j1<0.5*cutoff*NodalSize1(); j1++)
         {
             for (int j3=j3min; j3<j3max; j3++)
             {
 
+                // each process only sets its own stacks
                 if (!filterSpanwise)
                 {
-                    for (int j2=0; j2<N2; j2++)
+                    for (int j2=0; j2<this->Size2(); j2++)
                     {
-                        this->operator()(j1,j2,j3) = rng(generator) + i*rng(generator);
+                        if (this->Stores(j1, j2))
+                        {
+                            this->operator()(j1,j2,j3) = rng(generator) + i*rng(generator);
+                        }
                     }
                 }
                 else
                 {
-                    for (int j2=0; j2<0.5*cutoff*N2; j2++)
+                    for (int j2=0; j2<0.5*cutoff*this->Size2(); j2++)
                     {
-                        this->operator()(j1,j2,j3) = rng(generator) + i*rng(generator);
+                        if (this->Stores(j1, j2))
+                        {
+                            this->operator()(j1,j2,j3) = rng(generator) + i*rng(generator);
+                        }
                     }
-                    for (int j2=N2-1; j2>(1-0.5*cutoff)*N2; j2--)
+                    for (int j2=this->Size2()-1; j2>(1-0.5*cutoff)*this->Size2(); j2--)
                     {
-                        this->operator()(j1,j2,j3) = rng(generator) + i*rng(generator);
+                        if (this->Stores(j1, j2))
+                        {
+                            this->operator()(j1,j2,j3) = rng(generator) + i*rng(generator);
+                        }
                     }
                 }
             }
@@ -1075,20 +1705,20 @@ public:
         std::mt19937 generator(rd());
         std::uniform_real_distribution<stratifloat> rng(-1.0,1.0);
 
-        ArrayX z = VerticalPointsFractional(L,N3);
+        ArrayX z = VerticalPointsFractional(L,this->Size3());
 
         if (this->BC() == BoundaryCondition::Dirichlet)
         {
-            z = VerticalPoints(L,N3);
+            z = VerticalPoints(L,this->Size3());
         }
 
-        int M2=N2/2;
+        int M2=this->Size2()/2;
         if (filterSpanwise)
         {
-            M2=N2/6;
+            M2=this->Size2()/6;
         }
 
-        for (int j1=0; j1<N1/6; j1++)
+        for (int j1=0; j1<NodalSize1()/6; j1++)
         {
             for (int j2=-M2; j2<=M2; j2++)
             {
@@ -1100,9 +1730,15 @@ public:
                 }
 
                 int actualj2 = j2;
-                if (actualj2<0) actualj2 += N2;
+                if (actualj2<0) actualj2 += this->Size2();
 
-                for (int j3=0; j3<N3; j3++)
+                // each process only sets its own stacks
+                if (!this->Stores(j1, actualj2))
+                {
+                    continue;
+                }
+
+                for (int j3=0; j3<this->Size3(); j3++)
                 {
                     this->operator()(j1,actualj2,j3) = 0;
 
@@ -1117,57 +1753,18 @@ public:
 
     void MakeMode2()
     {
-        for (int j2=0; j2<N2; j2++)
+        this->ParallelPerStack([this](int j1, int j2)
         {
-            for (int j1=1; j1<actualN1; j1+=2)
+            if (j1%2 == 1)
             {
                 this->stack(j1,j2).setZero();
             }
-        }
-    }
-
-    virtual void ParallelPerStack(std::function<void(int j1, int j2)> f) const override
-    {
-        int maxN1 = N1/3;
-        int maxN2 = N2/3;
-        int minN2 = N2-(N2/3)+1;
-
-        if(N2>1 && filterSpanwise)
-        {
-            #pragma omp parallel for collapse(2)
-            for (int j2=0; j2<maxN2; j2++)
-            {
-                for (int j1=0; j1<maxN1; j1++)
-                {
-                    f(j1, j2);
-                }
-            }
-
-            #pragma omp parallel for collapse(2)
-            for (int j2=minN2; j2<N2; j2++)
-            {
-                for (int j1=0; j1<maxN1; j1++)
-                {
-                    f(j1, j2);
-                }
-            }
-        }
-        else
-        {
-            #pragma omp parallel for collapse(2)
-            for (int j2=0; j2<N2; j2++)
-            {
-                for (int j1=0; j1<maxN1; j1++)
-                {
-                    f(j1, j2);
-                }
-            }
-        }
+        });
     }
 
     void PhaseShift(stratifloat shift)
     {
-        ParallelPerStack([this, shift](int j1, int j2)
+        this->ParallelPerStack([this, shift](int j1, int j2)
         {
             this->stack(j1,j2) *= exp(i*(j1*shift));
         });
@@ -1175,14 +1772,14 @@ public:
 
     void SetValue(std::function<stratifloat(stratifloat)> f, stratifloat L3)
     {
-        ArrayX z = VerticalPointsFractional(L3, N3);
+        ArrayX z = VerticalPointsFractional(L3, this->Size3());
 
         if (this->BC() == BoundaryCondition::Dirichlet)
         {
-            z = VerticalPoints(L3,N3);
+            z = VerticalPoints(L3,this->Size3());
         }
 
-        for (int j3=0; j3<N3; j3++)
+        for (int j3=0; j3<this->Size3(); j3++)
         {
             this->operator()(0, 0, j3) = f(z(j3));
         }
@@ -1191,26 +1788,199 @@ public:
         {
             this->slice(1)=this->slice(2);
             this->slice(0)=this->slice(1);
-            this->slice(N3-2)=this->slice(N3-3);
-            this->slice(N3-1)=this->slice(N3-2);
+            this->slice(this->Size3()-2)=this->slice(this->Size3()-3);
+            this->slice(this->Size3()-1)=this->slice(this->Size3()-2);
         }
         else
         {
             this->slice(1)=-this->slice(2);
             this->slice(0)=this->slice(1);
-            this->slice(N3-1)=-this->slice(N3-2);
+            this->slice(this->Size3()-1)=-this->slice(this->Size3()-2);
         }
     }
-
-private:
-    static std::vector<complex, aligned_allocator<complex>> inputData;
 };
 
+// Several fields of the same size whose values are stored together, so that they can all be transformed by one FFT
+// The fields are views of the bundle, made by the NodalField and ModalField constructors which take it, so it must be made first
+// The stacks are interleaved: stack (j1, j2) of field k comes straight after that of field k-1
 template<int N1, int N2, int N3>
-constexpr int ModalField<N1,N2,N3>::actualN1;
+class FieldBundle
+{
+public:
+    FieldBundle(int count,
+                int n1 = Extent(N1, gridParams.N1),
+                int n2 = Extent(N2, gridParams.N2),
+                int n3 = Extent(N3, gridParams.N3),
+                bool compact = CompactModalStorage())
+    : count(count)
+    , n1(n1)
+    , n2(n2)
+    , n3(n3)
+    , m1(n1/2 + 1)
+    , compact(compact)
+    , nodalData(static_cast<std::size_t>(count)*OwnedStacks(n1).Count()*OwnedRows(n2, n2, n2).Count()*n3)
+    , nodal(count, nullptr)
+    , modal(count, nullptr)
+    {
+    }
+
+    // the fields can't be moved to another bundle, so copying what contains them copies the values field by field
+    FieldBundle(const FieldBundle<N1, N2, N3>& other) = delete;
+    FieldBundle<N1, N2, N3>& operator=(const FieldBundle<N1, N2, N3>& /*other*/)
+    {
+        return *this;
+    }
 
-template<int N1, int N2, int N3>
-std::vector<complex, aligned_allocator<complex>> ModalField<N1,N2,N3>::inputData;
+    int Count() const
+    {
+        return count;
+    }
+
+    // the sizes of the nodal fields
+    int NodalSize1() const
+    {
+        return n1;
+    }
+    int Size2() const
+    {
+        return n2;
+    }
+    int Size3() const
+    {
+        return n3;
+    }
+
+    // whether the modal fields only store the dealiased wavenumbers
+    bool Compact() const
+    {
+        return compact;
+    }
+
+    // called by the constructors of the fields, which are given the start of the storage
+    stratifloat* Attach(NodalField<N1, N2, N3>* field, int k)
+    {
+        assert(k < count && nodal[k] == nullptr);
+        nodal[k] = field;
+        return nodalData.data();
+    }
+
+    complex* Attach(ModalField<N1, N2, N3>* field, int k)
+    {
+        assert(k < count && modal[k] == nullptr);
+        assert(field->Compact() == compact);
+
+        // the modal storage is laid out as for the stacks which the fields store, so the first field sizes it
+        if (modalData.empty())
+        {
+            modalData.resize(count*field->StoredSize());
+        }
+        assert(modalData.size() == count*field->StoredSize());
+
+        modal[k] = field;
+        return modalData.data();
+    }
+
+    // every modal field to the nodal field in the same place
+    void ToNodal()
+    {
+        AssertAttached();
+
+        const ModalField<N1, N2, N3>& first = *modal[0];
+
+        // as in ModalField::ToNodal, the first stage reads the modal fields where they are and writes to the scratch space,
+        // unless only the dealiased spanwise wavenumbers are stored, when they are zero padded into it first
+        if (!compact || n2 == 1 || !first.FiltersSpanwise())
+        {
+            int stored1 = compact ? first.ActiveSize1() : m1;
+            const complex* modalValues = modalData.data();
+            PerformPrunedC2R(n1, n2, count*n3, stored1, modalValues, nodalData.data(), scratch);
+            return;
+        }
+
+        OwnedStacks owned(m1);
+        OwnedRows rows(n2, n2, n2);
+        scratch.modal.resize(static_cast<std::size_t>(owned.Count())*rows.Count()*count*n3);
+        ParallelFor(owned.Count(), 0, rows.Count(), [this, &owned, &rows](int n, int row)
+        {
+            for (int k=0; k<count; k++)
+            {
+                const ModalField<N1, N2, N3>& field = *modal[k];
+                ScratchStack(k, owned.Count()*row + n) = field.stack(owned[n], rows[row]);
+            }
+        });
+
+        PerformPrunedC2R(n1, n2, count*n3, first.ActiveSize1(), scratch.modal.data(), nodalData.data(), scratch);
+    }
+
+    // every nodal field to the modal field in the same place, which is filtered
+    void ToModal()
+    {
+        AssertAttached();
+
+        const ModalField<N1, N2, N3>& first = *modal[0];
+        stratifloat scale = 1/static_cast<stratifloat>(n1*n2);
+
+        // only the wavenumbers which are kept need transforming in the 2nd dimension,
+        // and the rest are part way transformed until the filter zeros them
+        if (!compact)
+        {
+            PerformPrunedR2C(n1, n2, count*n3, first.ActiveSize1(), nodalData.data(), modalData.data(), scratch);
+
+            for (ModalField<N1, N2, N3>* field : modal)
+            {
+                *field *= scale;
+                field->Filter();
+            }
+            return;
+        }
+
+        // otherwise the full size goes in the scratch space, and the retained wavenumbers are normalised as they are copied out
+        scratch.modal.resize(static_cast<std::size_t>(OwnedStacks(m1).Count())*OwnedRows(n2, n2, n2).Count()*count*n3);
+        PerformPrunedR2C(n1, n2, count*n3, first.ActiveSize1(), nodalData.data(), scratch.modal.data(), scratch);
+
+        for (int k=0; k<count; k++)
+        {
+            ModalField<N1, N2, N3>& field = *modal[k];
+            field.ParallelPerStack([&field,k,scale,this](int j1, int j2)
+            {
+                field.stack(j1, j2) = scale*ScratchStack(k, StackIndex(j1, j2, m1, n2));
+            });
+        }
+    }
+
+private:
+    using ScratchStackMap = Map<Array<complex, -1, 1>, Aligned16>;
+
+    // every field must have been made before transforming, and each nodal field is the same kind as its modal one
+    void AssertAttached() const
+    {
+        for (int k=0; k<count; k++)
+        {
+            assert(nodal[k] != nullptr && modal[k] != nullptr);
+            assert(nodal[k]->BC() == modal[k]->BC());
+        }
+    }
+
+    // field k of the given one of this process's stacks of the full modal size
+    ScratchStackMap ScratchStack(int k, std::size_t index)
+    {
+        return ScratchStackMap(&scratch.modal[(index*count + k)*n3], n3);
+    }
+
+    int count;
+    int n1, n2, n3;
+    int m1; // size of the 1st dimension in spectral space
+    bool compact;
+
+    std::vector<stratifloat, aligned_allocator<stratifloat>> nodalData;
+    std::vector<complex, aligned_allocator<complex>> modalData;
+
+    std::vector<NodalField<N1, N2, N3>*> nodal;
+    std::vector<ModalField<N1, N2, N3>*> modal;
+
+    // for the transforms to work in, which is also where the full modal size goes if the fields are compact
+    TransformScratch scratch;
+};
 
 template<typename A, typename T, int N1, int N2, int N3>
 ScalarProduct<A, T, N1, N2, N3> operator*(T scalar,
@@ -62,6 +62,29 @@ public:
         p = 0;
     }
 
+    std::size_t PackedSize() const
+    {
+        return x.PackedSize() + v.PackedSize() + 1;
+    }
+
+    template<typename S>
+    S* Pack(S* into) const
+    {
+        into = x.Pack(into);
+        into = v.Pack(into);
+        *into = static_cast<S>(p);
+        return into + 1;
+    }
+
+    template<typename S>
+    const S* Unpack(const S* from)
+    {
+        from = x.Unpack(from);
+        from = v.Unpack(from);
+        p = static_cast<stratifloat>(*from);
+        return from + 1;
+    }
+
     void SaveToFile(const std::string& filename) const
     {
         x.SaveToFile(filename+".fields");
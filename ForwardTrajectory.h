@@ -0,0 +1,164 @@
+#pragma once
+
+#include "Stratiflow.h"
+#include "KrylovBasis.h"
+
+#include <vector>
+
+// The states of a forward evolution, one for each timestep, which an adjoint evolution runs backwards through
+//
+// only u1, u2, u3 and b are kept, as that is all the adjoint uses, and only the values which the dealiasing
+// allows to be nonzero, in the same storage as a Krylov basis, set from the environment by
+// STRATIFLOW_TRAJECTORY_MEMORY, STRATIFLOW_TRAJECTORY_SPILL and STRATIFLOW_TRAJECTORY_PRECISION (see KrylovBasis.h)
+class ForwardTrajectory
+{
+public:
+    ForwardTrajectory()
+    : storage("STRATIFLOW_TRAJECTORY")
+    {
+    }
+
+    void Store(int step, const NeumannModal& u1, const NeumannModal& u2, const DirichletModal& u3, const NeumannModal& b)
+    {
+        std::size_t size = u1.PackedSize() + u3.PackedSize() + b.PackedSize();
+        if (gridParams.ThirdDimension())
+        {
+            size += u2.PackedSize();
+        }
+
+        if (storage.ReducedPrecision())
+        {
+            Pack(static_cast<ReducedFloat*>(storage.Block(step, size*sizeof(ReducedFloat))), u1, u2, u3, b);
+        }
+        else
+        {
+            Pack(static_cast<stratifloat*>(storage.Block(step, size*sizeof(stratifloat))), u1, u2, u3, b);
+        }
+    }
+
+    // sets the fields to (1-fraction) times the state at step first plus fraction times the state at step second
+    // the values outside the dealiased range are left as they are
+    void Interpolate(int first, int second, stratifloat fraction,
+                     NeumannModal& u1, NeumannModal& u2, DirichletModal& u3, NeumannModal& b) const
+    {
+        if (storage.ReducedPrecision())
+        {
+            Unpack(static_cast<const ReducedFloat*>(storage.Block(first)),
+                   static_cast<const ReducedFloat*>(storage.Block(second)),
+                   fraction, u1, u2, u3, b);
+        }
+        else
+        {
+            Unpack(static_cast<const stratifloat*>(storage.Block(first)),
+                   static_cast<const stratifloat*>(storage.Block(second)),
+                   fraction, u1, u2, u3, b);
+        }
+    }
+
+    // sets the fields to the state at step, leaving the values outside the dealiased range as they are
+    void Load(int step, NeumannModal& u1, NeumannModal& u2, DirichletModal& u3, NeumannModal& b) const
+    {
+        if (storage.ReducedPrecision())
+        {
+            Unpack(static_cast<const ReducedFloat*>(storage.Block(step)), u1, u2, u3, b);
+        }
+        else
+        {
+            Unpack(static_cast<const stratifloat*>(storage.Block(step)), u1, u2, u3, b);
+        }
+    }
+
+private:
+    template<typename S>
+    static void Pack(S* into, const NeumannModal& u1, const NeumannModal& u2, const DirichletModal& u3, const NeumannModal& b)
+    {
+        into = u1.Pack(into);
+        if (gridParams.ThirdDimension())
+        {
+            into = u2.Pack(into);
+        }
+        into = u3.Pack(into);
+        b.Pack(into);
+    }
+
+    template<typename S>
+    static void Unpack(const S* first, const S* second, stratifloat fraction,
+                       NeumannModal& u1, NeumannModal& u2, DirichletModal& u3, NeumannModal& b)
+    {
+        std::size_t offset = 0;
+
+        u1.UnpackInterpolated(first + offset, second + offset, fraction);
+        offset += u1.PackedSize();
+
+        if (gridParams.ThirdDimension())
+        {
+            u2.UnpackInterpolated(first + offset, second + offset, fraction);
+            offset += u2.PackedSize();
+        }
+
+        u3.UnpackInterpolated(first + offset, second + offset, fraction);
+        offset += u3.PackedSize();
+
+        b.UnpackInterpolated(first + offset, second + offset, fraction);
+    }
+
+    template<typename S>
+    static void Unpack(const S* from, NeumannModal& u1, NeumannModal& u2, DirichletModal& u3, NeumannModal& b)
+    {
+        from = u1.Unpack(from);
+        if (gridParams.ThirdDimension())
+        {
+            from = u2.Unpack(from);
+        }
+        from = u3.Unpack(from);
+        b.Unpack(from);
+    }
+
+    KrylovStorage storage;
+};
+
+// The steps of an evolution, which a tangent linear evolution can then follow (see IMEXRK::TimeStepTangent)
+//
+// for each timestep this has the state at the start of each of its substeps, which the explicit terms are
+// evaluated from, and these are kept in the same way as a ForwardTrajectory
+class Trajectory
+{
+public:
+    static constexpr int Substeps = 3;
+
+    void Clear()
+    {
+        timesteps.clear();
+    }
+
+    int Steps() const
+    {
+        return timesteps.size();
+    }
+
+    stratifloat TimeStep(int step) const
+    {
+        return timesteps[step];
+    }
+
+    // starts recording another timestep of length deltaT, and returns its number
+    int AddStep(stratifloat deltaT)
+    {
+        timesteps.push_back(deltaT);
+        return Steps()-1;
+    }
+
+    void Store(int step, int substep, const NeumannModal& u1, const NeumannModal& u2, const DirichletModal& u3, const NeumannModal& b)
+    {
+        states.Store(step*Substeps+substep, u1, u2, u3, b);
+    }
+
+    void Load(int step, int substep, NeumannModal& u1, NeumannModal& u2, DirichletModal& u3, NeumannModal& b) const
+    {
+        states.Load(step*Substeps+substep, u1, u2, u3, b);
+    }
+
+private:
+    ForwardTrajectory states;
+    std::vector<stratifloat> timesteps;
+};
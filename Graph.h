@@ -11,17 +11,20 @@ inline void HeatPlot(const NodalField<N1, N2, N3> &U, stratifloat L1, stratifloa
 {
     matplotlibcpp::figure();
 
-    std::vector<stratifloat> imdata(N1*N3);
+    const int n1 = U.Size1();
+    const int n3 = U.Size3();
 
-    for (int n1=0; n1<N1; n1++)
+    std::vector<stratifloat> imdata(n1*n3);
+
+    for (int k1=0; k1<n1; k1++)
     {
-        for (int n3=0; n3<N3; n3++)
+        for (int k3=0; k3<n3; k3++)
         {
-            imdata[n3*N1 + n1] = U(n1,j2,n3);
+            imdata[k3*n1 + k1] = U(k1,j2,k3);
         }
     }
 
-    matplotlibcpp::imshow(imdata, N3, N1, 0, N1, 0, N3);
+    matplotlibcpp::imshow(imdata, n3, n1, 0, n1, 0, n3);
 
     matplotlibcpp::save(filename);
     matplotlibcpp::close();
@@ -39,8 +42,10 @@ inline void HeatPlot(const NodalField<K1, K2, K3> &U, stratifloat L1, stratifloa
 
     matplotlibcpp::figure(L1, zcutoff);
 
-    ArrayX oldNeumannPoints = VerticalPointsFractional(L3, K3);
-    ArrayX oldDirichletPoints = VerticalPoints(L3, K3);
+    const int oldN1 = U.Size1();
+
+    ArrayX oldNeumannPoints = VerticalPointsFractional(L3, U.Size3());
+    ArrayX oldDirichletPoints = VerticalPoints(L3, U.Size3());
 
     std::vector<stratifloat> imdata(N1*2*N3);
 
@@ -48,19 +53,19 @@ inline void HeatPlot(const NodalField<K1, K2, K3> &U, stratifloat L1, stratifloa
     {
         stratifloat x = j1*L1/N1;
 
-        int k1_left = static_cast<int>(x/(L1/K1));
+        int k1_left = static_cast<int>(x/(L1/oldN1));
         int k1_right = k1_left+1;
 
-        stratifloat x_left = k1_left*L1/K1;
-        stratifloat x_right = k1_right*L1/K1;
+        stratifloat x_left = k1_left*L1/oldN1;
+        stratifloat x_right = k1_right*L1/oldN1;
 
         stratifloat weight_left = (x_right-x)/(x_right-x_left);
         stratifloat weight_right = (x-x_left)/(x_right-x_left);
 
-        while (k1_left<0) k1_left += K1;
-        while (k1_right<0) k1_right += K1;
-        while (k1_left>=K1) k1_left -= K1;
-        while (k1_right>=K1) k1_right -= K1;
+        while (k1_left<0) k1_left += oldN1;
+        while (k1_right<0) k1_right += oldN1;
+        while (k1_left>=oldN1) k1_left -= oldN1;
+        while (k1_right>=oldN1) k1_right -= oldN1;
 
         for (int j3=0; j3<N3; j3++)
         {
@@ -111,9 +116,17 @@ inline void HeatPlot(const NodalField<K1, K2, K3> &U, stratifloat L1, stratifloa
 template<int N1, int N2, int N3>
 inline void HeatPlot(const ModalField<N1, N2, N3> &u, stratifloat L1, stratifloat L3, int j2, std::string filename)
 {
-    NodalField<N1, N2, N3> U(u.BC());
+    NodalField<N1, N2, N3> U(u.BC(), u.NodalSize1(), u.Size2(), u.Size3());
 
     u.ToNodal(U);
 
-    HeatPlot<N1,N2,N3>(U, L1, L3, j2, filename);
+    // only one process draws, so it needs every stack
+    NodalField<N1, N2, N3> whole(u.BC(), u.NodalSize1(), u.Size2(), u.Size3());
+    U.Gather(whole);
+    if (ProcessRank() != 0)
+    {
+        return;
+    }
+
+    HeatPlot<N1,N2,N3>(whole, L1, L3, j2, filename);
 }
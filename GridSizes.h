@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Eigen.h"
+
+#include <cassert>
+#include <type_traits>
+
+// Field sizes are template parameters, which are either fixed when compiling
+// or Dynamic (as in Eigen), in which case they are only known once the grid is loaded
+
+// the size of a dimension, given its compile time size and the size of the loaded grid
+constexpr int Extent(int N, int runtimeN)
+{
+    return N == Dynamic ? runtimeN : N;
+}
+
+// number of complex coefficients in the 1st dimension after a real to complex transform
+constexpr int ModalSize(int N1)
+{
+    return N1 == Dynamic ? Dynamic : N1/2 + 1;
+}
+
+template<int... Sizes>
+struct SizeList {};
+
+// vertical resolutions which still get fixed size kernels when the grid is only known at runtime
+// each one adds to the compile time and code size, so this should be kept short
+using HotVerticalSizes = SizeList<128, 256, 384, 512>;
+
+template<typename F>
+void DispatchVerticalSize(int /*N*/, SizeList<>, F& f)
+{
+    f(std::integral_constant<int, Dynamic>());
+}
+
+template<int First, int... Rest, typename F>
+void DispatchVerticalSize(int N, SizeList<First, Rest...>, F& f)
+{
+    if (N == First)
+    {
+        f(std::integral_constant<int, First>());
+    }
+    else
+    {
+        DispatchVerticalSize(N, SizeList<Rest...>(), f);
+    }
+}
+
+// calls f(std::integral_constant<int, K>()), where K is the fixed size N3 if there is one,
+// otherwise the runtime size N if it is one of the hot sizes, and Dynamic if not
+template<int N3, typename F>
+typename std::enable_if<N3 != Dynamic>::type WithVerticalSize(int N, F f)
+{
+    assert(N == N3);
+    f(std::integral_constant<int, N3>());
+}
+
+template<int N3, typename F>
+typename std::enable_if<N3 == Dynamic>::type WithVerticalSize(int N, F f)
+{
+    DispatchVerticalSize(N, HotVerticalSizes(), f);
+}
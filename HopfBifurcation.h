@@ -81,6 +81,33 @@ public:
         p = 0;
     }
 
+    std::size_t PackedSize() const
+    {
+        return x.PackedSize() + v1.PackedSize() + v2.PackedSize() + 2;
+    }
+
+    template<typename S>
+    S* Pack(S* into) const
+    {
+        into = x.Pack(into);
+        into = v1.Pack(into);
+        into = v2.Pack(into);
+        into[0] = static_cast<S>(theta);
+        into[1] = static_cast<S>(p);
+        return into + 2;
+    }
+
+    template<typename S>
+    const S* Unpack(const S* from)
+    {
+        from = x.Unpack(from);
+        from = v1.Unpack(from);
+        from = v2.Unpack(from);
+        theta = static_cast<stratifloat>(from[0]);
+        p = static_cast<stratifloat>(from[1]);
+        return from + 2;
+    }
+
     void SaveToFile(const std::string& filename) const
     {
         x.SaveToFile(filename+".fields");
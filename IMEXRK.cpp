@@ -5,375 +5,606 @@ constexpr int IMEXRK::s;
 constexpr stratifloat IMEXRK::beta[];
 constexpr stratifloat IMEXRK::zeta[];
 
-void IMEXRK::TimeStep()
+void IMEXRK::TimeStep(Trajectory* record)
 {
-    // see Numerical Renaissance
-    for (int k=0; k<s; k++)
+    PROFILE(TimeStep);
+
+    int step = record != nullptr ? record->AddStep(deltaT) : 0;
+
+    // the stages are split into a task graph per field, see Tasks.h, so that for example
+    // u1 can be solved while the right hand side for b is still being finished
+    #pragma omp parallel if(UseTaskGraph())
+    #pragma omp single
     {
-        ExplicitRK(k, flowParams.EvolveBackground);
-        BuildRHS();
-        FinishRHS(k);
+        // see Numerical Renaissance
+        for (int k=0; k<s; k++)
+        {
+            if (record != nullptr)
+            {
+                GRAPH_TASK(depend(in: this->u1, this->u2, this->u3, this->b))
+                {
+                    record->Store(step, k, u1, u2, u3, b);
+                }
+            }
 
-        CrankNicolson(k, flowParams.EvolveBackground);
+            ExplicitRK(k, flowParams.EvolveBackground);
+            BuildRHS();
+            FinishRHS(k);
 
-        RemoveDivergence(1/h[k]);
+            CrankNicolson(k, flowParams.EvolveBackground);
 
-        FilterAll();
-        PopulateNodalVariables();
+            RemoveDivergence(1/h[k]);
+
+            FilterAll();
+            PopulateNodalVariables();
+        }
     }
 }
 
 void IMEXRK::TimeStepLinear()
 {
-    // see Numerical Renaissance
-    for (int k=0; k<s; k++)
+    PROFILE(TimeStep);
+
+    #pragma omp parallel if(UseTaskGraph())
+    #pragma omp single
     {
-        ExplicitRK(k);
-        BuildRHSLinear();
-        FinishRHS(k);
+        // see Numerical Renaissance
+        for (int k=0; k<s; k++)
+        {
+            ExplicitRK(k);
+            BuildRHSLinear();
+            FinishRHS(k);
 
-        CrankNicolson(k);
-        RemoveDivergence(1/h[k]);
+            CrankNicolson(k);
+            RemoveDivergence(1/h[k]);
 
-        FilterAll();
-        PopulateNodalVariables();
+            FilterAll();
+            PopulateNodalVariables();
+        }
     }
 }
 
-void IMEXRK::RemoveDivergence(stratifloat pressureMultiplier)
+// this is the exact linearisation of TimeStep about the recorded states, for a fixed background
+void IMEXRK::TimeStepTangent(const Trajectory& about, int step)
 {
-    // construct the diverence of u
-    if(gridParams.ThirdDimension())
+    PROFILE(TimeStep);
+
+    assert(!flowParams.EvolveBackground);
+    assert(deltaT == about.TimeStep(step));
+
+    #pragma omp parallel if(UseTaskGraph())
+    #pragma omp single
     {
-        divergence = ddx(u1) + ddy(u2) + ddz(u3);
+        for (int k=0; k<s; k++)
+        {
+            // the state is used throughout the substep, so the previous one has to be finished first
+            #pragma omp taskwait
+
+            about.Load(step, k, u1_tot, u2_tot, u3_tot, b_tot);
+            u1_tot.Filter();
+            u2_tot.Filter();
+            u3_tot.Filter();
+            b_tot.Filter();
+            PopulateBackgroundNodal();
+
+            ExplicitRK(k);
+            BuildRHSLinear();
+            FinishRHS(k);
+
+            CrankNicolson(k);
+            RemoveDivergence(1/h[k]);
+
+            FilterAll();
+            PopulateNodalVariables();
+        }
     }
-    else
+}
+
+void IMEXRK::RemoveDivergence(stratifloat pressureMultiplier)
+{
+    GRAPH_TASK(depend(inout: this->u1, this->u2, this->u3, this->p, this->divergence, this->q))
     {
-        divergence = ddx(u1) + ddz(u3);
-    }
+        PROFILE(RemoveDivergence);
 
-    // set value at boundary to zero
-    divergence.ZeroEnds();
+        // construct the diverence of u
+        if(gridParams.ThirdDimension())
+        {
+            divergence = ddx(u1) + ddy(u2) + ddz(u3);
+        }
+        else
+        {
+            divergence = ddx(u1) + ddz(u3);
+        }
 
-    // solve Δq = ∇·u as linear system Aq = divergence
-    divergence.Solve(solveLaplacian, q);
+        // set value at boundary to zero
+        divergence.ZeroEnds();
 
-    // subtract the gradient of this from the velocity
-    u1 -= ddx(q);
-    if(gridParams.ThirdDimension())
-    {
-        u2 -= ddy(q);
-    }
-    u3 -= ddz(q);
+        // solve Δq = ∇·u as linear system Aq = divergence
+        divergence.Solve(solveLaplacian, q);
 
-    // also add it on to p for the next step
-    // this is scaled to match the p that was added before
-    // effectively we have forward euler
-    p += pressureMultiplier*q;
+        // subtract the gradient of this from the velocity
+        u1 -= ddx(q);
+        if(gridParams.ThirdDimension())
+        {
+            u2 -= ddy(q);
+        }
+        u3 -= ddz(q);
+
+        // also add it on to p for the next step
+        // this is scaled to match the p that was added before
+        // effectively we have forward euler
+        p += pressureMultiplier*q;
+    }
 }
 
 void IMEXRK::CrankNicolson(int k, bool evolveBackground)
 {
-    R1 += (0.5f*h[k]/flowParams.Re)*(MatMulDim1(dim1Derivative2, u1)
-                         +MatMulDim2(dim2Derivative2, u1)
-                         +MatMulDim3(dim3Derivative2Neumann, u1));
-    CNSolve(R1, u1, k);
+    // each variable is solved as soon as its own right hand side is ready
+    GRAPH_TASK(depend(inout: this->R1, this->u1))
+    {
+        PROFILE(CrankNicolson);
+
+        R1 += (0.5f*h[k]/flowParams.Re)*(MatMulDim1(dim1Derivative2, u1)
+                             +MatMulDim2(dim2Derivative2, u1)
+                             +MatMulDim3(dim3Derivative2Neumann, u1));
+        CNSolve(R1, u1, k);
+    }
 
     if(gridParams.ThirdDimension())
     {
-        R2 += (0.5f*h[k]/flowParams.Re)*(MatMulDim1(dim1Derivative2, u2)
-                             +MatMulDim2(dim2Derivative2, u2)
-                             +MatMulDim3(dim3Derivative2Neumann, u2));
-        CNSolve(R2, u2, k);
+        GRAPH_TASK(depend(inout: this->R2, this->u2))
+        {
+            PROFILE(CrankNicolson);
+
+            R2 += (0.5f*h[k]/flowParams.Re)*(MatMulDim1(dim1Derivative2, u2)
+                                 +MatMulDim2(dim2Derivative2, u2)
+                                 +MatMulDim3(dim3Derivative2Neumann, u2));
+            CNSolve(R2, u2, k);
+        }
+    }
+
+    GRAPH_TASK(depend(inout: this->R3, this->u3))
+    {
+        PROFILE(CrankNicolson);
+
+        R3 += (0.5f*h[k]/flowParams.Re)*(MatMulDim1(dim1Derivative2, u3)
+                             +MatMulDim2(dim2Derivative2, u3)
+                             +MatMulDim3(dim3Derivative2Dirichlet, u3));
+        CNSolve(R3, u3, k);
     }
 
-    R3 += (0.5f*h[k]/flowParams.Re)*(MatMulDim1(dim1Derivative2, u3)
-                         +MatMulDim2(dim2Derivative2, u3)
-                         +MatMulDim3(dim3Derivative2Dirichlet, u3));
-    CNSolve(R3, u3, k);
+    GRAPH_TASK(depend(inout: this->RB, this->b))
+    {
+        PROFILE(CrankNicolson);
 
-    RB += (0.5f*h[k]/flowParams.Re/flowParams.Pr)*(MatMulDim1(dim1Derivative2, b)
-                         +MatMulDim2(dim2Derivative2, b)
-                         +MatMulDim3(dim3Derivative2Neumann, b));
-    CNSolveBuoyancy(RB, b, k);
+        RB += (0.5f*h[k]/flowParams.Re/flowParams.Pr)*(MatMulDim1(dim1Derivative2, b)
+                             +MatMulDim2(dim2Derivative2, b)
+                             +MatMulDim3(dim3Derivative2Neumann, b));
+        CNSolveBuoyancy(RB, b, k);
+    }
 
     if (flowParams.EvolveBackground)
     {
-        RU_ = U_ + (0.5f*h[k]/flowParams.Re)*MatMul1D(dim3Derivative2Neumann, U_);
-        CNSolve1D(RU_, U_, k);
+        GRAPH_TASK(depend(inout: this->RU_, this->U_))
+        {
+            PROFILE(CrankNicolson);
+
+            RU_ = U_ + (0.5f*h[k]/flowParams.Re)*MatMul1D(dim3Derivative2Neumann, U_);
+            CNSolve1D(RU_, U_, k);
+        }
     }
 }
 
 void IMEXRK::FinishRHS(int k)
 {
     // now add on explicit terms to RHS
-    R1 += (h[k]*beta[k])*r1;
+    GRAPH_TASK(depend(in: this->r1) depend(inout: this->R1))
+    {
+        PROFILE(FinishRHS);
+        R1 += (h[k]*beta[k])*r1;
+    }
     if(gridParams.ThirdDimension())
     {
-        R2 += (h[k]*beta[k])*r2;
+        GRAPH_TASK(depend(in: this->r2) depend(inout: this->R2))
+        {
+            PROFILE(FinishRHS);
+            R2 += (h[k]*beta[k])*r2;
+        }
+    }
+    GRAPH_TASK(depend(in: this->r3) depend(inout: this->R3))
+    {
+        PROFILE(FinishRHS);
+        R3 += (h[k]*beta[k])*r3;
+    }
+    GRAPH_TASK(depend(in: this->rB) depend(inout: this->RB))
+    {
+        PROFILE(FinishRHS);
+        RB += (h[k]*beta[k])*rB;
     }
-    R3 += (h[k]*beta[k])*r3;
-    RB += (h[k]*beta[k])*rB;
 }
 
 void IMEXRK::ExplicitRK(int k, bool evolveBackground)
 {
     //   old      last rk step         pressure
-    R1 = u1 + (h[k]*zeta[k])*r1 + (-h[k])*ddx(p) ;
-    if(gridParams.ThirdDimension())
+    GRAPH_TASK(depend(in: this->u1, this->p) depend(inout: this->r1) depend(out: this->R1))
     {
-    R2 = u2 + (h[k]*zeta[k])*r2 + (-h[k])*ddy(p) ;
+        PROFILE(ExplicitRK);
+        R1 = u1 + (h[k]*zeta[k])*r1 + (-h[k])*ddx(p) ;
+        r1.Zero();
+    }
+    GRAPH_TASK(depend(in: this->u2, this->p) depend(inout: this->r2) depend(out: this->R2))
+    {
+        PROFILE(ExplicitRK);
+        if(gridParams.ThirdDimension())
+        {
+        R2 = u2 + (h[k]*zeta[k])*r2 + (-h[k])*ddy(p) ;
+        }
+        r2.Zero();
+    }
+    GRAPH_TASK(depend(in: this->u3, this->p) depend(inout: this->r3) depend(out: this->R3))
+    {
+        PROFILE(ExplicitRK);
+        R3 = u3 + (h[k]*zeta[k])*r3 + (-h[k])*ddz(p) ;
+        r3.Zero();
+    }
+    GRAPH_TASK(depend(in: this->b) depend(inout: this->rB) depend(out: this->RB))
+    {
+        PROFILE(ExplicitRK);
+        RB = b  + (h[k]*zeta[k])*rB                  ;
+        rB.Zero();
     }
-    R3 = u3 + (h[k]*zeta[k])*r3 + (-h[k])*ddz(p) ;
-    RB = b  + (h[k]*zeta[k])*rB                  ;
-
-    r1.Zero();
-    r2.Zero();
-    r3.Zero();
-    rB.Zero();
 }
 
 void IMEXRK::BuildRHS()
 {
-    // build up right hand sides for the implicit solve in R
+    // U1 stands for all the nodal variables, which are always transformed together
+    GRAPH_TASK(depend(in: this->U1, this->U_, this->b, this->u3)
+               depend(inout: this->r1, this->r2, this->r3, this->rB, this->neumannTemp, this->dirichletTemp, this->nnTemp))
+    {
+        PROFILE(BuildRHS);
 
-    // buoyancy force without hydrostatic part
-    neumannTemp = b;
-    RemoveHorizontalAverage(neumannTemp);
-    r3 += flowParams.Ri*ReinterpolateFull(neumannTemp); // buoyancy force
+        // build up right hand sides for the implicit solve in R
 
-    // background stratification term
-    dirichletTemp = u3;
-    rB -= ReinterpolateDirichlet(dirichletTemp);
+        // buoyancy force without hydrostatic part
+        neumannTemp = b;
+        RemoveHorizontalAverage(neumannTemp);
+        r3 += flowParams.Ri*ReinterpolateFull(neumannTemp); // buoyancy force
 
-    //////// NONLINEAR TERMS ////////
-    // calculate products at nodes in physical space
+        // background stratification term
+        dirichletTemp = u3;
+        rB -= ReinterpolateDirichlet(dirichletTemp);
 
-    // take into account background shear for nonlinear terms
-    U1_tot = U1 + U_;
+        //////// NONLINEAR TERMS ////////
+        BuildNonlinearTerms();
+    }
+}
 
-    InterpolateProduct(U1_tot, U1_tot, neumannTemp);
-    r1 -= ddx(neumannTemp);
+namespace
+{
+// the quadratic products that make up the nonlinear terms, in the order they are stored
+// the ones involving the spanwise velocity come last so they can be left out for 2D flows
+enum NonlinearProduct
+{
+    U1U1,   // ddx -> r1
+    DzU1U3, // -> r1
+    U1U3,   // ddx -> r3
+    DzU3U3, // -> r3
+    DzBU3,  // -> rB
+    U1B,    // ddx -> rB
+    U2U2,   // ddy -> r2
+    DzU2U3, // -> r2
+    U2U3,   // ddy -> r3
+    U1U2,   // ddy -> r1, ddx -> r2
+    U2B,    // ddy -> rB
+    AllNonlinearProducts
+};
+}
 
-    DifferentiateProductBar(U1_tot, U3, neumannTemp);
-    r1 -= neumannTemp;
+int IMEXRK::NonlinearProductCount() const
+{
+    return gridParams.ThirdDimension() ? AllNonlinearProducts : U2U2;
+}
 
-    InterpolateProductTilde(U1_tot, U3, dirichletTemp);
-    InterpolateProduct(U3, U3, neumannTemp);
-    r3 -= ddx(dirichletTemp)+ddz(neumannTemp);
+void IMEXRK::BuildNonlinearTerms()
+{
+    // this does the same as calling InterpolateProduct etc. for each term, but
+    // reads each nodal variable once, does one FFT and makes one pass over the RHS
 
-    if(gridParams.ThirdDimension())
+    // the columns have a fixed size unless the grid is loaded at runtime with an unusual N3
+    const int count = NonlinearProductCount();
+    WithVerticalSize<GridN3>(gridParams.N3, [this, count](auto size)
     {
-        InterpolateProduct(U2, U2, neumannTemp);
-        r2 -= ddy(neumannTemp);
+        BuildNonlinearTermsOfSize<decltype(size)::value>(count);
+    });
+}
+
+template<int K3>
+void IMEXRK::BuildNonlinearTermsOfSize(int count)
+{
+    const int N1 = gridParams.N1;
+    const int N2 = gridParams.N2;
+    const int N3 = Extent(K3, gridParams.N3);
+    using Column = Array<stratifloat, K3, 1>;
+    using ProductStack = Map<Array<stratifloat, K3, 1>, Aligned16>;
+    using ModalProductStack = Map<const Array<complex, K3, 1>, Aligned16>;
 
-        DifferentiateProductBar(U2, U3, neumannTemp);
-        r2 -= neumannTemp;
+    // calculate products at nodes in physical space
+    U1.ParallelPerStack([this, count, N1, N2, N3](int j1, int j2)
+    {
+        stratifloat* products = &nonlinearProducts[StackIndex(j1, j2, N1, N2)*count*N3];
+        auto product = [products, N3](int n) { return ProductStack(products + n*N3, N3); };
 
-        InterpolateProductTilde(U2, U3, dirichletTemp);
-        r3 -= ddy(dirichletTemp);
+        // take into account background shear for nonlinear terms
+        Column u1 = U1.stack(j1, j2) + U_.Get();
+        Column u3 = U3.stack(j1, j2);
+        Column b = B.stack(j1, j2);
 
-        InterpolateProduct(U1_tot, U2, neumannTemp);
-        r1 -= ddy(neumannTemp);
-        r2 -= ddx(neumannTemp);
-    }
+        Column interpolated(N3), temp(N3);
 
-    // buoyancy nonlinear terms
-    DifferentiateProductBar(B, U3, neumannTemp);
-    rB -= neumannTemp;
+        product(U1U1) = u1*u1;
 
-    if(gridParams.ThirdDimension())
+        reinterpolateBar.Apply(u1, interpolated);
+        temp = interpolated*u3;
+        ProductStack dzU1U3 = product(DzU1U3);
+        dim3DerivativeDirichlet.Apply(temp, dzU1U3);
+
+        reinterpolateTilde.Apply(u1, interpolated);
+        product(U1U3) = interpolated*u3;
+
+        reinterpolateDirichlet.Apply(u3, interpolated);
+        temp = interpolated*interpolated;
+        ProductStack dzU3U3 = product(DzU3U3);
+        dim3DerivativeNeumann.Apply(temp, dzU3U3);
+
+        reinterpolateBar.Apply(b, interpolated);
+        temp = interpolated*u3;
+        ProductStack dzBU3 = product(DzBU3);
+        dim3DerivativeDirichlet.Apply(temp, dzBU3);
+
+        product(U1B) = u1*b;
+
+        if (count > U2U2)
+        {
+            Column u2 = U2.stack(j1, j2);
+
+            product(U2U2) = u2*u2;
+
+            reinterpolateBar.Apply(u2, interpolated);
+            temp = interpolated*u3;
+            ProductStack dzU2U3 = product(DzU2U3);
+            dim3DerivativeDirichlet.Apply(temp, dzU2U3);
+
+            reinterpolateTilde.Apply(u2, interpolated);
+            product(U2U3) = interpolated*u3;
+
+            product(U1U2) = u1*u2;
+            product(U2B) = u2*b;
+        }
+    });
+
+    // the stacks of all the products are interleaved, so this is a single FFT of count*N3 planes
+    // of which only the dealiased wavenumbers are used, so the rest aren't transformed in the 2nd dimension
+    PerformPrunedR2C(N1, N2, count*N3, r1.ActiveSize1(), nonlinearProducts.data(), nonlinearProductsModal.data(), nonlinearTransform);
+
+    // accumulate into the RHS, applying the horizontal derivatives and FFT normalisation as we go
+    // only the dealiased wavenumbers are visited, which is equivalent to filtering the products
+    const stratifloat scale = 1/static_cast<stratifloat>(N1*N2);
+    r1.ParallelPerStack([this, count, scale, N2, N3](int j1, int j2)
     {
-        InterpolateProduct(U2, B, neumannTemp);
-        rB -= ddy(neumannTemp);
-    }
+        const complex* products = &nonlinearProductsModal[StackIndex(j1, j2, M1, N2)*count*N3];
+        auto product = [products, N3](int n) { return ModalProductStack(products + n*N3, N3); };
 
-    InterpolateProduct(U1_tot, B, neumannTemp);
-    rB -= ddx(neumannTemp);
+        complex ddx = scale*dim1Derivative.diagonal()(j1);
+        complex ddy = scale*dim2Derivative.diagonal()(j2);
+
+        r1.stack(j1, j2) -= ddx*product(U1U1) + scale*product(DzU1U3);
+        r3.stack(j1, j2) -= ddx*product(U1U3) + scale*product(DzU3U3);
+        rB.stack(j1, j2) -= scale*product(DzBU3) + ddx*product(U1B);
+
+        if (count > U2U2)
+        {
+            r1.stack(j1, j2) -= ddy*product(U1U2);
+            r2.stack(j1, j2) -= ddy*product(U2U2) + scale*product(DzU2U3) + ddx*product(U1U2);
+            r3.stack(j1, j2) -= ddy*product(U2U3);
+            rB.stack(j1, j2) -= ddy*product(U2B);
+        }
+    });
 }
 
 void IMEXRK::BuildRHSLinear()
 {
-    // build up right hand sides for the implicit solve in R
+    GRAPH_TASK(depend(in: this->U1, this->U_, this->b, this->u3)
+               depend(inout: this->r1, this->r2, this->r3, this->rB, this->neumannTemp, this->dirichletTemp, this->nnTemp))
+    {
+        PROFILE(BuildRHS);
 
-    // buoyancy force without hydrostatic part
-    neumannTemp = b;
-    RemoveHorizontalAverage(neumannTemp);
-    r3 += flowParams.Ri*ReinterpolateFull(neumannTemp); // buoyancy force
+        // build up right hand sides for the implicit solve in R
 
-    // background stratification term
-    dirichletTemp = u3;
-    rB -= ReinterpolateDirichlet(dirichletTemp);
+        // buoyancy force without hydrostatic part
+        neumannTemp = b;
+        RemoveHorizontalAverage(neumannTemp);
+        r3 += flowParams.Ri*ReinterpolateFull(neumannTemp); // buoyancy force
 
-    //////// NONLINEAR TERMS ////////
-    // calculate products at nodes in physical space
+        // background stratification term
+        dirichletTemp = u3;
+        rB -= ReinterpolateDirichlet(dirichletTemp);
 
-    // take into account background shear for nonlinear terms
-    nnTemp = U1_tot + U_;
+        //////// NONLINEAR TERMS ////////
+        // calculate products at nodes in physical space
 
-    InterpolateProduct(U1, nnTemp, neumannTemp);
-    r1 -= 2.0*ddx(neumannTemp);
+        // take into account background shear for nonlinear terms
+        nnTemp = U1_tot + U_;
 
-    DifferentiateProductBar(U1, nnTemp, U3_tot, U3, neumannTemp);
-    r1 -= neumannTemp;
+        InterpolateProduct(U1, nnTemp, neumannTemp, workspace);
+        r1 -= 2.0*ddx(neumannTemp);
 
-    InterpolateProductTilde(U1, nnTemp, U3_tot, U3, dirichletTemp);
-    InterpolateProduct(U3, U3_tot, neumannTemp);
-    r3 -= ddx(dirichletTemp)+2.0*ddz(neumannTemp);
+        DifferentiateProductBar(U1, nnTemp, U3_tot, U3, neumannTemp, workspace);
+        r1 -= neumannTemp;
 
-    if(gridParams.ThirdDimension())
-    {
-        DifferentiateProductBar(U2, U2_tot, U3_tot, U3, neumannTemp);
-        r2 -= neumannTemp;
+        InterpolateProductTilde(U1, nnTemp, U3_tot, U3, dirichletTemp, workspace);
+        InterpolateProduct(U3, U3_tot, neumannTemp, workspace);
+        r3 -= ddx(dirichletTemp)+2.0*ddz(neumannTemp);
 
-        if (gridParams.dimensionality == Dimensionality::ThreeDimensional)
+        if(gridParams.ThirdDimension())
         {
-            InterpolateProduct(U2, U2_tot, neumannTemp);
-            r2 -= 2.0*ddy(neumannTemp);
-
-            InterpolateProductTilde(U2, U2_tot, U3_tot, U3,  dirichletTemp);
-            r3 -= ddy(dirichletTemp);
+            DifferentiateProductBar(U2, U2_tot, U3_tot, U3, neumannTemp, workspace);
+            r2 -= neumannTemp;
+
+            if (gridParams.dimensionality == Dimensionality::ThreeDimensional)
+            {
+                InterpolateProduct(U2, U2_tot, neumannTemp, workspace);
+                r2 -= 2.0*ddy(neumannTemp);
+
+                InterpolateProductTilde(U2, U2_tot, U3_tot, U3,  dirichletTemp, workspace);
+                r3 -= ddy(dirichletTemp);
+            }
+
+            InterpolateProduct(U1, nnTemp, U2_tot, U2, neumannTemp, workspace);
+            if (gridParams.dimensionality == Dimensionality::ThreeDimensional)
+            {
+                r1 -= ddy(neumannTemp);
+            }
+            r2 -= ddx(neumannTemp);
         }
 
-        InterpolateProduct(U1, nnTemp, U2_tot, U2, neumannTemp);
-        if (gridParams.dimensionality == Dimensionality::ThreeDimensional)
+        // buoyancy nonlinear terms
+        DifferentiateProductBar(B, B_tot, U3_tot, U3, neumannTemp, workspace);
+        rB -= neumannTemp;
+
+        if(gridParams.ThirdDimension())
         {
-            r1 -= ddy(neumannTemp);
+            InterpolateProduct(B, B_tot, U2_tot, U2, neumannTemp, workspace);
+            rB -= ddy(neumannTemp);
         }
-        r2 -= ddx(neumannTemp);
-    }
 
-    // buoyancy nonlinear terms
-    DifferentiateProductBar(B, B_tot, U3_tot, U3, neumannTemp);
-    rB -= neumannTemp;
-
-    if(gridParams.ThirdDimension())
-    {
-        InterpolateProduct(B, B_tot, U2_tot, U2, neumannTemp);
-        rB -= ddy(neumannTemp);
+        InterpolateProduct(B, B_tot, nnTemp, U1, neumannTemp, workspace);
+        rB -= ddx(neumannTemp);
     }
-
-    InterpolateProduct(B, B_tot, nnTemp, U1, neumannTemp);
-    rB -= ddx(neumannTemp);
 }
 
 void IMEXRK::BuildRHSAdjoint()
 {
-    // build up right hand sides for the implicit solve in R
+    GRAPH_TASK(depend(in: this->U1, this->U_, this->b, this->u3)
+               depend(inout: this->r1, this->r2, this->r3, this->rB, this->neumannTemp, this->dirichletTemp, this->nnTemp))
+    {
+        PROFILE(BuildRHS);
 
-    // adjoint buoyancy
-    bForcing += flowParams.Ri*ReinterpolateDirichlet(U3);
+        // build up right hand sides for the implicit solve in R
 
-    //////// NONLINEAR TERMS ////////
-    // advection of adjoint quantities by the direct flow
-    InterpolateProduct(U1, U1_tot, neumannTemp);
-    r1 += ddx(neumannTemp);
+        // adjoint buoyancy
+        bForcing += flowParams.Ri*ReinterpolateDirichlet(U3);
 
-    DifferentiateProductBar(U1, U3_tot, neumannTemp);
-    r1 += neumannTemp;
+        //////// NONLINEAR TERMS ////////
+        // advection of adjoint quantities by the direct flow
+        InterpolateProduct(U1, U1_tot, neumannTemp, workspace);
+        r1 += ddx(neumannTemp);
 
-    InterpolateProductTilde(U1_tot, U3, dirichletTemp);
-    InterpolateProduct(U3, U3_tot, neumannTemp);
-    r3 += ddx(dirichletTemp)+ddz(neumannTemp);
+        DifferentiateProductBar(U1, U3_tot, neumannTemp, workspace);
+        r1 += neumannTemp;
 
-    if(gridParams.ThirdDimension())
-    {
-        InterpolateProduct(U2, U2_tot, neumannTemp);
-        r2 += ddy(neumannTemp);
+        InterpolateProductTilde(U1_tot, U3, dirichletTemp, workspace);
+        InterpolateProduct(U3, U3_tot, neumannTemp, workspace);
+        r3 += ddx(dirichletTemp)+ddz(neumannTemp);
 
-        DifferentiateProductBar(U2, U3_tot, neumannTemp);
-        r2 += neumannTemp;
+        if(gridParams.ThirdDimension())
+        {
+            InterpolateProduct(U2, U2_tot, neumannTemp, workspace);
+            r2 += ddy(neumannTemp);
 
-        InterpolateProductTilde(U2_tot, U3, dirichletTemp);
-        r3 += ddy(dirichletTemp);
+            DifferentiateProductBar(U2, U3_tot, neumannTemp, workspace);
+            r2 += neumannTemp;
 
-        InterpolateProduct(U1, U2_tot, neumannTemp);
-        r1 += ddy(neumannTemp);
+            InterpolateProductTilde(U2_tot, U3, dirichletTemp, workspace);
+            r3 += ddy(dirichletTemp);
 
-        InterpolateProduct(U2, U1_tot, neumannTemp);
-        r2 += ddx(neumannTemp);
-    }
+            InterpolateProduct(U1, U2_tot, neumannTemp, workspace);
+            r1 += ddy(neumannTemp);
 
-    // buoyancy nonlinear terms
-    DifferentiateProductBar(B, U3_tot, neumannTemp);
-    rB += neumannTemp;
+            InterpolateProduct(U2, U1_tot, neumannTemp, workspace);
+            r2 += ddx(neumannTemp);
+        }
 
-    if(gridParams.ThirdDimension())
-    {
-        InterpolateProduct(B, U2_tot, neumannTemp);
-        rB += ddy(neumannTemp);
-    }
+        // buoyancy nonlinear terms
+        DifferentiateProductBar(B, U3_tot, neumannTemp, workspace);
+        rB += neumannTemp;
 
-    InterpolateProduct(B, U1_tot, neumannTemp);
-    rB += ddx(neumannTemp);
+        if(gridParams.ThirdDimension())
+        {
+            InterpolateProduct(B, U2_tot, neumannTemp, workspace);
+            rB += ddy(neumannTemp);
+        }
 
+        InterpolateProduct(B, U1_tot, neumannTemp, workspace);
+        rB += ddx(neumannTemp);
 
-    // extra adjoint nonlinear terms
-    neumannTemp = ddx(u1_tot);
-    neumannTemp.ToNodal(nnTemp);
-    nnTemp2 = nnTemp*U1;
-    if(gridParams.ThirdDimension())
-    {
-        neumannTemp = ddx(u2_tot);
-        neumannTemp.ToNodal(nnTemp);
-        nnTemp2 += nnTemp*U2;
-    }
-    dirichletTemp = ddx(u3_tot);
-    dirichletTemp.ToNodal(ndTemp);
-    u1Forcing -= nnTemp2 + ReinterpolateDirichlet(ndTemp*U3);
 
-    if(gridParams.ThirdDimension())
-    {
-        neumannTemp = ddy(u1_tot);
-        neumannTemp.ToNodal(nnTemp);
+        // extra adjoint nonlinear terms
+        neumannTemp = ddx(u1_tot);
+        neumannTemp.ToNodal(nnTemp, workspace.transform);
         nnTemp2 = nnTemp*U1;
-        neumannTemp = ddy(u2_tot);
-        neumannTemp.ToNodal(nnTemp);
-        nnTemp2 += nnTemp*U2;
-        dirichletTemp = ddy(u3_tot);
-        dirichletTemp.ToNodal(ndTemp);
-        u2Forcing -= nnTemp2 + ReinterpolateDirichlet(ndTemp*U3);
-    }
+        if(gridParams.ThirdDimension())
+        {
+            neumannTemp = ddx(u2_tot);
+            neumannTemp.ToNodal(nnTemp, workspace.transform);
+            nnTemp2 += nnTemp*U2;
+        }
+        dirichletTemp = ddx(u3_tot);
+        dirichletTemp.ToNodal(ndTemp, workspace.transform);
+        u1Forcing -= nnTemp2 + ReinterpolateDirichlet(ndTemp*U3);
 
-    dirichletTemp = ddz(u1_tot);
-    dirichletTemp.ToNodal(ndTemp);
-    ndTemp2 = ndTemp*ReinterpolateFull(U1);
-    if(gridParams.ThirdDimension())
-    {
-        dirichletTemp = ddz(u2_tot);
-        dirichletTemp.ToNodal(ndTemp);
-        ndTemp2 += ndTemp*ReinterpolateFull(U2);
-    }
-    neumannTemp = ddz(u3_tot);
-    neumannTemp.ToNodal(nnTemp);
-    u3Forcing -= ndTemp2 + ReinterpolateFull(nnTemp)*U3;
+        if(gridParams.ThirdDimension())
+        {
+            neumannTemp = ddy(u1_tot);
+            neumannTemp.ToNodal(nnTemp, workspace.transform);
+            nnTemp2 = nnTemp*U1;
+            neumannTemp = ddy(u2_tot);
+            neumannTemp.ToNodal(nnTemp, workspace.transform);
+            nnTemp2 += nnTemp*U2;
+            dirichletTemp = ddy(u3_tot);
+            dirichletTemp.ToNodal(ndTemp, workspace.transform);
+            u2Forcing -= nnTemp2 + ReinterpolateDirichlet(ndTemp*U3);
+        }
+
+        dirichletTemp = ddz(u1_tot);
+        dirichletTemp.ToNodal(ndTemp, workspace.transform);
+        ndTemp2 = ndTemp*ReinterpolateFull(U1);
+        if(gridParams.ThirdDimension())
+        {
+            dirichletTemp = ddz(u2_tot);
+            dirichletTemp.ToNodal(ndTemp, workspace.transform);
+            ndTemp2 += ndTemp*ReinterpolateFull(U2);
+        }
+        neumannTemp = ddz(u3_tot);
+        neumannTemp.ToNodal(nnTemp, workspace.transform);
+        u3Forcing -= ndTemp2 + ReinterpolateFull(nnTemp)*U3;
 
 
-    neumannTemp = ddx(b_tot);
-    neumannTemp.ToNodal(nnTemp);
-    u1Forcing -= nnTemp*B;
+        neumannTemp = ddx(b_tot);
+        neumannTemp.ToNodal(nnTemp, workspace.transform);
+        u1Forcing -= nnTemp*B;
 
-    if(gridParams.ThirdDimension())
-    {
-        neumannTemp = ddy(b_tot);
-        neumannTemp.ToNodal(nnTemp);
-        u2Forcing -= nnTemp*B;
-    }
+        if(gridParams.ThirdDimension())
+        {
+            neumannTemp = ddy(b_tot);
+            neumannTemp.ToNodal(nnTemp, workspace.transform);
+            u2Forcing -= nnTemp*B;
+        }
 
-    dirichletTemp = ddz(b_tot);
-    dirichletTemp.ToNodal(ndTemp);
-    u3Forcing -= ndTemp*ReinterpolateFull(B);
+        dirichletTemp = ddz(b_tot);
+        dirichletTemp.ToNodal(ndTemp, workspace.transform);
+        u3Forcing -= ndTemp*ReinterpolateFull(B);
 
-    // Now include all the forcing terms
-    u1Forcing.ToModal(neumannTemp);
-    r1 += neumannTemp;
-    if (gridParams.ThirdDimension())
-    {
-        u2Forcing.ToModal(neumannTemp);
-        r2 += neumannTemp;
+        // Now include all the forcing terms
+        u1Forcing.ToModal(neumannTemp, workspace.transform);
+        r1 += neumannTemp;
+        if (gridParams.ThirdDimension())
+        {
+            u2Forcing.ToModal(neumannTemp, workspace.transform);
+            r2 += neumannTemp;
+        }
+        u3Forcing.ToModal(dirichletTemp, workspace.transform);
+        r3 += dirichletTemp;
+        bForcing.ToModal(neumannTemp, workspace.transform);
+        rB += neumannTemp;
     }
-    u3Forcing.ToModal(dirichletTemp);
-    r3 += dirichletTemp;
-    bForcing.ToModal(neumannTemp);
-    rB += neumannTemp;
 }
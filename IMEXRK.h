@@ -3,17 +3,23 @@
 #include "Stratiflow.h"
 
 #include "Field.h"
+#include "ForwardTrajectory.h"
 #include "Differentiation.h"
 #include "Integration.h"
 #include "Graph.h"
 #include "OSUtils.h"
 #include "Tridiagonal.h"
+#include "Profiling.h"
 
 #include <iostream>
 #include <fstream>
 #include <chrono>
 #include <dirent.h>
 #include <map>
+#include <list>
+#include <iterator>
+#include <cstdlib>
+#include <algorithm>
 
 #include <omp.h>
 
@@ -22,11 +28,25 @@
 #include <string>
 
 // will become unnecessary with C++17
-#define MatMulDim1 Dim1MatMul<Map<const Array<complex, -1, 1>, Aligned16>, stratifloat, complex, M1, gridParams.N2, gridParams.N3>
-#define MatMulDim2 Dim2MatMul<Map<const Array<complex, -1, 1>, Aligned16>, stratifloat, complex, M1, gridParams.N2, gridParams.N3>
-#define MatMulDim3 Dim3MatMul<Map<const Array<complex, -1, 1>, Aligned16>, stratifloat, complex, M1, gridParams.N2, gridParams.N3>
-#define MatMulDim3Nodal Dim3MatMul<Map<const Array<stratifloat, -1, 1>, Aligned16>, stratifloat, stratifloat, gridParams.N1, gridParams.N2, gridParams.N3>
-#define MatMul1D Dim3MatMul<Map<const Array<stratifloat, -1, 1>, Aligned16>, stratifloat, stratifloat, gridParams.N1, gridParams.N2, gridParams.N3>
+#define MatMulDim1 Dim1MatMul<Field<complex, GridM1, GridN2, GridN3>, stratifloat, complex, GridM1, GridN2, GridN3>
+#define MatMulDim2 Dim2MatMul<Field<complex, GridM1, GridN2, GridN3>, stratifloat, complex, GridM1, GridN2, GridN3>
+#define MatMulDim3 Dim3BandedMatMul<Field<complex, GridM1, GridN2, GridN3>, stratifloat, complex, GridM1, GridN2, GridN3>
+#define MatMulDim3Nodal Dim3BandedMatMul<Field<stratifloat, GridN1, GridN2, GridN3>, stratifloat, stratifloat, GridN1, GridN2, GridN3>
+#define MatMul1D Dim3BandedMatMul<Field1D<stratifloat, GridN1, GridN2, GridN3>, stratifloat, stratifloat, GridN1, GridN2, GridN3>
+
+// number of timesteps for which each solver keeps its implicit operators factorised,
+// each of which takes 27*N3*M1*N2 numbers, set by STRATIFLOW_IMPLICIT_CACHE
+// the default of 2 covers the timestep from the CFL condition and the shorter one which ends an evolution
+inline unsigned int ImplicitOperatorCacheSize()
+{
+    static const unsigned int size = []()
+    {
+        const char* setting = std::getenv("STRATIFLOW_IMPLICIT_CACHE");
+        return setting == nullptr ? 2u : static_cast<unsigned int>(std::max(1, std::atoi(setting)));
+    }();
+
+    return size;
+}
 
 class IMEXRK
 {
@@ -34,11 +54,19 @@ public:
     stratifloat deltaT = 0.01f;
 
 public:
+    // the variables are part of the bundle, which is in the same order in both spaces,
+    // with the spanwise velocity last so that it can be left out in 2D
     IMEXRK()
-    : solveLaplacian(M1*gridParams.N2)
-    , implicitSolveVelocityNeumann{std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>>(M1*gridParams.N2), std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>>(M1*gridParams.N2), std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>>(M1*gridParams.N2)}
-    , implicitSolveVelocityDirichlet{std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>>(M1*gridParams.N2), std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>>(M1*gridParams.N2), std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>>(M1*gridParams.N2)}
-    , implicitSolveBuoyancyNeumann{std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>>(M1*gridParams.N2), std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>>(M1*gridParams.N2), std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>>(M1*gridParams.N2)}
+    : variableBundle(gridParams.ThirdDimension() ? 4 : 3)
+    , u1(variableBundle, 0)
+    , u2(variableBundle, 3)
+    , b(variableBundle, 2)
+    , u3(variableBundle, 1)
+    , U1(variableBundle, 0)
+    , U2(variableBundle, 3)
+    , B(variableBundle, 2)
+    , U3(variableBundle, 1)
+    , solveLaplacian(M1*gridParams.N2)
     {
         assert(gridParams.ThirdDimension() || gridParams.N2 == 1);
 
@@ -49,7 +77,20 @@ public:
         dim3Derivative2Neumann = VerticalSecondDerivativeMatrix(flowParams.L3, gridParams.N3, BoundaryCondition::Neumann);
         dim3Derivative2Dirichlet = VerticalSecondDerivativeMatrix(flowParams.L3, gridParams.N3, BoundaryCondition::Dirichlet);
 
-        MatrixX laplacian;
+        dim1Derivative = FourierDerivativeMatrix(flowParams.L1, gridParams.N1, 1);
+        dim2Derivative = FourierDerivativeMatrix(flowParams.L2, gridParams.N2, 2);
+        dim3DerivativeNeumann = VerticalDerivativeMatrix(flowParams.L3, gridParams.N3, BoundaryCondition::Neumann);
+        dim3DerivativeDirichlet = VerticalDerivativeMatrix(flowParams.L3, gridParams.N3, BoundaryCondition::Dirichlet);
+        reinterpolateBar = NeumannReinterpolationBar(flowParams.L3, gridParams.N3);
+        reinterpolateTilde = NeumannReinterpolationTilde(flowParams.L3, gridParams.N3);
+        reinterpolateDirichlet = DirichletReinterpolation(flowParams.L3, gridParams.N3);
+
+        // only this process's stacks
+        int rows = OwnedRows(gridParams.N2, gridParams.N2, gridParams.N2).Count();
+        nonlinearProducts.resize(NonlinearProductCount()*OwnedStacks(gridParams.N1).Count()*rows*gridParams.N3);
+        nonlinearProductsModal.resize(NonlinearProductCount()*OwnedStacks(M1).Count()*rows*gridParams.N3);
+
+        BandedMatrix<stratifloat> laplacian;
 
         // we solve each vetical line separately, so N1*gridParams.N2 total solves
         for (int j1=0; j1<M1; j1++)
@@ -59,17 +100,16 @@ public:
                 laplacian = dim3Derivative2Neumann;
 
                 // add terms for horizontal derivatives
-                laplacian += dim1Derivative2.diagonal()(j1)*MatrixX::Identity(gridParams.N3, gridParams.N3);
-                laplacian += dim2Derivative2.diagonal()(j2)*MatrixX::Identity(gridParams.N3, gridParams.N3);
+                laplacian.diagonal(0) += dim1Derivative2.diagonal()(j1) + dim2Derivative2.diagonal()(j2);
 
                 Neumannify(laplacian);
 
                 // correct for singularity
                 if (j1==0 && j2==0)
                 {
-                    laplacian.row(0).setZero();
+                    laplacian.ZeroRow(0);
                     laplacian(0,0) = 1;
-                    laplacian.row(1).setZero();
+                    laplacian.ZeroRow(1);
                     laplacian(1,1) = 1;
                 }
 
@@ -80,8 +120,17 @@ public:
         UpdateForTimestep();
     }
 
-    void TimeStep();
+    // the copy's variables are part of its own bundle
+    IMEXRK(const IMEXRK& other)
+    : IMEXRK()
+    {
+        *this = other;
+    }
+
+    // if record is given, the step is added to it, so that it can be taken again linearised by TimeStepTangent
+    void TimeStep(Trajectory* record = nullptr);
     void TimeStepLinear();
+    void TimeStepTangent(const Trajectory& about, int step);
 
     void TimeStepAdjoint(const NeumannModal& u1Below,
                          const NeumannModal& u2Below,
@@ -92,61 +141,66 @@ public:
                          const DirichletModal& u3Above,
                          const NeumannModal& bAbove)
     {
-        stratifloat interpFrac = 0;
-        for (int k=0; k<s; k++)
+        TimeStepAdjoint([&](stratifloat interpFrac)
         {
-            // interpolate the direct state at the RK substep
             u1_tot = (1-interpFrac)*u1Above + interpFrac*u1Below;
             u2_tot = (1-interpFrac)*u2Above + interpFrac*u2Below;
             u3_tot = (1-interpFrac)*u3Above + interpFrac*u3Below;
             b_tot = (1-interpFrac)*bAbove + interpFrac*bBelow;
+        });
+    }
 
-            // todo: add on background in modal?
-            u1_tot.ToNodal(U1_tot);
-
-            U1_tot += U_;
-
-            U1_tot.ToModal(u1_tot);
-
-            UpdateAdjointVariables(u1_tot, u2_tot, u3_tot, b_tot);
-
-            ExplicitRK(k);
-            BuildRHSAdjoint();
-            FinishRHS(k);
-
-            CrankNicolson(k);
-
-            RemoveDivergence(1/h[k]);
-            FilterAll();
-
-            PopulateNodalVariables();
-
-            interpFrac += h[k]/deltaT;
-        }
+    // the same, with the direct states read straight from a trajectory, from step below to the one after it
+    void TimeStepAdjoint(const ForwardTrajectory& trajectory, int below)
+    {
+        TimeStepAdjoint([&](stratifloat interpFrac)
+        {
+            trajectory.Interpolate(below+1, below, interpFrac, u1_tot, u2_tot, u3_tot, b_tot);
+        });
     }
 
     void FilterAll()
     {
         // To prevent anything dodgy accumulating in the unused coefficients
-        u1.Filter();
+        GRAPH_TASK(depend(inout: this->u1))
+        {
+            PROFILE(FilterAll);
+            u1.Filter();
+        }
         if(gridParams.ThirdDimension())
         {
-            u2.Filter();
+            GRAPH_TASK(depend(inout: this->u2))
+            {
+                PROFILE(FilterAll);
+                u2.Filter();
+            }
+        }
+        GRAPH_TASK(depend(inout: this->u3))
+        {
+            PROFILE(FilterAll);
+            u3.Filter();
+        }
+        GRAPH_TASK(depend(inout: this->b))
+        {
+            PROFILE(FilterAll);
+            b.Filter();
+        }
+        GRAPH_TASK(depend(inout: this->p))
+        {
+            PROFILE(FilterAll);
+            p.Filter();
         }
-        u3.Filter();
-        b.Filter();
-        p.Filter();
     }
 
     void PopulateNodalVariables()
     {
-        u1.ToNodal(U1);
-        if (gridParams.ThirdDimension())
+        // the variables are transformed together, so this waits for all of them
+        GRAPH_TASK(depend(in: this->u1, this->u2, this->u3, this->b) depend(inout: this->U1, this->variableBundle))
         {
-            u2.ToNodal(U2);
+            PROFILE(PopulateNodalVariables);
+
+            variableBundle.ToNodal();
         }
-        u3.ToNodal(U3);
-        b.ToNodal(B);
 
         // U1.Antisymmetrise();
         // if (gridParams.ThirdDimension())
@@ -161,6 +215,18 @@ public:
         // B.ToModal(b);
     }
 
+    // the reverse, which is only needed when setting the flow, so isn't a task
+    void PopulateModalVariables()
+    {
+        variableBundle.ToModal();
+
+        // which in 2D doesn't include the spanwise velocity
+        if (!gridParams.ThirdDimension())
+        {
+            U2.ToModal(u2);
+        }
+    }
+
     void PrepareRun(std::string imageDir, bool makeDirs = true)
     {
         imageDirectory = imageDir;
@@ -304,10 +370,12 @@ public:
 
     void SetInitial(const NeumannNodal& velocity1, const NeumannNodal& velocity2, const DirichletNodal& velocity3, const NeumannNodal& buoyancy)
     {
-        velocity1.ToModal(u1);
-        velocity2.ToModal(u2);
-        velocity3.ToModal(u3);
-        buoyancy.ToModal(b);
+        U1 = velocity1;
+        U2 = velocity2;
+        U3 = velocity3;
+        B = buoyancy;
+
+        PopulateModalVariables();
     }
 
     void SetInitial(const NeumannModal& velocity1, const NeumannModal& velocity2, const DirichletModal& velocity3, const NeumannModal& buoyancy)
@@ -341,16 +409,23 @@ public:
         u3_tot = velocity3;
         b_tot = buoyancy;
 
-        u1_tot.ToNodal(U1_tot);
+        PopulateBackgroundNodal();
+    }
+
+private:
+    void PopulateBackgroundNodal()
+    {
+        u1_tot.ToNodal(U1_tot, workspace.transform);
 
         if ((gridParams.dimensionality == Dimensionality::ThreeDimensional))
         {
-            u2_tot.ToNodal(U2_tot);
+            u2_tot.ToNodal(U2_tot, workspace.transform);
         }
-        u3_tot.ToNodal(U3_tot);
-        b_tot.ToNodal(B_tot);
+        u3_tot.ToNodal(U3_tot, workspace.transform);
+        b_tot.ToNodal(B_tot, workspace.transform);
     }
 
+public:
     // gives an upper bound on cfl number - also updates timestep
     stratifloat CFL()
     {
@@ -414,7 +489,12 @@ public:
 
     void SaveFlow(const std::string& filename) const
     {
-        std::ofstream filestream(filename, std::ios::out | std::ios::binary);
+        // only the first process writes, and opening the file on the others would truncate what it had written
+        std::ofstream filestream;
+        if (ProcessRank() == 0)
+        {
+            filestream.open(filename, std::ios::out | std::ios::binary);
+        }
 
         U1.Save(filestream);
         U2.Save(filestream);
@@ -436,24 +516,18 @@ public:
             U2.Zero(); // just to be sure
         }
 
-        U1.ToModal(u1);
-        U2.ToModal(u2);
-        U3.ToModal(u3);
-        B.ToModal(b);
+        PopulateModalVariables();
     }
 
     stratifloat JoverK()
     {
-        static NeumannModal u1_total;
-        static NeumannModal b_total;
-
         nnTemp = U1 + U_;
-        nnTemp.ToModal(u1_total);
+        nnTemp.ToModal(u1_full);
 
         nnTemp = B;
-        nnTemp.ToModal(b_total);
+        nnTemp.ToModal(b_full);
 
-        UpdateAdjointVariables(u1_total, u2, u3, b_total);
+        UpdateAdjointVariables(u1_full, u2, u3, b_full);
 
         return J/K;
     }
@@ -464,16 +538,13 @@ public:
                                 const NeumannModal& b_total)
     {
         // todo: remove some of these
-        u1_total.ToNodal(U1_tot);
-        u2_total.ToNodal(U2_tot);
-        u3_total.ToNodal(U3_tot);
-        b_total.ToNodal(B_tot);
+        u1_total.ToNodal(U1_tot, workspace.transform);
+        u2_total.ToNodal(U2_tot, workspace.transform);
+        u3_total.ToNodal(U3_tot, workspace.transform);
+        b_total.ToNodal(B_tot, workspace.transform);
 
         // work out variation of buoyancy from average
-        static Neumann1D bAve;
         HorizontalAverage(b_total, bAve);
-
-        static Dirichlet1D wAve;
         HorizontalAverage(u3_total, wAve);
 
         nnTemp = B_tot + -1*bAve;
@@ -483,7 +554,6 @@ public:
         ndTemp.ToModal(dirichletTemp);
 
         // construct integrand for J
-        static Dirichlet1D Jintegrand;
         HorizontalAverage(dirichletTemp, Jintegrand);
         J = IntegrateVertically(Jintegrand, flowParams.L3);
 
@@ -501,45 +571,72 @@ public:
 
     void UpdateForTimestep()
     {
-        std::cout << "Solving matices..." << std::endl;
-
         h[0] = deltaT*8.0/15.0;
         h[1] = deltaT*2.0/15.0;
         h[2] = deltaT*5.0/15.0;
 
+        // reuse the factorisations if we have seen this timestep recently, with the same parameters,
+        // as a solver may be created before a driver sets Re and Pr
+        for (auto cached = implicitOperators.begin(); cached != implicitOperators.end(); cached++)
+        {
+            if (cached->deltaT == deltaT && cached->Re == flowParams.Re && cached->Pr == flowParams.Pr)
+            {
+                implicitOperators.splice(implicitOperators.begin(), implicitOperators, cached);
+                return;
+            }
+        }
+
+        std::cout << "Solving matices..." << std::endl;
+
+        // otherwise overwrite the least recently used ones
+        if (implicitOperators.size() < ImplicitOperatorCacheSize())
+        {
+            implicitOperators.emplace_front();
+        }
+        else
+        {
+            implicitOperators.splice(implicitOperators.begin(), implicitOperators, std::prev(implicitOperators.end()));
+        }
+
+        ImplicitOperators& operators = implicitOperators.front();
+        operators.deltaT = deltaT;
+        operators.Re = flowParams.Re;
+        operators.Pr = flowParams.Pr;
 
         #pragma omp parallel for
         for (int j1=0; j1<M1; j1++)
         {
-            MatrixX laplacian;
-            MatrixX solve;
+            BandedMatrix<stratifloat> solve;
 
             for (int j2=0; j2<gridParams.N2; j2++)
             {
+                // the horizontal derivatives just shift the diagonal
+                stratifloat shift = dim1Derivative2.diagonal()(j1) + dim2Derivative2.diagonal()(j2);
+
                 for (int k=0; k<s; k++)
                 {
-                    laplacian = dim3Derivative2Neumann;
-                    laplacian += dim1Derivative2.diagonal()(j1)*MatrixX::Identity(gridParams.N3, gridParams.N3);
-                    laplacian += dim2Derivative2.diagonal()(j2)*MatrixX::Identity(gridParams.N3, gridParams.N3);
-
-                    solve = (MatrixX::Identity(gridParams.N3, gridParams.N3)-0.5*h[k]*laplacian/flowParams.Re);
+                    // solve = I - c*(laplacian + shift*I)
+                    stratifloat c = 0.5*h[k]/flowParams.Re;
+                    solve = dim3Derivative2Neumann;
+                    solve *= -c;
+                    solve.diagonal(0) += 1 - c*shift;
                     Neumannify(solve);
-                    implicitSolveVelocityNeumann[k][j1*gridParams.N2+j2].compute(solve);
+                    operators.velocityNeumann[k][j1*gridParams.N2+j2].compute(solve);
 
-                    solve = (MatrixX::Identity(gridParams.N3, gridParams.N3)-0.5*h[k]*laplacian/flowParams.Re/flowParams.Pr);
+                    c = 0.5*h[k]/flowParams.Re/flowParams.Pr;
+                    solve = dim3Derivative2Neumann;
+                    solve *= -c;
+                    solve.diagonal(0) += 1 - c*shift;
                     Neumannify(solve);
-                    implicitSolveBuoyancyNeumann[k][j1*gridParams.N2+j2].compute(solve);
-
+                    operators.buoyancyNeumann[k][j1*gridParams.N2+j2].compute(solve);
 
-                    laplacian = dim3Derivative2Dirichlet;
-                    laplacian += dim1Derivative2.diagonal()(j1)*MatrixX::Identity(gridParams.N3, gridParams.N3);
-                    laplacian += dim2Derivative2.diagonal()(j2)*MatrixX::Identity(gridParams.N3, gridParams.N3);
-
-                    solve = (MatrixX::Identity(gridParams.N3, gridParams.N3)-0.5*h[k]*laplacian/flowParams.Re);
+                    c = 0.5*h[k]/flowParams.Re;
+                    solve = dim3Derivative2Dirichlet;
+                    solve *= -c;
+                    solve.diagonal(0) += 1 - c*shift;
                     Dirichlify(solve);
-                    implicitSolveVelocityDirichlet[k][j1*gridParams.N2+j2].compute(solve);
+                    operators.velocityDirichlet[k][j1*gridParams.N2+j2].compute(solve);
                 }
-
             }
         }
     }
@@ -548,58 +645,110 @@ private:
     void CNSolve(NeumannModal& solve, NeumannModal& into, int k)
     {
         solve.ZeroEnds();
-        solve.Solve(implicitSolveVelocityNeumann[k], into);
+        solve.Solve(implicitOperators.front().velocityNeumann[k], into);
     }
 
     void CNSolve(DirichletModal& solve, DirichletModal& into, int k)
     {
         solve.ZeroEnds();
-        solve.Solve(implicitSolveVelocityDirichlet[k], into);
+        solve.Solve(implicitOperators.front().velocityDirichlet[k], into);
     }
 
     void CNSolveBuoyancy(NeumannModal& solve, NeumannModal& into, int k)
     {
         solve.ZeroEnds();
-        solve.Solve(implicitSolveBuoyancyNeumann[k], into);
+        solve.Solve(implicitOperators.front().buoyancyNeumann[k], into);
     }
 
     void CNSolve(NeumannNodal& solve, NeumannNodal& into, int k)
     {
         solve.ZeroEnds();
-        solve.Solve(implicitSolveVelocityNeumann[k][0], into);
+        solve.Solve(implicitOperators.front().velocityNeumann[k][0], into);
     }
 
     void CNSolve(DirichletNodal& solve, DirichletNodal& into, int k)
     {
         solve.ZeroEnds();
-        solve.Solve(implicitSolveVelocityDirichlet[k][0], into);
+        solve.Solve(implicitOperators.front().velocityDirichlet[k][0], into);
     }
 
     void CNSolveBuoyancy(NeumannNodal& solve, NeumannNodal& into, int k)
     {
         solve.ZeroEnds();
-        solve.Solve(implicitSolveBuoyancyNeumann[k][0], into);
+        solve.Solve(implicitOperators.front().buoyancyNeumann[k][0], into);
     }
 
     void CNSolve1D(Neumann1D& solve, Neumann1D& into, int k, bool buoyancy = false)
     {
         solve.ZeroEnds();
-        solve.Solve(implicitSolveVelocityNeumann[k][0], into);
+        solve.Solve(implicitOperators.front().velocityNeumann[k][0], into);
     }
 
     void CNSolveBuoyancy1D(Neumann1D& solve, Neumann1D& into, int k, bool buoyancy = false)
     {
         solve.ZeroEnds();
-        solve.Solve(implicitSolveBuoyancyNeumann[k][0], into);
+        solve.Solve(implicitOperators.front().buoyancyNeumann[k][0], into);
     }
 
     void CrankNicolson(int k, bool evolveBackground = false);
     void FinishRHS(int k);
     void ExplicitRK(int k, bool evolveBackground = false);
     void BuildRHS();
+    void BuildNonlinearTerms();
+    template<int K3>
+    void BuildNonlinearTermsOfSize(int count);
+    int NonlinearProductCount() const;
     void BuildRHSLinear();
     void BuildRHSAdjoint();
 
+    // one adjoint timestep, where interpolate(fraction) sets u1_tot, u2_tot, u3_tot and b_tot
+    // to the direct state that fraction of the way back through the step
+    template<typename Interpolate>
+    void TimeStepAdjoint(Interpolate interpolate)
+    {
+        PROFILE(TimeStep);
+
+        #pragma omp parallel if(UseTaskGraph())
+        #pragma omp single
+        {
+            stratifloat interpFrac = 0;
+            for (int k=0; k<s; k++)
+            {
+                // the direct state is used throughout the substep, so the previous one has to be finished first
+                #pragma omp taskwait
+
+                // interpolate the direct state at the RK substep
+                interpolate(interpFrac);
+
+                // todo: add on background in modal?
+                u1_tot.ToNodal(U1_tot, workspace.transform);
+
+                U1_tot += U_;
+
+                U1_tot.ToModal(u1_tot);
+
+                UpdateAdjointVariables(u1_tot, u2_tot, u3_tot, b_tot);
+
+                ExplicitRK(k);
+                BuildRHSAdjoint();
+                FinishRHS(k);
+
+                CrankNicolson(k);
+
+                RemoveDivergence(1/h[k]);
+                FilterAll();
+
+                PopulateNodalVariables();
+
+                interpFrac += h[k]/deltaT;
+            }
+        }
+    }
+
+private:
+    // used to transform all the variables at once, which are views of it, so it must be made first
+    FieldBundle<GridN1, GridN2, GridN3> variableBundle;
+
 public:
     // these are the actual variables we care about
     NeumannModal u1, u2, b, p;
@@ -622,11 +771,18 @@ private:
     // extra variables required for adjoint forcing
     stratifloat J, K;
 
+    Neumann1D bAve;
+    Dirichlet1D wAve, Jintegrand;
+
+    // full velocity and buoyancy, for the mixing in JoverK
+    NeumannModal u1_full, b_full;
+
     NeumannNodal u1Forcing, u2Forcing;
     DirichletNodal u3Forcing, bForcing;
 
     // parameters for the scheme
     static constexpr int s = 3;
+    static_assert(Trajectory::Substeps == s, "a trajectory records the state at the start of each substep");
     stratifloat h[3];
     static constexpr stratifloat beta[3] = {1.0, 25.0/8.0, 9.0/4.0};
     static constexpr stratifloat zeta[3] = {0, -17.0/8.0, -5.0/4.0};
@@ -646,6 +802,9 @@ private:
     mutable NeumannNodal nnTemp, nnTemp2;
     mutable DirichletNodal ndTemp, ndTemp2;
 
+    // scratch space, which is kept here rather than shared so that several solvers can run at once
+    Workspace workspace;
+
     mutable NeumannModal neumannTemp;
     mutable DirichletModal dirichletTemp;
 
@@ -658,13 +817,48 @@ private:
     // these are precomputed matrices for performing and solving derivatives
     DiagonalMatrix<stratifloat, -1> dim1Derivative2;
     DiagonalMatrix<stratifloat, -1> dim2Derivative2;
-    MatrixX dim3Derivative2Neumann;
-    MatrixX dim3Derivative2Dirichlet;
+    BandedMatrix<stratifloat> dim3Derivative2Neumann;
+    BandedMatrix<stratifloat> dim3Derivative2Dirichlet;
+
+    // these are used by the fused nonlinear terms, which work on whole stacks rather than fields
+    DiagonalMatrix<complex, -1> dim1Derivative;
+    DiagonalMatrix<complex, -1> dim2Derivative;
+    BandedMatrix<stratifloat> dim3DerivativeNeumann;
+    BandedMatrix<stratifloat> dim3DerivativeDirichlet;
+    BandedMatrix<stratifloat> reinterpolateBar;
+    BandedMatrix<stratifloat> reinterpolateTilde;
+    BandedMatrix<stratifloat> reinterpolateDirichlet;
+
+    // all the quadratic products for the nonlinear terms, with the products for each (j1, j2)
+    // stored one after another so the whole lot can be transformed by a single FFT
+    ArrayX nonlinearProducts;
+    ArrayXc nonlinearProductsModal;
+    TransformScratch nonlinearTransform;
+
+    using TridiagonalBank = std::vector<Tridiagonal<stratifloat, GridN3>, aligned_allocator<Tridiagonal<stratifloat, GridN3>>>;
+
+    // the factorised Crank-Nicolson operators for each substep of one timestep
+    struct ImplicitOperators
+    {
+        ImplicitOperators()
+        : velocityNeumann{TridiagonalBank(M1*gridParams.N2), TridiagonalBank(M1*gridParams.N2), TridiagonalBank(M1*gridParams.N2)}
+        , velocityDirichlet{TridiagonalBank(M1*gridParams.N2), TridiagonalBank(M1*gridParams.N2), TridiagonalBank(M1*gridParams.N2)}
+        , buoyancyNeumann{TridiagonalBank(M1*gridParams.N2), TridiagonalBank(M1*gridParams.N2), TridiagonalBank(M1*gridParams.N2)}
+        {
+        }
+
+        stratifloat deltaT;
+        stratifloat Re;
+        stratifloat Pr;
+        TridiagonalBank velocityNeumann[3];
+        TridiagonalBank velocityDirichlet[3];
+        TridiagonalBank buoyancyNeumann[3];
+    };
+
+    // most recently used first, the front is the current timestep
+    std::list<ImplicitOperators> implicitOperators;
 
-    std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>> implicitSolveVelocityNeumann[3];
-    std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>> implicitSolveVelocityDirichlet[3];
-    std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>> implicitSolveBuoyancyNeumann[3];
-    std::vector<Tridiagonal<stratifloat, gridParams.N3>, aligned_allocator<Tridiagonal<stratifloat, gridParams.N3>>> solveLaplacian;
+    TridiagonalBank solveLaplacian;
 
     std::string imageDirectory;
 };
@@ -7,11 +7,11 @@ stratifloat IntegrateVertically(const Nodal1D<N1,N2,N3>& U, stratifloat L3)
 {
     if (U.BC() == BoundaryCondition::Neumann)
     {
-        static ArrayX z = VerticalPoints(L3,N3);
+        static ArrayX z = VerticalPoints(L3,U.Size3());
 
         stratifloat result = 0;
 
-        for (int k=1; k<N3-1; k++)
+        for (int k=1; k<U.Size3()-1; k++)
         {
             result += (z(k+1)-z(k))*U.Get()(k);
         }
@@ -21,11 +21,11 @@ stratifloat IntegrateVertically(const Nodal1D<N1,N2,N3>& U, stratifloat L3)
     }
     else
     {
-        static ArrayX z = VerticalPointsFractional(L3,N3);
+        static ArrayX z = VerticalPointsFractional(L3,U.Size3());
 
         stratifloat result = 0;
 
-        for (int k=2; k<N3-1; k++)
+        for (int k=2; k<U.Size3()-1; k++)
         {
             result += (z(k)-z(k-1))*U.Get()(k);
         }
@@ -39,6 +39,7 @@ void HorizontalAverage(const ModalField<N1,N2,N3>& integrand, Nodal1D<N1,N2,N3>&
 {
     // the zero mode gives the horizontal average (should always be real)
     into.Get() = real(integrand.stack(0,0));
+    ShareFromProcess(into.Get().data(), into.Size3(), StackOwner(0, 0));
 }
 
 template<int N1, int N2, int N3>
@@ -50,8 +51,7 @@ void RemoveHorizontalAverage(ModalField<N1,N2,N3>& field)
 template<int N1, int N2, int N3>
 stratifloat IntegrateAllSpace(const ModalField<N1,N2,N3>& u, stratifloat L1, stratifloat L2, stratifloat L3)
 {
-    static Nodal1D<N1,N2,N3> horzAve(u.BC());
-    horzAve.Reset(u.BC());
+    Nodal1D<N1,N2,N3> horzAve(u.BC(), u.Size3());
     HorizontalAverage(u,horzAve);
     return IntegrateVertically(horzAve,L3)*L1*L2;
 }
@@ -78,8 +78,7 @@ template<typename C, typename T, int N1, int N2, int N3>
 stratifloat InnerProd(const NodalField<N1,N2,N3>& A, const NodalField<N1,N2,N3>& B, stratifloat L3, const StackContainer<C,T,N1,N2,N3>& weight)
 {
     assert(A.BC() == B.BC());
-    static NodalField<N1,N2,N3> U(A.BC());
-    U.Reset(A.BC());
+    NodalField<N1,N2,N3> U(A.BC(), A.Size1(), A.Size2(), A.Size3());
 
     U = A*B*weight;
 
@@ -89,12 +88,8 @@ stratifloat InnerProd(const NodalField<N1,N2,N3>& A, const NodalField<N1,N2,N3>&
 template<typename C, typename T, int N1, int N2, int N3>
 stratifloat InnerProd(const ModalField<N1,N2,N3>& a, const ModalField<N1,N2,N3>& b, stratifloat L3, const StackContainer<C,T,N1,N2,N3>& weight)
 {
-    static NodalField<N1,N2,N3> A(a.BC());
-    static NodalField<N1,N2,N3> B(b.BC());
-
-    A.Reset(a.BC());
-    B.Reset(b.BC());
-
+    NodalField<N1,N2,N3> A(a.BC(), a.NodalSize1(), a.Size2(), a.Size3());
+    NodalField<N1,N2,N3> B(b.BC(), b.NodalSize1(), b.Size2(), b.Size3());
 
     a.ToNodal(A);
     b.ToNodal(B);
@@ -106,8 +101,7 @@ template<int N1, int N2, int N3>
 stratifloat InnerProd(const NodalField<N1,N2,N3>& A, const NodalField<N1,N2,N3>& B, stratifloat L3)
 {
     assert(A.BC() == B.BC());
-    static NodalField<N1,N2,N3> U(A.BC());
-    U.Reset(A.BC());
+    NodalField<N1,N2,N3> U(A.BC(), A.Size1(), A.Size2(), A.Size3());
 
     U = A*B;
 
@@ -118,29 +112,24 @@ template<int N1, int N2, int N3>
 stratifloat InnerProd(const ModalField<N1,N2,N3>& a, const ModalField<N1,N2,N3>& b, stratifloat L3)
 {
     assert(a.BC() == b.BC());
-    static Nodal1D<N1,N2,N3> horzAve(a.BC());
-    horzAve.Reset(a.BC());
+    Nodal1D<N1,N2,N3> horzAve(a.BC(), a.Size3());
 
-    for (int j3=0; j3<N3; j3++)
+    OwnedStacks owned(a.Size1());
+    OwnedRows rows(a.Size2(), a.Size2(), a.Size2());
+
+    // a stack at a time, rather than looking up each value
+    horzAve.Get().setZero();
+    for (int n=0; n<owned.Count(); n++)
     {
-        stratifloat sum = 0;
-        for (int j1=0; j1<N1/2 + 1; j1++)
+        int j1 = owned[n];
+        for (int row=0; row<rows.Count(); row++)
         {
-            for (int j2=0; j2<N2; j2++)
-            {
-                if (j1==0 && j2==0)
-                {
-                    sum += std::real(a(j1,j2,j3)*std::conj(b(j1,j2,j3)));
-                }
-                else
-                {
-                    sum += 2*std::real(a(j1,j2,j3)*std::conj(b(j1,j2,j3)));
-                }
-            }
+            int j2 = rows[row];
+            stratifloat weight = (j1==0 && j2==0) ? 1 : 2;
+            horzAve.Get() += weight*(a.stack(j1,j2)*b.stack(j1,j2).conjugate()).real();
         }
-
-        horzAve.Get()[j3] = sum;
     }
+    SumOverProcesses(horzAve.Get().data(), a.Size3());
 
     return IntegrateVertically(horzAve, L3);
 }
@@ -0,0 +1,116 @@
+#include "KrylovBasis.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+KrylovStorage::KrylovStorage(const std::string& environment)
+: budget(std::numeric_limits<std::size_t>::max())
+, reducedPrecision(false)
+, spillDirectory(".")
+{
+    if (const char* fromEnvironment = std::getenv((environment + "_MEMORY").c_str()))
+    {
+        budget = std::stoull(fromEnvironment)*1024*1024;
+    }
+
+    if (const char* fromEnvironment = std::getenv((environment + "_SPILL").c_str()))
+    {
+        spillDirectory = fromEnvironment;
+    }
+
+    if (const char* fromEnvironment = std::getenv((environment + "_PRECISION").c_str()))
+    {
+        reducedPrecision = std::string(fromEnvironment) == "reduced";
+    }
+}
+
+KrylovStorage::~KrylovStorage()
+{
+    for (void* mapping : mappings)
+    {
+        munmap(mapping, mappingSize);
+    }
+
+    if (spillFile != -1)
+    {
+        close(spillFile);
+    }
+}
+
+void* KrylovStorage::Block(int k, std::size_t bytes)
+{
+    assert(blockSize == 0 || bytes == blockSize);
+    blockSize = bytes;
+
+    if (k >= static_cast<int>(blocks.size()))
+    {
+        blocks.resize(k+1, nullptr);
+    }
+
+    if (blocks[k] == nullptr)
+    {
+        if (used + bytes <= budget)
+        {
+            inMemory.emplace_back(new char[bytes]);
+            blocks[k] = inMemory.back().get();
+            used += bytes;
+        }
+        else
+        {
+            blocks[k] = Spill(bytes);
+        }
+    }
+
+    return blocks[k];
+}
+
+const void* KrylovStorage::Block(int k) const
+{
+    assert(k < static_cast<int>(blocks.size()) && blocks[k] != nullptr);
+    return blocks[k];
+}
+
+void* KrylovStorage::Spill(std::size_t bytes)
+{
+    if (spillFile == -1)
+    {
+        // several processes, or several bases in one process, may spill to the same directory
+        static std::atomic<int> files(0);
+        std::string filename = spillDirectory + "/krylov-" + std::to_string(getpid())
+                             + "-" + std::to_string(files++) + ".spill";
+
+        spillFile = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (spillFile == -1)
+        {
+            throw std::runtime_error("Error: could not create " + filename);
+        }
+
+        // the data is then only reachable through the mappings, and is removed when they are
+        unlink(filename.c_str());
+
+        // mappings have to start on a page boundary
+        std::size_t page = sysconf(_SC_PAGESIZE);
+        mappingSize = (bytes + page - 1)/page*page;
+    }
+
+    if (ftruncate(spillFile, spillSize + mappingSize) != 0)
+    {
+        throw std::runtime_error("Error: could not extend the Krylov spill file");
+    }
+
+    void* mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, spillFile, spillSize);
+    if (mapping == MAP_FAILED)
+    {
+        throw std::runtime_error("Error: could not map the Krylov spill file");
+    }
+
+    spillSize += mappingSize;
+    mappings.push_back(mapping);
+    return mapping;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "Eigen.h"
+#include "Constants.h"
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Stores the vectors of a Krylov basis, which at 3D resolutions can take far more memory than the machine has
+//
+// Each vector's memory is only allocated when it is first stored, and only the values which the dealiasing
+// allows to be nonzero are kept, optionally in reduced precision (half the bits of stratifloat).
+// Once the vectors in memory reach a budget, the rest go in a memory mapped file,
+// which the operating system pages in and out as they are used.
+//
+// These are set from the environment:
+//   STRATIFLOW_KRYLOV_MEMORY     the budget in megabytes, unlimited by default
+//   STRATIFLOW_KRYLOV_SPILL      the directory for the file, the working directory by default
+//   STRATIFLOW_KRYLOV_PRECISION  "reduced" to store the vectors in reduced precision
+// other uses (such as the checkpoints of an adjoint evolution) can read them with a different prefix
+
+#ifdef USE_DOUBLE
+using ReducedFloat = float;
+#else
+using ReducedFloat = half;
+#endif
+
+// the memory for each vector, as raw bytes
+class KrylovStorage
+{
+public:
+    explicit KrylovStorage(const std::string& environment = "STRATIFLOW_KRYLOV");
+    ~KrylovStorage();
+
+    KrylovStorage(const KrylovStorage&) = delete;
+    KrylovStorage& operator=(const KrylovStorage&) = delete;
+
+    // the memory for vector k, which is allocated the first time
+    void* Block(int k, std::size_t bytes);
+    const void* Block(int k) const;
+
+    bool ReducedPrecision() const
+    {
+        return reducedPrecision;
+    }
+
+private:
+    void* Spill(std::size_t bytes);
+
+    std::size_t budget;
+    std::size_t used = 0;
+    bool reducedPrecision;
+    std::string spillDirectory;
+
+    std::vector<std::unique_ptr<char[]>> inMemory;
+    std::vector<void*> blocks;
+    std::size_t blockSize = 0;
+
+    // the mapped parts of the file, which is deleted as soon as it is opened
+    int spillFile = -1;
+    std::size_t spillSize = 0;
+    std::vector<void*> mappings;
+    std::size_t mappingSize = 0;
+};
+
+template<typename VectorType>
+class KrylovBasis
+{
+public:
+    explicit KrylovBasis(const std::string& environment = "STRATIFLOW_KRYLOV")
+    : storage(environment)
+    {
+    }
+
+    void Store(int k, const VectorType& vector)
+    {
+        std::size_t size = vector.PackedSize();
+        if (storage.ReducedPrecision())
+        {
+            vector.Pack(static_cast<ReducedFloat*>(storage.Block(k, size*sizeof(ReducedFloat))));
+        }
+        else
+        {
+            vector.Pack(static_cast<stratifloat*>(storage.Block(k, size*sizeof(stratifloat))));
+        }
+    }
+
+    // into should be a vector whose values outside the dealiased range are zero, which these don't include
+    void Load(int k, VectorType& into) const
+    {
+        if (storage.ReducedPrecision())
+        {
+            into.Unpack(static_cast<const ReducedFloat*>(storage.Block(k)));
+        }
+        else
+        {
+            into.Unpack(static_cast<const stratifloat*>(storage.Block(k)));
+        }
+    }
+
+private:
+    KrylovStorage storage;
+};
@@ -51,6 +51,29 @@ int main(int argc, char *argv[])
 
     BasicNewtonKrylov solver;
 
+    // several Krylov directions can be evaluated at once, which helps when there are more threads than one evolution can use
+    if (const char* fromEnvironment = std::getenv("STRATIFLOW_KRYLOV_BLOCK"))
+    {
+        solver.blockSize = std::stoi(fromEnvironment);
+    }
+
+    // restarting GMRES bounds the size of its basis, and deflation keeps it converging well
+    if (const char* fromEnvironment = std::getenv("STRATIFLOW_GMRES_RESTART"))
+    {
+        solver.restartLength = std::stoi(fromEnvironment);
+    }
+    if (const char* fromEnvironment = std::getenv("STRATIFLOW_GMRES_DEFLATE"))
+    {
+        solver.deflatedVectors = std::stoi(fromEnvironment);
+    }
+
+    // the tangent linear equations are evolved about the stored trajectory, rather than taking finite differences
+    // this doesn't support an evolving background
+    if (const char* fromEnvironment = std::getenv("STRATIFLOW_KRYLOV_TANGENT"))
+    {
+        solver.tangentLinear = std::string(fromEnvironment) != "0" && !flowParams.EvolveBackground;
+    }
+
     solver.Run(guess);
 
     guess.SaveToFile("final");
@@ -1,12 +1,22 @@
 #pragma once
 
+#include "StateVector.h"
+#include "KrylovBasis.h"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include <omp.h>
+
 template<typename VectorType>
 class NewtonKrylov
 {
 public:
     NewtonKrylov()
-    : q(K)
-    , H(K, K-1)
+    : H(K, K-1)
+    , R(K, K-1)
+    , g0(K)
+    , g(K)
     {
         H.setZero();
     }
@@ -107,9 +117,38 @@ public:
 
     virtual void EnforceConstraints(VectorType& at) {}
 
+    // number of Krylov directions evaluated at once, each with its own solver
+    // this should only be more than 1 if EvalFunctionWithSolver is overridden
+    int blockSize = 1;
+
+    // whether derivatives are found with EvalTangent rather than a finite difference
+    bool tangentLinear = false;
+
+    // GMRES restarts when its basis has this many vectors, keeping deflatedVectors of them, see Restart
+    // 0 never restarts
+    int restartLength = 0;
+    int deflatedVectors = 0;
+
 protected:
     virtual VectorType EvalFunction(const VectorType& at) = 0;
 
+    // the same, but evolving with the given solver rather than StateVector::solver, so that several can run at once
+    // problems which change global parameters (such as flowParams.Ri) cannot do this, and keep blockSize at 1
+    virtual VectorType EvalFunctionWithSolver(const VectorType& at, IMEXRK& /*solver*/)
+    {
+        assert(blockSize == 1);
+        return EvalFunction(at);
+    }
+
+    // the derivative of EvalFunction applied to at, about the point EvalFunction was last called at by Run
+    // problems that can evolve the tangent linear equations about the trajectory from that call should override this,
+    // as it is cheaper than the extra nonlinear evolution of a finite difference, and doesn't lose precision
+    virtual VectorType EvalTangent(const VectorType& at, IMEXRK& /*solver*/)
+    {
+        assert(!tangentLinear);
+        return at;
+    }
+
     stratifloat T = 11; // time interval for integration
 
 private:
@@ -118,6 +157,11 @@ private:
 
     VectorType EvalDerivative(const VectorType& at)
     {
+        if (tangentLinear)
+        {
+            return EvalTangent(at, StateVector::solver);
+        }
+
         const stratifloat eps = 1e-7*linearAboutStart.Norm()/at.Norm();
         VectorType temp = linearAboutStart;
 
@@ -131,111 +175,496 @@ private:
         return temp;
     }
 
-    // solves A x = G-x0 for x
-    // where A = I-G_x
-    // GMRES is a Krylov-subspace method, hence Newton-Krylov
-    // Delta is a maximum size for x in the least squares solution
-    void GMRES(const VectorType& rhs, VectorType& x, stratifloat epsilon, stratifloat Delta=0)
+    VectorType EvalDerivative(const VectorType& at, IMEXRK& solver)
     {
-        VectorX y; // result in new basis
+        if (tangentLinear)
+        {
+            return EvalTangent(at, solver);
+        }
 
-        q[0] = rhs;
-        q[0].EnforceBCs();
+        const stratifloat eps = 1e-7*linearAboutStart.Norm()/at.Norm();
+        VectorType temp = linearAboutStart;
 
-        stratifloat beta = q[0].Norm();
-        std::cout << beta << std::endl;
-        q[0] *= 1/beta;
+        temp.MulAdd(eps, at);
+        temp = EvalFunctionWithSolver(temp, solver);
+
+        temp -= linearAboutEnd;
 
-        K = q.size();
-        for (int k=1; k<K; k++)
+        temp *= 1/eps;
+
+        return temp;
+    }
+
+    // images[n] = A q[first+n] for 0 <= n < count
+    // these don't depend on each other, so with blockSize above 1 they are evaluated at once,
+    // each in a nested parallel region with an equal share of the threads
+    void EvalDerivatives(int first, int count)
+    {
+        if (static_cast<int>(images.size()) < count)
+        {
+            directions.resize(count);
+            images.resize(count);
+        }
+
+        for (int n=0; n<count; n++)
         {
-            if (k > vectorsToReuse) // if we need to construct this basis vector
+            q.Load(first+n, directions[n]);
+        }
+
+        // with MPI only the main thread communicates, so they are evaluated one at a time
+        if (blockSize == 1 || count == 1 || IsDistributed())
+        {
+            for (int n=0; n<count; n++)
             {
-                vectorsToReuse = k;
+                images[n] = EvalDerivative(directions[n]);
+            }
+            return;
+        }
+
+        if (static_cast<int>(solvers.size()) < blockSize)
+        {
+            solvers.resize(blockSize);
+        }
 
-                // Arnoldi Algorithm
-                // find orthogonal basis q1,...,qn
-                // from x, A x, A^2 x, ...
+        int threads = std::max(1, omp_get_max_threads()/count);
+        int levels = omp_get_max_active_levels();
+        omp_set_max_active_levels(std::max(levels, 2));
 
-                // q_k = A q_k-1
-                q[k] = EvalDerivative(q[k-1]);
-                q[k] *= -1.0; // factor of -1 for Newton iteration
+        #pragma omp parallel for num_threads(count) schedule(static, 1)
+        for (int n=0; n<count; n++)
+        {
+            omp_set_num_threads(threads);
+            images[n] = EvalDerivative(directions[n], solvers[n]);
+        }
 
-                // remove component in direction of preceding vectors
-                for (int j=0; j<k; j++)
-                {
-                    H(j,k-1) = q[j].Dot(q[k]);
-                    q[k].MulAdd(-H(j,k-1), q[j]);
-                }
+        omp_set_max_active_levels(levels);
+    }
 
-                // normalise
-                H(k,k-1) = q[k].Norm();
-                q[k] *= 1/H(k,k-1);
+    // the basis starts with the right hand side, which is in q[0]
+    // to evaluate several directions at once there have to be several vectors whose images aren't known yet,
+    // so up to blockSize-1 vectors of the previous solve's basis are kept as well,
+    // which span similar directions as the Newton iterates are close together
+    // the first solve has none, so it evaluates one direction at a time
+    void StartBasis(stratifloat beta)
+    {
+        int previousSize = basisSize;
+        basisSize = 1;
+        imaged = 0;
 
-                // enforce BCs
-                q[k].EnforceBCs();
+        VectorType seed;
+        for (int k=1; k<std::min(blockSize, previousSize); k++)
+        {
+            q.Load(k, seed);
+            for (int j=0; j<k; j++)
+            {
+                q.Load(j, basisVector);
+                seed.MulAdd(-basisVector.Dot(seed), basisVector);
             }
 
-            // Construct least squares problem in this basis
-            VectorX Beta(k+1);
-            Beta.setZero();
-            Beta[0] = beta;
+            stratifloat norm = seed.Norm();
+            if (norm < 1e-3)
+            {
+                // this is almost in the span of the others already
+                break;
+            }
+
+            seed *= 1/norm;
+            seed.EnforceBCs();
+            q.Store(k, seed);
+            basisSize++;
+        }
+
+        vectorsToReuse = basisSize;
+
+        H.setZero();
+        R.setZero();
+        rotations.clear();
+
+        g0.setZero();
+        g0[0] = beta;
+        g = g0;
+    }
+
+    // brings column j of H into R, which is kept as the upper triangular factor of H = QR,
+    // using the existing rotations and then new ones to zero it below the diagonal
+    void AddColumn(int j)
+    {
+        R.col(j).head(basisSize) = H.col(j).head(basisSize);
+
+        for (const GivensRotation& rotation : rotations)
+        {
+            rotation.Apply(R(rotation.row-1, j), R(rotation.row, j));
+        }
+
+        for (int row=basisSize-1; row>j; row--)
+        {
+            if (R(row, j) != 0)
+            {
+                GivensRotation rotation(row, R(row-1, j), R(row, j));
+                rotation.Apply(R(row-1, j), R(row, j));
+                rotation.Apply(g(row-1), g(row));
+                rotations.push_back(rotation);
+            }
+        }
+    }
 
-            MatrixX subH = H.block(0,0,k+1,k);
+    // the solution y minimising |g0 - H y| using the first imaged columns of H, with |y| < Delta,
+    // returning the residual relative to beta
+    // this is a triangular solve with R, and only needs an SVD if the trust region is reached
+    stratifloat SolveLeastSquares(stratifloat beta, stratifloat Delta, VectorX& y)
+    {
+        // rows of Q* g0 which no combination of the columns can reach
+        stratifloat unreachable = g.segment(imaged, basisSize-imaged).squaredNorm();
 
-            // Now we solve Hy = Beta
+        auto Rtop = R.topLeftCorner(imaged, imaged);
+        y = Rtop.triangularView<Upper>().solve(g.head(imaged));
 
+        if (Delta > 0 && y.norm() > Delta)
+        {
             // follows notation of Chandler & Kerswell 2013
 
-            // first H = UDV*
-            JacobiSVD<MatrixX> svd(subH, ComputeFullU | ComputeFullV);
-            MatrixX U = svd.matrixU();
-            MatrixX V = svd.matrixV();
+            // first R = UDV*
+            JacobiSVD<MatrixX> svd(Rtop, ComputeFullU | ComputeFullV);
             ArrayX d = svd.singularValues();
 
             // solve problem in space of singular vectors
-            VectorX p = U.transpose() * Beta; // p = U* Beta
-            VectorX z = p.array()/d; // D z = p
+            VectorX p = svd.matrixU().transpose() * g.head(imaged); // p = U* g
 
             // enforce trust region
-            stratifloat mu = 0;
-            while (z.norm() > Delta)
+            VectorX z;
+            stratifloat mu = HookStep(d, p, Delta, z);
+
+            std::cout << "For |z|<Delta, mu=" << mu << std::endl;
+
+            // z = V* y
+            y = svd.matrixV()*z;
+
+            return sqrt((Rtop*y - g.head(imaged)).squaredNorm() + unreachable)/beta;
+        }
+
+        return sqrt(unreachable)/beta;
+    }
+
+    // finds z_j = p_j d_j/(d_j^2 + mu) with |z| = Delta
+    // by Newton's method on 1/|z| - 1/Delta, which is close to linear in mu (More & Sorensen 1983)
+    // starting from mu = 0 it increases monotonically to the root
+    stratifloat HookStep(const ArrayX& d, const VectorX& p, stratifloat Delta, VectorX& z)
+    {
+        stratifloat mu = 0;
+        for (int iteration=0; iteration<100; iteration++)
+        {
+            ArrayX denominator = d*d + mu;
+            z = (p.array()*d/denominator).matrix();
+
+            stratifloat norm = z.norm();
+            if (std::abs(norm - Delta) < 1e-4*Delta)
             {
-                mu += 0.00001;
+                break;
+            }
+
+            // d|z|^2/dmu
+            stratifloat derivative = -2*(z.array().square()/denominator).sum();
+
+            mu -= (1/norm - 1/Delta)/(-0.5*derivative/(norm*norm*norm));
+            mu = std::max(mu, static_cast<stratifloat>(0));
+        }
+        return mu;
+    }
+
+    // GMRES(m): when the basis reaches restartLength vectors the solution so far is added to x,
+    // and the basis is replaced by the residual together with the harmonic Ritz vectors for the
+    // deflatedVectors eigenvalues nearest zero, which are what slow the convergence (Morgan 2002)
+    // their images are combinations of the old basis, so this needs no more evaluations
+    // returns how much of the trust region is used by the solution so far
+    stratifloat Restart(const VectorX& y, VectorType& x)
+    {
+        int rows = basisSize;
+        int m = imaged;
+        MatrixX Hbar = H.topLeftCorner(rows, m);
 
-                for (int j=0; j<z.size(); j++)
+        // the residual, in the old basis
+        VectorX c = g0.head(rows) - Hbar*y;
+
+        for (int j=0; j<m; j++)
+        {
+            q.Load(j, basisVector);
+            x.MulAdd(y[j], basisVector);
+        }
+
+        // harmonic Ritz vectors, from Hbar* Hbar g = theta Htop* g
+        std::vector<VectorX> kept;
+        int d = std::min(deflatedVectors, m-1);
+        if (d > 0)
+        {
+            MatrixX Htop = H.topLeftCorner(m, m);
+            MatrixX M = Htop.transpose().partialPivLu().solve(Hbar.transpose()*Hbar);
+            EigenSolver<MatrixX> harmonic(M, true);
+
+            std::vector<int> order(m);
+            for (int j=0; j<m; j++)
+            {
+                order[j] = j;
+            }
+            std::sort(order.begin(), order.end(), [&harmonic](int a, int b)
+            {
+                return std::abs(harmonic.eigenvalues()[a]) < std::abs(harmonic.eigenvalues()[b]);
+            });
+
+            // a complex pair gives its real and imaginary parts, which are kept together
+            // as only then is the pair's image in the span of the new basis
+            for (int n=0; n<m && static_cast<int>(kept.size())<d; n++)
+            {
+                complex theta = harmonic.eigenvalues()[order[n]];
+                if (theta.imag() < 0)
+                {
+                    continue;
+                }
+
+                VectorXc vector = harmonic.eigenvectors().col(order[n]);
+                kept.push_back(VectorX::Zero(rows));
+                kept.back().head(m) = vector.real();
+                if (theta.imag() > 0)
                 {
-                    z(j) = p(j)*d(j)/(d(j)*d(j)+mu);
+                    kept.push_back(VectorX::Zero(rows));
+                    kept.back().head(m) = vector.imag();
                 }
             }
+        }
+        int ritz = Orthonormalise(kept);
 
-            std::cout << "For |z|<Delta, mu=" << mu << std::endl;
+        // the images of the kept vectors have to lie in the new basis
+        // for blockSize 1 they already do once the residual is included, so these are dropped as dependent,
+        // but otherwise the new basis needs some of them
+        kept.push_back(c);
+        for (int n=0; n<ritz; n++)
+        {
+            kept.push_back(Hbar*kept[n].head(m));
+        }
+        int newSize = Orthonormalise(kept);
 
-            // z = V* y
-            y = V*z;
+        MatrixX P(rows, newSize);
+        for (int n=0; n<newSize; n++)
+        {
+            P.col(n) = kept[n];
+        }
+
+        // the new vectors are made after the old ones and then moved down
+        VectorType newVector;
+        for (int n=0; n<newSize; n++)
+        {
+            newVector.Zero();
+            for (int i=0; i<rows; i++)
+            {
+                q.Load(i, basisVector);
+                newVector.MulAdd(P(i,n), basisVector);
+            }
+            newVector.EnforceBCs();
+            q.Store(rows+n, newVector);
+        }
+        for (int n=0; n<newSize; n++)
+        {
+            q.Load(rows+n, newVector);
+            q.Store(n, newVector);
+        }
 
+        MatrixX Hnew = P.transpose()*Hbar*P.topLeftCorner(m, ritz);
+        H.setZero();
+        H.topLeftCorner(newSize, ritz) = Hnew;
+
+        g0.setZero();
+        g0.head(newSize) = P.transpose()*c;
 
-            stratifloat residual = (subH*y - Beta).norm()/beta;
+        basisSize = newSize;
+        imaged = 0;
+        vectorsToReuse = basisSize;
 
-            std::cout << "GMRES STEP " << k << ", RESIDUAL: " << residual << std::endl;
+        R.setZero();
+        rotations.clear();
+        g = g0;
+        for (int j=0; j<ritz; j++)
+        {
+            AddColumn(j);
+            imaged++;
+        }
+
+        std::cout << "GMRES RESTART, KEEPING " << ritz << " HARMONIC RITZ VECTORS" << std::endl;
+
+        return y.norm();
+    }
 
-            if (residual < epsilon)
+    // modified Gram-Schmidt on coefficient vectors, dropping those which are nearly dependent on the previous ones
+    // returns how many are left
+    static int Orthonormalise(std::vector<VectorX>& vectors)
+    {
+        std::vector<VectorX> independent;
+        for (VectorX& vector : vectors)
+        {
+            stratifloat before = vector.norm();
+            for (const VectorX& previous : independent)
+            {
+                vector -= previous.dot(vector)*previous;
+            }
+
+            if (vector.norm() > 1e-4*before)
+            {
+                independent.push_back(vector/vector.norm());
+            }
+        }
+        vectors = independent;
+        return vectors.size();
+    }
+
+    // solves A x = G-x0 for x
+    // where A = I-G_x
+    // GMRES is a Krylov-subspace method, hence Newton-Krylov
+    // Delta is a maximum size for x in the least squares solution
+    //
+    // column j of H holds the components of A q_j, which are found from the newest blockSize vectors together,
+    // so H is banded rather than upper Hessenberg when blockSize is above 1
+    void GMRES(const VectorType& rhs, VectorType& x, stratifloat epsilon, stratifloat Delta=0)
+    {
+        VectorX y; // result in new basis
+
+        basisVector = rhs;
+        basisVector.EnforceBCs();
+
+        stratifloat beta = basisVector.Norm();
+        std::cout << beta << std::endl;
+        basisVector *= 1/beta;
+        q.Store(0, basisVector);
+
+        if (vectorsToReuse == 0)
+        {
+            StartBasis(beta);
+        }
+
+        x.Zero();
+
+        // with room for the vectors made when restarting, and for some directions to be evaluated before it
+        int restartAt = restartLength > 0 ? std::min(restartLength, K - deflatedVectors - 2*blockSize) : K;
+        restartAt = std::max(restartAt, deflatedVectors + 2*blockSize);
+
+        bool converged = false;
+        while (!converged && basisSize < K)
+        {
+            if (basisSize >= restartAt)
+            {
+                Delta -= Restart(y, x);
+                if (Delta <= 0)
+                {
+                    return;
+                }
+            }
+
+            // Arnoldi Algorithm
+            // find orthogonal basis q1,...,qn
+            // from x, A x, A^2 x, ...
+
+            // q_k = A q_j for the vectors q_j whose images aren't known yet
+            int count = std::min({blockSize, basisSize - imaged, K - basisSize});
+            if (count == 0)
             {
-                K = k+1;
                 break;
             }
+            EvalDerivatives(imaged, count);
+
+            for (int n=0; n<count && !converged; n++)
+            {
+                int j = imaged;
+                int k = basisSize;
+                VectorType& image = images[n];
+
+                image *= -1.0; // factor of -1 for Newton iteration
+                stratifloat imageNorm = image.Norm();
+
+                // remove component in direction of preceding vectors
+                for (int i=0; i<k; i++)
+                {
+                    q.Load(i, basisVector);
+                    H(i,j) = basisVector.Dot(image);
+                    image.MulAdd(-H(i,j), basisVector);
+                }
+
+                // normalise, unless the image is already in the span of the basis,
+                // which can happen when vectors are kept from the previous solve
+                H(k,j) = image.Norm();
+                if (H(k,j) > 1e-10*imageNorm)
+                {
+                    image *= 1/H(k,j);
+
+                    // enforce BCs
+                    image.EnforceBCs();
+                    q.Store(k, image);
+
+                    basisSize++;
+                    vectorsToReuse = basisSize;
+                }
+                else
+                {
+                    H(k,j) = 0;
+                }
+
+                AddColumn(j);
+                imaged++;
+
+                stratifloat residual = SolveLeastSquares(beta, Delta, y);
+
+                std::cout << "GMRES STEP " << imaged << ", RESIDUAL: " << residual << std::endl;
+
+                converged = residual < epsilon;
+            }
         }
 
         // Now compute the solution using the basis vectors
-        x.Zero();
-        for (int k=0; k<K-1; k++)
+        for (int j=0; j<y.size(); j++)
         {
-            x.MulAdd(y[k], q[k]);
+            q.Load(j, basisVector);
+            x.MulAdd(y[j], basisVector);
         }
     }
 
+    // x' = c x + s y, y' = c y - s x, chosen to zero y in the pair it is made from
+    struct GivensRotation
+    {
+        GivensRotation(int row, stratifloat x, stratifloat y)
+        : row(row)
+        {
+            stratifloat r = std::hypot(x, y);
+            c = x/r;
+            s = y/r;
+        }
+
+        void Apply(stratifloat& x, stratifloat& y) const
+        {
+            stratifloat newX = c*x + s*y;
+            y = c*y - s*x;
+            x = newX;
+        }
+
+        int row; // acts on this row and the one before
+        stratifloat c;
+        stratifloat s;
+    };
+
     int K = 2048; // max iterations
     int vectorsToReuse = 0;
-    std::vector<VectorType> q;
+    int basisSize = 0; // number of vectors in q which are in use
+    int imaged = 0;    // number of those whose images are in H
+    KrylovBasis<VectorType> q;
     MatrixX H; // upper Hessenberg matrix
+
+    // H = QR, with Q the product of the rotations
+    MatrixX R;
+    std::vector<GivensRotation> rotations;
+
+    // the right hand side in terms of the basis, which is beta e_1 until a restart, and Q* of it
+    VectorX g0;
+    VectorX g;
+
+    // the only whole vectors kept, apart from those in the Newton iteration
+    VectorType basisVector;
+    std::vector<VectorType> directions;
+    std::vector<VectorType> images;
+
+    std::vector<IMEXRK> solvers; // for evaluating several directions at once
 };
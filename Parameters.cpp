@@ -2,6 +2,7 @@
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <cstdlib>
 
 FlowParams flowParams
     = {8.885765876/2, 1.570795, 10, 1000, 0.16, 7, false};
@@ -49,6 +50,69 @@ void CheckParameter(std::ifstream& paramFile, const std::string& name, int check
     }
 }
 
+#ifdef RUNTIME_GRID
+namespace
+{
+GridParams LoadGridParams()
+{
+    GridParams grid = DefaultGridParams;
+
+    std::string filename = "grid.dat";
+    if (const char* fromEnvironment = std::getenv("STRATIFLOW_GRID"))
+    {
+        filename = fromEnvironment;
+    }
+
+    std::ifstream paramFile;
+    paramFile.open(filename, std::fstream::in);
+    if (!paramFile.is_open())
+    {
+        std::cerr << "Could not open " << filename << ", using the default grid" << std::endl;
+        return grid;
+    }
+
+    int threeDimensional = 0;
+    int twoAndAHalf = 0;
+
+    // these are the names DumpParameters writes
+    LoadParamInto(paramFile, "gridParams.N1", grid.N1);
+    LoadParamInto(paramFile, "gridParams.N2", grid.N2);
+    LoadParamInto(paramFile, "gridParams.N3", grid.N3);
+    LoadParamInto(paramFile, "(gridParams.dimensionality == Dimensionality::ThreeDimensional)", threeDimensional);
+    LoadParamInto(paramFile, "(gridParams.dimensionality == Dimensionality::TwoAndAHalf)", twoAndAHalf);
+
+    if (threeDimensional)
+    {
+        grid.dimensionality = Dimensionality::ThreeDimensional;
+    }
+    else if (twoAndAHalf)
+    {
+        grid.dimensionality = Dimensionality::TwoAndAHalf;
+    }
+    else
+    {
+        grid.dimensionality = Dimensionality::TwoDimensional;
+    }
+
+    if (grid.N1 < 3 || grid.N2 < 1 || grid.N3%4 != 0 || (grid.N2 > 1 && !grid.ThirdDimension()))
+    {
+        throw std::string("Error: grid in ") + filename + " is not valid";
+    }
+
+    std::cout << "Loaded grid " << grid.N1 << "x" << grid.N2 << "x" << grid.N3 << " from " << filename << std::endl;
+
+    return grid;
+}
+}
+
+const GridParams& RuntimeGridParams()
+{
+    // loaded on first use, so that fields constructed during static initialisation see it
+    static GridParams grid = LoadGridParams();
+    return grid;
+}
+#endif
+
 #define CheckParam(parameter) CheckParameter(paramFile, #parameter, parameter)
 #define LoadParam(parameter) LoadParamInto(paramFile, #parameter, parameter)
 
@@ -2,7 +2,7 @@
 #include "Constants.h"
 #include <string>
 
-// These must be defined at compile time
+// These are defined at compile time, unless built with RUNTIME_GRID
 struct GridParams
 {
     int N1; // Number of streamwise gridpoints
@@ -35,11 +35,25 @@ inline stratifloat InitialU(stratifloat z)
     return tanh(z);
 }
 
+// the grid when it is fixed at compile time, which is also used if no grid is given at runtime
+constexpr GridParams DefaultGridParams
+    = {48, 1, 512, Dimensionality::TwoDimensional};
+
 void DumpParameters();
 void PrintParameters();
 void LoadParameters(const std::string& file);
 
-constexpr GridParams gridParams
-    = {48, 1, 512, Dimensionality::TwoDimensional};
+#ifdef RUNTIME_GRID
+
+// The grid is read on first use from the file named by $STRATIFLOW_GRID, or grid.dat otherwise,
+// which has the same format as params.dat (so the params.dat of an earlier run can be used)
+const GridParams& RuntimeGridParams();
+#define gridParams RuntimeGridParams()
+
+#else
+
+constexpr GridParams gridParams = DefaultGridParams;
+
+#endif
 
 extern FlowParams flowParams;
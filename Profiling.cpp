@@ -0,0 +1,136 @@
+#include "Profiling.h"
+
+#ifdef USE_PROFILING
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace
+{
+constexpr int RegionCount = static_cast<int>(ProfileRegion::Count);
+
+const char* regionNames[RegionCount] =
+{
+    "TimeStep",
+    "ExplicitRK",
+    "BuildRHS",
+    "FinishRHS",
+    "CrankNicolson",
+    "RemoveDivergence",
+    "FilterAll",
+    "PopulateNodalVariables",
+    "ForwardFFT",
+    "InverseFFT",
+    "RealToRealFFT",
+    "Transpose"
+};
+
+// each thread number has its own counters, so they are rarely contended
+// the padding keeps different threads' counters on different cache lines
+struct ThreadCounters
+{
+    long calls[RegionCount] = {};
+    double seconds[RegionCount] = {};
+    char padding[64];
+};
+
+// this is deliberately never freed, as the report is printed during static destruction
+std::vector<ThreadCounters>& Counters()
+{
+    static auto counters = new std::vector<ThreadCounters>(omp_get_max_threads());
+    return *counters;
+}
+
+long TotalCalls(int region)
+{
+    long calls = 0;
+    for (const ThreadCounters& thread : Counters())
+    {
+        calls += thread.calls[region];
+    }
+    return calls;
+}
+
+double TotalSeconds(int region)
+{
+    double seconds = 0;
+    for (const ThreadCounters& thread : Counters())
+    {
+        seconds += thread.seconds[region];
+    }
+    return seconds;
+}
+
+void WriteJSON(const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Failed to write profile to %s\n", filename);
+        return;
+    }
+
+    fprintf(file, "{\n  \"threads\": %d,\n  \"regions\": [\n", static_cast<int>(Counters().size()));
+    for (int region=0; region<RegionCount; region++)
+    {
+        fprintf(file, "    {\"name\": \"%s\", \"calls\": %ld, \"seconds\": %.6f, \"perThreadSeconds\": [",
+                regionNames[region], TotalCalls(region), TotalSeconds(region));
+
+        for (unsigned int thread=0; thread<Counters().size(); thread++)
+        {
+            fprintf(file, "%s%.6f", thread ? ", " : "", Counters()[thread].seconds[region]);
+        }
+
+        fprintf(file, "]}%s\n", region<RegionCount-1 ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    fclose(file);
+}
+}
+
+void RecordProfile(ProfileRegion region, double seconds)
+{
+    // when several solvers run at once, the threads of their teams have the same numbers
+    int thread = omp_get_thread_num() % Counters().size();
+
+    ThreadCounters& counters = Counters()[thread];
+
+    #pragma omp atomic
+    counters.calls[static_cast<int>(region)]++;
+
+    #pragma omp atomic
+    counters.seconds[static_cast<int>(region)] += seconds;
+}
+
+void PrintProfile()
+{
+    // regions are nested, so everything is given as a fraction of whole timesteps
+    double stepSeconds = TotalSeconds(static_cast<int>(ProfileRegion::TimeStep));
+
+    printf("%-24s %10s %12s %12s %8s\n", "Region", "Calls", "Total (s)", "Mean (ms)", "% step");
+    for (int region=0; region<RegionCount; region++)
+    {
+        long calls = TotalCalls(region);
+        if (calls == 0)
+        {
+            continue;
+        }
+
+        double seconds = TotalSeconds(region);
+        printf("%-24s %10ld %12.3f %12.3f %8.1f\n",
+               regionNames[region],
+               calls,
+               seconds,
+               1000*seconds/calls,
+               stepSeconds > 0 ? 100*seconds/stepSeconds : 0.0);
+    }
+
+    if (const char* filename = std::getenv("STRATIFLOW_PROFILE_JSON"))
+    {
+        WriteJSON(filename);
+    }
+}
+
+#endif
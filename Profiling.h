@@ -0,0 +1,59 @@
+#pragma once
+
+// Scoped timers showing where the time goes within a timestep
+// These are compiled out entirely unless USE_PROFILING is defined (cmake -DPROFILE=On)
+
+enum class ProfileRegion
+{
+    TimeStep,
+    ExplicitRK,
+    BuildRHS,
+    FinishRHS,
+    CrankNicolson,
+    RemoveDivergence,
+    FilterAll,
+    PopulateNodalVariables,
+    ForwardFFT,
+    InverseFFT,
+    RealToRealFFT,
+    Transpose,
+    Count
+};
+
+#ifdef USE_PROFILING
+
+#include <omp.h>
+
+void RecordProfile(ProfileRegion region, double seconds);
+
+// prints a table to stdout, and also writes json to $STRATIFLOW_PROFILE_JSON if it is set
+void PrintProfile();
+
+class ScopedTimer
+{
+public:
+    ScopedTimer(ProfileRegion region)
+    : region(region)
+    , start(omp_get_wtime())
+    {
+    }
+
+    ~ScopedTimer()
+    {
+        RecordProfile(region, omp_get_wtime() - start);
+    }
+
+private:
+    ProfileRegion region;
+    double start;
+};
+
+#define PROFILE_JOIN(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_JOIN(profileTimer, line)
+#define PROFILE(region) ScopedTimer PROFILE_NAME(__LINE__)(ProfileRegion::region)
+
+#else
+
+#define PROFILE(region)
+
+#endif
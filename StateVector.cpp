@@ -1,8 +1,14 @@
 #include "StateVector.h"
+#include "Checkpointing.h"
+#include "KrylovBasis.h"
 
-stratifloat StateVector::FullEvolve(stratifloat T, StateVector& result, bool snapshot, bool screenshot, bool calcmixing) const
+#include <atomic>
+#include <functional>
+
+stratifloat StateVector::FullEvolve(stratifloat T, StateVector& result, bool snapshot, bool screenshot, bool calcmixing,
+                                    IMEXRK& solver, Trajectory* trajectory) const
 {
-    CopyToSolver();
+    CopyToSolver(solver);
 
     solver.SetBackground(InitialU);
 
@@ -16,11 +22,17 @@ stratifloat StateVector::FullEvolve(stratifloat T, StateVector& result, bool sna
 
     bool done = false;
 
-    static int runnum = 0;
-    runnum++;
+    // numbered so that concurrent runs use different directories
+    static std::atomic<int> runs(0);
+    int runnum = ++runs;
     solver.PrepareRun(std::string("images-")+std::to_string(runnum)+"/", screenshot);
     MakeCleanDir("snapshots");
 
+    if (trajectory != nullptr)
+    {
+        trajectory->Clear();
+    }
+
     const int stepinterval = 100;
 
     stratifloat mixing = 0;
@@ -53,7 +65,7 @@ stratifloat StateVector::FullEvolve(stratifloat T, StateVector& result, bool sna
             }
         }
 
-        solver.TimeStep();
+        solver.TimeStep(trajectory);
 
         if (calcmixing)
         {
@@ -77,16 +89,14 @@ stratifloat StateVector::FullEvolve(stratifloat T, StateVector& result, bool sna
         }
     }
 
-    CopyFromSolver(result);
+    CopyFromSolver(solver, result);
 
     return mixing;
 }
 
-void StateVector::FixedEvolve(stratifloat deltaT, int steps, std::vector<StateVector>& result) const
+void StateVector::FixedEvolve(stratifloat deltaT, int steps, ForwardTrajectory& result, IMEXRK& solver) const
 {
-    result.resize(steps);
-
-    CopyToSolver();
+    CopyToSolver(solver);
 
     solver.FilterAll();
     solver.PopulateNodalVariables();
@@ -99,14 +109,15 @@ void StateVector::FixedEvolve(stratifloat deltaT, int steps, std::vector<StateVe
 
     for (int step=0; step<steps; step++)
     {
-        CopyFromSolver(result[step]);
+        result.Store(step, solver.u1, solver.u2, solver.u3, solver.b);
         solver.TimeStep();
     }
+    result.Store(steps, solver.u1, solver.u2, solver.u3, solver.b);
 }
 
-void StateVector::LinearEvolve(stratifloat T, const StateVector& about, StateVector& result) const
+void StateVector::LinearEvolve(stratifloat T, const StateVector& about, StateVector& result, IMEXRK& solver) const
 {
-    CopyToSolver();
+    CopyToSolver(solver);
 
     solver.SetBackground(InitialU);
     solver.SetBackground(about.u1, about.u2, about.u3, about.b);
@@ -120,8 +131,8 @@ void StateVector::LinearEvolve(stratifloat T, const StateVector& about, StateVec
 
     bool done = false;
 
-    static int runnum = 0;
-    runnum++;
+    static std::atomic<int> runs(0);
+    int runnum = ++runs;
     solver.PrepareRunLinear(std::string("images-linear-")+std::to_string(runnum)+"/", false);
 
     solver.deltaT = 0.01;
@@ -152,47 +163,161 @@ void StateVector::LinearEvolve(stratifloat T, const StateVector& about, StateVec
         step++;
     }
 
-    CopyFromSolver(result);
+    CopyFromSolver(solver, result);
+}
+
+void StateVector::TangentEvolve(const Trajectory& about, StateVector& result, IMEXRK& solver) const
+{
+    CopyToSolver(solver);
+
+    solver.SetBackground(InitialU);
+    solver.FilterAll();
+    solver.PopulateNodalVariables();
+    solver.RemoveDivergence(0.0f);
+    solver.PopulateNodalVariables();
+
+    for (int step=0; step<about.Steps(); step++)
+    {
+        if (solver.deltaT != about.TimeStep(step))
+        {
+            solver.deltaT = about.TimeStep(step);
+            solver.UpdateForTimestep();
+        }
+
+        solver.TimeStepTangent(about, step);
+    }
+
+    CopyFromSolver(solver, result);
+}
+
+namespace
+{
+    // a checkpoint has to include the pressure, which each timestep carries on to the next
+    struct ForwardState
+    {
+        StateVector x;
+
+        std::size_t PackedSize() const
+        {
+            return x.PackedSize() + x.p.PackedSize();
+        }
+
+        template<typename S>
+        S* Pack(S* into) const
+        {
+            return x.p.Pack(x.Pack(into));
+        }
+
+        template<typename S>
+        const S* Unpack(const S* from)
+        {
+            return x.p.Unpack(x.Unpack(from));
+        }
+    };
 }
 
-void StateVector::AdjointEvolve(stratifloat deltaT, int steps, const std::vector<StateVector>& intermediate, StateVector& result) const
+void StateVector::AdjointEvolve(stratifloat deltaT, int steps, const StateVector& forwardStart, StateVector& result,
+                                IMEXRK& forwardSolver, int checkpoints, IMEXRK& solver) const
 {
-    CopyToSolver();
+    if (checkpoints == 0)
+    {
+        checkpoints = BalancedCheckpoints(steps);
+    }
+    std::cout << "Reversing " << steps << " steps with " << checkpoints << " checkpoints" << std::endl;
+
+    CopyToSolver(solver);
     solver.SetBackground(InitialU);
 
     solver.FilterAll();
     solver.PopulateNodalVariables();
     solver.RemoveDivergence(0.0f);
 
-    static int runnum = 0;
-    runnum++;
+    static std::atomic<int> runs(0);
+    int runnum = ++runs;
     solver.PrepareRunAdjoint(std::string("images-adjoint-")+std::to_string(runnum)+"/");
 
     solver.deltaT = deltaT;
     solver.UpdateForTimestep();
 
-    for (int step=0; step<steps; step++)
+    // the forward states are evolved again with their own solver, so that the adjoint's is left as it is
+    forwardSolver.SetBackground(InitialU);
+    forwardSolver.deltaT = deltaT;
+
+    auto advance = [&forwardSolver](ForwardState& state, int count)
     {
-        solver.TimeStepAdjoint(intermediate[steps-1-step].u1,
-                               intermediate[steps-1-step].u2,
-                               intermediate[steps-1-step].u3,
-                               intermediate[steps-1-step].b,
-                               intermediate[steps-step].u1,
-                               intermediate[steps-step].u2,
-                               intermediate[steps-step].u3,
-                               intermediate[steps-step].b);
-    }
+        if (count == 0)
+        {
+            return;
+        }
+
+        state.x.CopyToSolver(forwardSolver);
+        forwardSolver.FilterAll();
+        forwardSolver.PopulateNodalVariables();
+        forwardSolver.RemoveDivergence(0.0f);
+        forwardSolver.UpdateForTimestep();
+        forwardSolver.PrepareRun(std::string("blah"), false);
+
+        for (int step=0; step<count; step++)
+        {
+            forwardSolver.TimeStep();
+        }
+
+        state.x.CopyFromSolver(forwardSolver);
+    };
+
+    // the checkpoint in slot k is the start of the steps being reversed at depth k of the recursion
+    // they are kept in memory up to a budget, after which they go to disk,
+    // as set by STRATIFLOW_CHECKPOINT_MEMORY and STRATIFLOW_CHECKPOINT_SPILL (see KrylovBasis.h)
+    KrylovBasis<ForwardState> stored("STRATIFLOW_CHECKPOINT");
+
+    // between the checkpoints, the forward states are evolved once more and recorded,
+    // keeping only what the adjoint uses, and each adjoint step then interpolates straight from them
+    // (set by STRATIFLOW_TRAJECTORY_MEMORY, STRATIFLOW_TRAJECTORY_SPILL and STRATIFLOW_TRAJECTORY_PRECISION)
+    ForwardTrajectory interval;
+
+    // assignment of a StateVector leaves out the pressure
+    ForwardState state;
+    state.x = forwardStart;
+    state.x.p = forwardStart.p;
+    stored.Store(0, state);
+
+    // reverses the steps from start to end, whose first state is in the given slot
+    std::function<void(int, int, int)> reverse = [&](int start, int end, int slot)
+    {
+        int free = checkpoints - slot;
+        while (end - start > 1 && free > 0)
+        {
+            int split = CheckpointSplit(end - start, free);
+
+            stored.Load(slot, state);
+            advance(state, split);
+            stored.Store(slot+1, state);
+
+            reverse(start+split, end, slot+1);
+            end = start+split;
+        }
+
+        stored.Load(slot, state);
+        state.x.FixedEvolve(deltaT, end-start, interval, forwardSolver);
+
+        for (int step=end-1; step>=start; step--)
+        {
+            solver.TimeStepAdjoint(interval, step-start);
+        }
+    };
+
+    reverse(0, steps, 0);
 
-    CopyFromSolver(result);
+    CopyFromSolver(solver, result);
 }
 
-void StateVector::Rescale(stratifloat energy)
+void StateVector::Rescale(stratifloat energy, IMEXRK& solver)
 {
-    CopyToSolver();
+    CopyToSolver(solver);
     solver.FilterAll();
     solver.PopulateNodalVariables();
     solver.RemoveDivergence(0.0f);
-    CopyFromSolver();
+    CopyFromSolver(solver);
 
     stratifloat scale;
 
@@ -218,11 +343,11 @@ void StateVector::Rescale(stratifloat energy)
     u3 *= scale;
     b *= scale;
 
-    CopyToSolver();
+    CopyToSolver(solver);
     solver.FilterAll();
     solver.PopulateNodalVariables();
     solver.RemoveDivergence(0.0f);
-    CopyFromSolver();
+    CopyFromSolver(solver);
 }
 
 void StateVector::ExciteLowWavenumbers(stratifloat energy)
@@ -28,13 +28,29 @@ public:
     NeumannModal b;
     NeumannModal p;
 
-    stratifloat FullEvolve(stratifloat T, StateVector& result, bool snapshot = false, bool screenshot = true, bool calcmixing = false) const;
+    // these use the shared solver unless they are given their own,
+    // and evolutions with different solvers can be run at the same time
+    // if trajectory is given, the steps are recorded into it
+    stratifloat FullEvolve(stratifloat T, StateVector& result, bool snapshot = false, bool screenshot = true, bool calcmixing = false,
+                           IMEXRK& solver = StateVector::solver, Trajectory* trajectory = nullptr) const;
 
-    void FixedEvolve(stratifloat deltaT, int steps, std::vector<StateVector>& result) const;
+    // records the states at the start of each of the steps, and at the end, which is how AdjointEvolve
+    // evolves forward again from each of its checkpoints
+    void FixedEvolve(stratifloat deltaT, int steps, ForwardTrajectory& result, IMEXRK& solver = StateVector::solver) const;
 
-    void LinearEvolve(stratifloat T, const StateVector& about, StateVector& result) const;
+    void LinearEvolve(stratifloat T, const StateVector& about, StateVector& result, IMEXRK& solver = StateVector::solver) const;
 
-    void AdjointEvolve(stratifloat deltaT, int steps, const std::vector<StateVector>& intermediate, StateVector& result) const;
+    // evolves the tangent linear equations about a trajectory recorded by FullEvolve, with the same timesteps,
+    // which gives the derivative of that evolution applied to this
+    void TangentEvolve(const Trajectory& about, StateVector& result, IMEXRK& solver = StateVector::solver) const;
+
+    // evolves the adjoint backwards through the forward evolution of steps timesteps from forwardStart,
+    // keeping only a few of its states as checkpoints and evolving forward again from them (see Checkpointing.h)
+    // with checkpoints = 0 the number grows logarithmically with the steps, and so does the extra evolution
+    // the forward states are evolved with forwardSolver, which should be kept for the next call,
+    // as it has its own implicit operators to factorise
+    void AdjointEvolve(stratifloat deltaT, int steps, const StateVector& forwardStart, StateVector& result,
+                       IMEXRK& forwardSolver, int checkpoints = 0, IMEXRK& solver = StateVector::solver) const;
 
 
     const StateVector& operator+=(const StateVector& other)
@@ -170,7 +186,8 @@ public:
 
     stratifloat MinimumRi() const
     {
-        solver.SetBackground(InitialU);
+        Neumann1D U_;
+        U_.SetValue(InitialU, flowParams.L3);
 
         Neumann1D u_ave;
         Neumann1D b_ave;
@@ -178,7 +195,7 @@ public:
         HorizontalAverage(u1, u_ave);
         HorizontalAverage(b, b_ave);
 
-        u_ave = u_ave + solver.U_;
+        u_ave = u_ave + U_;
 
         Neumann1D dbdz;
         dbdz = ddz(b_ave);
@@ -207,7 +224,42 @@ public:
         p.Zero();
     }
 
-    void Rescale(stratifloat energy);
+    // the values which can be nonzero, for storing vectors compactly (see KrylovBasis)
+    std::size_t PackedSize() const
+    {
+        std::size_t size = u1.PackedSize() + u3.PackedSize() + b.PackedSize();
+        if (gridParams.ThirdDimension())
+        {
+            size += u2.PackedSize();
+        }
+        return size;
+    }
+
+    template<typename S>
+    S* Pack(S* into) const
+    {
+        into = u1.Pack(into);
+        if (gridParams.ThirdDimension())
+        {
+            into = u2.Pack(into);
+        }
+        into = u3.Pack(into);
+        return b.Pack(into);
+    }
+
+    template<typename S>
+    const S* Unpack(const S* from)
+    {
+        from = u1.Unpack(from);
+        if (gridParams.ThirdDimension())
+        {
+            from = u2.Unpack(from);
+        }
+        from = u3.Unpack(from);
+        return b.Unpack(from);
+    }
+
+    void Rescale(stratifloat energy, IMEXRK& solver = StateVector::solver);
 
     void ExciteLowWavenumbers(stratifloat energy);
 
@@ -254,12 +306,12 @@ public:
 
         solver.LoadFlow(filename, twoDimensional);
 
-        CopyFromSolver();
+        CopyFromSolver(solver);
     }
 
     void SaveToFile(const std::string& filename) const
     {
-        CopyToSolver();
+        CopyToSolver(solver);
         solver.PopulateNodalVariables();
 
         if (EndsWith(filename, ".fields"))
@@ -313,7 +365,8 @@ public:
         assert(gridParams.N2==1);
         assert(!gridParams.ThirdDimension());
 
-        for (int j1=0; j1<std::min(K1/2+1,gridParams.N1/2+1); j1++)
+        // the other wavenumbers are removed by the dealiasing, and compact fields don't store them
+        for (int j1=0; j1<std::min(u1Loaded.ActiveSize1(), u1.ActiveSize1()); j1++)
         {
             // Neumann fields u1, u2 and b
             for (int j3=0; j3<gridParams.N3; j3++)
@@ -508,7 +561,7 @@ public:
     }
 
 private:
-    void CopyToSolver() const
+    void CopyToSolver(IMEXRK& solver) const
     {
         solver.u1 = u1;
         if (gridParams.ThirdDimension())
@@ -524,12 +577,12 @@ private:
         solver.p = p;
     }
 
-    void CopyFromSolver()
+    void CopyFromSolver(const IMEXRK& solver)
     {
-        CopyFromSolver(*this);
+        CopyFromSolver(solver, *this);
     }
 
-    void CopyFromSolver(StateVector& into) const
+    void CopyFromSolver(const IMEXRK& solver, StateVector& into) const
     {
         into.u1 = solver.u1;
         if (gridParams.ThirdDimension())
@@ -543,6 +596,7 @@ private:
     }
 
 public:
+    // the solver used when one is not given
     static IMEXRK solver;
 };
 
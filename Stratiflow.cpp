@@ -0,0 +1,84 @@
+#include "Stratiflow.h"
+
+#define INSTANTIATE_GRID_TEMPLATES(N1, N2, N3) GRID_TEMPLATES(, N1, N2, N3)
+FOR_EACH_LIBRARY_GRID(INSTANTIATE_GRID_TEMPLATES)
+#undef INSTANTIATE_GRID_TEMPLATES
+
+const GridOperators& Operators()
+{
+    // built on first use, as the grid may only be known at runtime
+    static const GridOperators operators = []()
+    {
+        GridOperators operators;
+
+        operators.dim1Derivative = FourierDerivativeMatrix(flowParams.L1, gridParams.N1, 1);
+        operators.dim2Derivative = FourierDerivativeMatrix(flowParams.L2, gridParams.N2, 2);
+
+        operators.dim3DerivativeNeumann = VerticalDerivativeMatrix(flowParams.L3, gridParams.N3, BoundaryCondition::Neumann);
+        operators.dim3DerivativeDirichlet = VerticalDerivativeMatrix(flowParams.L3, gridParams.N3, BoundaryCondition::Dirichlet);
+
+        operators.reinterpolateDirichlet = DirichletReinterpolation(flowParams.L3, gridParams.N3);
+        operators.reinterpolateBar = NeumannReinterpolationBar(flowParams.L3, gridParams.N3);
+        operators.reinterpolateTilde = NeumannReinterpolationTilde(flowParams.L3, gridParams.N3);
+        operators.reinterpolateFull = NeumannReinterpolationFull(flowParams.L3, gridParams.N3);
+
+        return operators;
+    }();
+
+    return operators;
+}
+
+void InterpolateProduct(const NeumannNodal& A, const NeumannNodal& B, NeumannModal& to, Workspace& workspace)
+{
+    NeumannNodal& prod = workspace.neumannProduct;
+    prod = A*B;
+    prod.ToModal(to, workspace.transform);
+}
+
+void DifferentiateProductBar(const NeumannNodal& A, const DirichletNodal& B, NeumannModal& to, Workspace& workspace)
+{
+    NeumannNodal& prod = workspace.neumannProduct;
+    prod = ddz(ReinterpolateBar(A)*B);
+    prod.ToModal(to, workspace.transform);
+}
+
+void InterpolateProductTilde(const NeumannNodal& A, const DirichletNodal& B, DirichletModal& to, Workspace& workspace)
+{
+    DirichletNodal& prod = workspace.dirichletProduct;
+    prod = ReinterpolateTilde(A)*B;
+    prod.ToModal(to, workspace.transform);
+}
+
+void InterpolateProduct(const DirichletNodal& A, const DirichletNodal& B, NeumannModal& to, Workspace& workspace)
+{
+    NeumannNodal& prod = workspace.neumannProduct;
+    prod = ReinterpolateDirichlet(A)*ReinterpolateDirichlet(B);
+    prod.ToModal(to, workspace.transform);
+}
+
+void InterpolateProduct(const NeumannNodal& A1, const NeumannNodal& A2,
+                        const NeumannNodal& B1, const NeumannNodal& B2,
+                        NeumannModal& to, Workspace& workspace)
+{
+    NeumannNodal& prod = workspace.neumannProduct;
+    prod = A1*B1 + A2*B2;
+    prod.ToModal(to, workspace.transform);
+}
+
+void DifferentiateProductBar(const NeumannNodal& A1, const NeumannNodal& A2,
+                        const DirichletNodal& B1, const DirichletNodal& B2,
+                        NeumannModal& to, Workspace& workspace)
+{
+    NeumannNodal& prod = workspace.neumannProduct;
+    prod = ddz(ReinterpolateBar(A1)*B1 + ReinterpolateBar(A2)*B2);
+    prod.ToModal(to, workspace.transform);
+}
+
+void InterpolateProductTilde(const NeumannNodal& A1, const NeumannNodal& A2,
+                        const DirichletNodal& B1, const DirichletNodal& B2,
+                        DirichletModal& to, Workspace& workspace)
+{
+    DirichletNodal& prod = workspace.dirichletProduct;
+    prod = ReinterpolateTilde(A1)*B1 + ReinterpolateTilde(A2)*B2;
+    prod.ToModal(to, workspace.transform);
+}
@@ -2,164 +2,190 @@
 #include "Field.h"
 #include "Parameters.h"
 #include "Differentiation.h"
+#include "Integration.h"
+#include "Tridiagonal.h"
+
+// sizes of the fields as template parameters, which are Dynamic if the grid is loaded at runtime
+#ifdef RUNTIME_GRID
+constexpr int GridN1 = Dynamic;
+constexpr int GridN2 = Dynamic;
+constexpr int GridN3 = Dynamic;
+
+static const int M1 = gridParams.N1/2 + 1;
+#else
+constexpr int GridN1 = gridParams.N1;
+constexpr int GridN2 = gridParams.N2;
+constexpr int GridN3 = gridParams.N3;
 
 constexpr int M1 = gridParams.N1/2 + 1;
+#endif
 
-class NeumannNodal : public NodalField<gridParams.N1,gridParams.N2,gridParams.N3>
+constexpr int GridM1 = ModalSize(GridN1);
+
+class NeumannNodal : public NodalField<GridN1,GridN2,GridN3>
 {
 public:
     NeumannNodal() : NodalField(BoundaryCondition::Neumann) {}
+    NeumannNodal(FieldBundle<GridN1,GridN2,GridN3>& bundle, int k) : NodalField(BoundaryCondition::Neumann, bundle, k) {}
     using NodalField::operator=;
 };
 
-class NeumannModal : public ModalField<gridParams.N1,gridParams.N2,gridParams.N3>
+class NeumannModal : public ModalField<GridN1,GridN2,GridN3>
 {
 public:
     NeumannModal() : ModalField(BoundaryCondition::Neumann, gridParams.dimensionality==Dimensionality::ThreeDimensional) {}
+    NeumannModal(FieldBundle<GridN1,GridN2,GridN3>& bundle, int k) : ModalField(BoundaryCondition::Neumann, gridParams.dimensionality==Dimensionality::ThreeDimensional, bundle, k) {}
     using ModalField::operator=;
 };
 
-class DirichletNodal : public NodalField<gridParams.N1,gridParams.N2,gridParams.N3>
+class DirichletNodal : public NodalField<GridN1,GridN2,GridN3>
 {
 public:
     DirichletNodal() : NodalField(BoundaryCondition::Dirichlet) {}
+    DirichletNodal(FieldBundle<GridN1,GridN2,GridN3>& bundle, int k) : NodalField(BoundaryCondition::Dirichlet, bundle, k) {}
     using NodalField::operator=;
 
 };
 
-class DirichletModal : public ModalField<gridParams.N1,gridParams.N2,gridParams.N3>
+class DirichletModal : public ModalField<GridN1,GridN2,GridN3>
 {
 public:
     DirichletModal() : ModalField(BoundaryCondition::Dirichlet, gridParams.dimensionality==Dimensionality::ThreeDimensional) {}
+    DirichletModal(FieldBundle<GridN1,GridN2,GridN3>& bundle, int k) : ModalField(BoundaryCondition::Dirichlet, gridParams.dimensionality==Dimensionality::ThreeDimensional, bundle, k) {}
     using ModalField::operator=;
 };
 
-class Neumann1D : public Nodal1D<gridParams.N1,gridParams.N2,gridParams.N3>
+class Neumann1D : public Nodal1D<GridN1,GridN2,GridN3>
 {
 public:
     Neumann1D() : Nodal1D(BoundaryCondition::Neumann) {}
     using Nodal1D::operator=;
 };
 
-class Dirichlet1D : public Nodal1D<gridParams.N1,gridParams.N2,gridParams.N3>
+class Dirichlet1D : public Nodal1D<GridN1,GridN2,GridN3>
 {
 public:
     Dirichlet1D() : Nodal1D(BoundaryCondition::Dirichlet) {}
     using Nodal1D::operator=;
 };
 
-template<typename T>
-Dim1MatMul<T, complex, complex, M1, gridParams.N2, gridParams.N3> ddx(const StackContainer<T, complex, M1, gridParams.N2, gridParams.N3>& f)
+// the derivative and reinterpolation operators for the grid
+// these are built once, in StratiLib, and shared by every translation unit
+struct GridOperators
 {
-    static DiagonalMatrix<complex, -1> dim1Derivative = FourierDerivativeMatrix(flowParams.L1, gridParams.N1, 1);
+    DiagonalMatrix<complex, -1> dim1Derivative;
+    DiagonalMatrix<complex, -1> dim2Derivative;
 
-    return Dim1MatMul<T, complex, complex, M1, gridParams.N2, gridParams.N3>(dim1Derivative, f);
-}
+    BandedMatrix<stratifloat> dim3DerivativeNeumann;
+    BandedMatrix<stratifloat> dim3DerivativeDirichlet;
+
+    BandedMatrix<stratifloat> reinterpolateDirichlet;
+    BandedMatrix<stratifloat> reinterpolateBar;
+    BandedMatrix<stratifloat> reinterpolateTilde;
+    BandedMatrix<stratifloat> reinterpolateFull;
+};
+
+const GridOperators& Operators();
 
 template<typename T>
-Dim2MatMul<T, complex, complex, M1, gridParams.N2, gridParams.N3> ddy(const StackContainer<T, complex, M1, gridParams.N2, gridParams.N3>& f)
+Dim1MatMul<T, complex, complex, GridM1, GridN2, GridN3> ddx(const StackContainer<T, complex, GridM1, GridN2, GridN3>& f)
 {
-    static DiagonalMatrix<complex, -1> dim2Derivative = FourierDerivativeMatrix(flowParams.L2, gridParams.N2, 2);
+    return Dim1MatMul<T, complex, complex, GridM1, GridN2, GridN3>(Operators().dim1Derivative, f);
+}
 
-    return Dim2MatMul<T, complex, complex, M1, gridParams.N2, gridParams.N3>(dim2Derivative, f);
+template<typename T>
+Dim2MatMul<T, complex, complex, GridM1, GridN2, GridN3> ddy(const StackContainer<T, complex, GridM1, GridN2, GridN3>& f)
+{
+    return Dim2MatMul<T, complex, complex, GridM1, GridN2, GridN3>(Operators().dim2Derivative, f);
 }
 
 template<typename A, typename T, int K1, int K2, int K3>
-Dim3MatMul<A, stratifloat, T, K1, K2, K3> ddz(const StackContainer<A, T, K1, K2, K3>& f)
+Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3> ddz(const StackContainer<A, T, K1, K2, K3>& f)
 {
     if (f.BC() == BoundaryCondition::Neumann)
     {
-        static MatrixX dim3Derivative = VerticalDerivativeMatrix(flowParams.L3, gridParams.N3, f.BC());
-        return Dim3MatMul<A, stratifloat, T, K1, K2, K3>(dim3Derivative, f, BoundaryCondition::Dirichlet);
+        return Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3>(Operators().dim3DerivativeNeumann, f, BoundaryCondition::Dirichlet);
     }
     else
     {
-        static MatrixX dim3Derivative = VerticalDerivativeMatrix(flowParams.L3, gridParams.N3, f.BC());
-        return Dim3MatMul<A, stratifloat, T, K1, K2, K3>(dim3Derivative, f, BoundaryCondition::Neumann);
+        return Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3>(Operators().dim3DerivativeDirichlet, f, BoundaryCondition::Neumann);
     }
 }
 
 template<typename A, typename T, int K1, int K2, int K3>
-Dim3MatMul<A, stratifloat, T, K1, K2, K3> ReinterpolateDirichlet(const StackContainer<A, T, K1, K2, K3>& f)
+Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3> ReinterpolateDirichlet(const StackContainer<A, T, K1, K2, K3>& f)
 {
-    static MatrixX reint = DirichletReinterpolation(flowParams.L3, gridParams.N3);
-    return Dim3MatMul<A, stratifloat, T, K1, K2, K3>(reint, f, BoundaryCondition::Neumann);
+    return Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3>(Operators().reinterpolateDirichlet, f, BoundaryCondition::Neumann);
 }
 
 template<typename A, typename T, int K1, int K2, int K3>
-Dim3MatMul<A, stratifloat, T, K1, K2, K3> ReinterpolateBar(const StackContainer<A, T, K1, K2, K3>& f)
+Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3> ReinterpolateBar(const StackContainer<A, T, K1, K2, K3>& f)
 {
-    static MatrixX reint = NeumannReinterpolationBar(flowParams.L3, gridParams.N3);
-    return Dim3MatMul<A, stratifloat, T, K1, K2, K3>(reint, f, BoundaryCondition::Dirichlet);
+    return Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3>(Operators().reinterpolateBar, f, BoundaryCondition::Dirichlet);
 }
 
 template<typename A, typename T, int K1, int K2, int K3>
-Dim3MatMul<A, stratifloat, T, K1, K2, K3> ReinterpolateTilde(const StackContainer<A, T, K1, K2, K3>& f)
+Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3> ReinterpolateTilde(const StackContainer<A, T, K1, K2, K3>& f)
 {
-    static MatrixX reint = NeumannReinterpolationTilde(flowParams.L3, gridParams.N3);
-    return Dim3MatMul<A, stratifloat, T, K1, K2, K3>(reint, f, BoundaryCondition::Dirichlet);
+    return Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3>(Operators().reinterpolateTilde, f, BoundaryCondition::Dirichlet);
 }
 
 template<typename A, typename T, int K1, int K2, int K3>
-Dim3MatMul<A, stratifloat, T, K1, K2, K3> ReinterpolateFull(const StackContainer<A, T, K1, K2, K3>& f)
-{
-    static MatrixX reint = NeumannReinterpolationFull(flowParams.L3, gridParams.N3);
-    return Dim3MatMul<A, stratifloat, T, K1, K2, K3>(reint, f, BoundaryCondition::Dirichlet);
-}
-
-namespace
-{
-void InterpolateProduct(const NeumannNodal& A, const NeumannNodal& B, NeumannModal& to)
+Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3> ReinterpolateFull(const StackContainer<A, T, K1, K2, K3>& f)
 {
-    static NeumannNodal prod;
-    prod = A*B;
-    prod.ToModal(to);
+    return Dim3BandedMatMul<A, stratifloat, T, K1, K2, K3>(Operators().reinterpolateFull, f, BoundaryCondition::Dirichlet);
 }
 
-void DifferentiateProductBar(const NeumannNodal& A, const DirichletNodal& B, NeumannModal& to)
+// scratch space for the products below and for transforms, which each solver owns
+// so that several solvers can be used at once
+struct Workspace
 {
-    static NeumannNodal prod;
-    prod = ddz(ReinterpolateBar(A)*B);
-    prod.ToModal(to);
-}
-
-
-void InterpolateProductTilde(const NeumannNodal& A, const DirichletNodal& B, DirichletModal& to)
-{
-    static DirichletNodal prod;
-    prod = ReinterpolateTilde(A)*B;
-    prod.ToModal(to);
-}
+    NeumannNodal neumannProduct;
+    DirichletNodal dirichletProduct;
+    TransformScratch transform;
+};
 
-void InterpolateProduct(const DirichletNodal& A, const DirichletNodal& B, NeumannModal& to)
-{
-    static NeumannNodal prod;
-    prod = ReinterpolateDirichlet(A)*ReinterpolateDirichlet(B);
-    prod.ToModal(to);
-}
+void InterpolateProduct(const NeumannNodal& A, const NeumannNodal& B, NeumannModal& to, Workspace& workspace);
+void DifferentiateProductBar(const NeumannNodal& A, const DirichletNodal& B, NeumannModal& to, Workspace& workspace);
+void InterpolateProductTilde(const NeumannNodal& A, const DirichletNodal& B, DirichletModal& to, Workspace& workspace);
+void InterpolateProduct(const DirichletNodal& A, const DirichletNodal& B, NeumannModal& to, Workspace& workspace);
 
 void InterpolateProduct(const NeumannNodal& A1, const NeumannNodal& A2,
                         const NeumannNodal& B1, const NeumannNodal& B2,
-                        NeumannModal& to)
-{
-    static NeumannNodal prod;
-    prod = A1*B1 + A2*B2;
-    prod.ToModal(to);
-}
+                        NeumannModal& to, Workspace& workspace);
 void DifferentiateProductBar(const NeumannNodal& A1, const NeumannNodal& A2,
                         const DirichletNodal& B1, const DirichletNodal& B2,
-                        NeumannModal& to)
-{
-    static NeumannNodal prod;
-    prod = ddz(ReinterpolateBar(A1)*B1 + ReinterpolateBar(A2)*B2);
-    prod.ToModal(to);
-}
+                        NeumannModal& to, Workspace& workspace);
 void InterpolateProductTilde(const NeumannNodal& A1, const NeumannNodal& A2,
                         const DirichletNodal& B1, const DirichletNodal& B2,
-                        DirichletModal& to)
-{
-    static DirichletNodal prod;
-    prod = ReinterpolateTilde(A1)*B1 + ReinterpolateTilde(A2)*B2;
-    prod.ToModal(to);
-}
-}
+                        DirichletModal& to, Workspace& workspace);
+
+// StratiLib explicitly instantiates the fields and kernels for each of these grids, given as (N1, N2, N3),
+// so that they are compiled once rather than in every translation unit which uses them
+// each grid must only be listed once
+#define FOR_EACH_LIBRARY_GRID(GRID) \
+    GRID(GridN1, GridN2, GridN3)
+
+#define GRID_TEMPLATES(PREFIX, N1, N2, N3) \
+    PREFIX template class Field<stratifloat, N1, N2, N3>; \
+    PREFIX template class Field<complex, ModalSize(N1), N2, N3>; \
+    PREFIX template class Field1D<stratifloat, N1, N2, N3>; \
+    PREFIX template class NodalField<N1, N2, N3>; \
+    PREFIX template class ModalField<N1, N2, N3>; \
+    PREFIX template class Nodal1D<N1, N2, N3>; \
+    PREFIX template class FieldBundle<N1, N2, N3>; \
+    PREFIX template class Tridiagonal<stratifloat, N3>; \
+    PREFIX template class Dim1MatMul<Field<complex, ModalSize(N1), N2, N3>, stratifloat, complex, ModalSize(N1), N2, N3>; \
+    PREFIX template class Dim1MatMul<Field<complex, ModalSize(N1), N2, N3>, complex, complex, ModalSize(N1), N2, N3>; \
+    PREFIX template class Dim2MatMul<Field<complex, ModalSize(N1), N2, N3>, stratifloat, complex, ModalSize(N1), N2, N3>; \
+    PREFIX template class Dim2MatMul<Field<complex, ModalSize(N1), N2, N3>, complex, complex, ModalSize(N1), N2, N3>; \
+    PREFIX template class Dim3BandedMatMul<Field<complex, ModalSize(N1), N2, N3>, stratifloat, complex, ModalSize(N1), N2, N3>; \
+    PREFIX template class Dim3BandedMatMul<Field<stratifloat, N1, N2, N3>, stratifloat, stratifloat, N1, N2, N3>; \
+    PREFIX template class Dim3BandedMatMul<Field1D<stratifloat, N1, N2, N3>, stratifloat, stratifloat, N1, N2, N3>; \
+    PREFIX template stratifloat IntegrateVertically<N1, N2, N3>(const Nodal1D<N1, N2, N3>&, stratifloat); \
+    PREFIX template stratifloat IntegrateAllSpace<N1, N2, N3>(const ModalField<N1, N2, N3>&, stratifloat, stratifloat, stratifloat); \
+    PREFIX template stratifloat InnerProd<N1, N2, N3>(const ModalField<N1, N2, N3>&, const ModalField<N1, N2, N3>&, stratifloat);
+
+#define EXTERN_GRID_TEMPLATES(N1, N2, N3) GRID_TEMPLATES(extern, N1, N2, N3)
+FOR_EACH_LIBRARY_GRID(EXTERN_GRID_TEMPLATES)
+#undef EXTERN_GRID_TEMPLATES
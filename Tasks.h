@@ -0,0 +1,68 @@
+#pragma once
+
+#include "Constants.h"
+#include "Distributed.h"
+
+#include <cstdlib>
+#include <string>
+#include <omp.h>
+
+// The loops over a field's stacks are split between threads by ParallelFor.
+// On its own each one is a parallel region, which ends with a barrier.
+// Within a task graph (see IMEXRK::TimeStep) the team is already running, so they become taskloops,
+// and the only waiting is where one operation needs the result of another,
+// which lets the work on independent fields overlap.
+
+// calls f(j1, j2) for 0 <= j1 < end1 and begin2 <= j2 < end2, split between threads
+template<typename F>
+void ParallelFor(int end1, int begin2, int end2, F f)
+{
+    if (omp_in_parallel())
+    {
+        #pragma omp taskloop collapse(2) grainsize(TaskGrainSize)
+        for (int j2=begin2; j2<end2; j2++)
+        {
+            for (int j1=0; j1<end1; j1++)
+            {
+                f(j1, j2);
+            }
+        }
+    }
+    else
+    {
+        #pragma omp parallel for collapse(2)
+        for (int j2=begin2; j2<end2; j2++)
+        {
+            for (int j1=0; j1<end1; j1++)
+            {
+                f(j1, j2);
+            }
+        }
+    }
+}
+
+// the number of threads which may run the iterations of a ParallelFor started here, for sizing per thread buffers
+// within a parallel region they are the current team, and otherwise the team which ParallelFor starts
+inline int ParallelForThreads()
+{
+    return omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+}
+
+// whether the timesteps are run as task graphs
+// this is not done with MPI, as only the main thread communicates,
+// and can be turned off by setting STRATIFLOW_TASKS=0 to compare against
+inline bool UseTaskGraph()
+{
+    static const bool enabled = []()
+    {
+        const char* setting = std::getenv("STRATIFLOW_TASKS");
+        return setting == nullptr || std::string(setting) != "0";
+    }();
+
+    return enabled && !IsDistributed() && omp_get_max_threads() > 1;
+}
+
+// a node of the task graph, which waits for the previous nodes using the same fields according to its depend clauses
+// outside a graph it is run straight away, so the code behaves as if it were not there
+#define TASK_PRAGMA(...) _Pragma(#__VA_ARGS__)
+#define GRAPH_TASK(...) TASK_PRAGMA(omp task __VA_ARGS__ if(omp_in_parallel()))
@@ -0,0 +1,245 @@
+#define CATCH_CONFIG_MAIN
+// this version of catch needs a constant SIGSTKSZ, which newer glibc does not have
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
+#include "catch.h"
+
+#include "StateVector.h"
+#include "Integration.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+namespace
+{
+    // a smooth state at the lowest streamwise wavenumbers
+    void SetSmooth(StateVector& x, complex u1, complex u3, complex b)
+    {
+        for (int j1=1; j1<=4; j1++)
+        {
+            for (int j3=3; j3<gridParams.N3-3; j3++)
+            {
+                stratifloat s = std::sin(pi*j3/gridParams.N3);
+                x.u1(j1,0,j3) = s/j1*u1;
+                x.u3(j1,0,j3) = s/j1*u3;
+                x.b(j1,0,j3) = s*s/j1*b;
+            }
+        }
+        x.EnforceBCs();
+    }
+
+    // has wavenumbers beyond those the dealiasing keeps, in both horizontal directions
+    stratifloat Rough(stratifloat x, stratifloat y, stratifloat z)
+    {
+        return std::sin(2*pi*x/flowParams.L1)*std::cos(2*pi*y/flowParams.L2)*std::exp(-z*z)
+             + std::cos(14*pi*x/flowParams.L1)*std::sin(10*pi*y/flowParams.L2)*std::tanh(z)
+             + 0.5*std::sin(30*pi*x/flowParams.L1 + 22*pi*y/flowParams.L2);
+    }
+
+    // transforms the same field with the dealiased stacks stored compactly and in the full layout
+    template<int K1, int K2, int K3>
+    void CheckCompactMatchesFull(bool filterSpanwise)
+    {
+        NodalField<K1, K2, K3> U(BoundaryCondition::Neumann);
+        U.SetValue(Rough, flowParams.L1, flowParams.L2, flowParams.L3);
+
+        ModalField<K1, K2, K3> compact(BoundaryCondition::Neumann, filterSpanwise, K1, K2, K3, true);
+        ModalField<K1, K2, K3> full(BoundaryCondition::Neumann, filterSpanwise, K1, K2, K3, false);
+        REQUIRE(compact.Compact());
+        REQUIRE(!full.Compact());
+
+        U.ToModal(compact);
+        U.ToModal(full);
+
+        const ModalField<K1, K2, K3>& constCompact = compact;
+        const ModalField<K1, K2, K3>& constFull = full;
+        stratifloat stackDifference = 0;
+        for (int j1=0; j1<full.Size1(); j1++)
+        {
+            for (int j2=0; j2<full.Size2(); j2++)
+            {
+                stackDifference = std::max(stackDifference, (constCompact.stack(j1, j2) - constFull.stack(j1, j2)).abs().maxCoeff());
+            }
+        }
+        CHECK(stackDifference == 0);
+
+        // a compact slice only has the stored stacks, but the others are zero in the full field
+        for (int j3 : {0, K3/2, K3-1})
+        {
+            CHECK(compact.slice(j3).abs2().sum() == Approx(full.slice(j3).abs2().sum()));
+        }
+
+        stratifloat compactProduct = InnerProd(compact, compact, flowParams.L3);
+        stratifloat fullProduct = InnerProd(full, full, flowParams.L3);
+        CHECK(compactProduct > 0);
+        CHECK(compactProduct == Approx(fullProduct).epsilon(1e-12));
+
+        NodalField<K1, K2, K3> fromCompact(BoundaryCondition::Neumann);
+        NodalField<K1, K2, K3> fromFull(BoundaryCondition::Neumann);
+        compact.ToNodal(fromCompact);
+        full.ToNodal(fromFull);
+
+        // transforming back doesn't lose any more
+        ModalField<K1, K2, K3> again(BoundaryCondition::Neumann, filterSpanwise, K1, K2, K3, true);
+        fromCompact.ToModal(again);
+        CHECK(InnerProd(again, again, flowParams.L3) == Approx(compactProduct).epsilon(1e-12));
+
+        // the round trip only keeps the dealiased part, so it only has to agree with itself
+        stratifloat scale = fromFull.Max();
+        fromCompact -= fromFull;
+        CHECK(fromCompact.Max() < 100*std::numeric_limits<stratifloat>::epsilon()*scale);
+    }
+
+    // the fields of a bundle are transformed together, but should get what they would separately
+    template<int K1, int K2, int K3>
+    void CheckBundleMatchesSeparate(bool filterSpanwise, bool compact)
+    {
+        FieldBundle<K1, K2, K3> bundle(2, K1, K2, K3, compact);
+        NodalField<K1, K2, K3> U(BoundaryCondition::Neumann, bundle, 0);
+        NodalField<K1, K2, K3> W(BoundaryCondition::Dirichlet, bundle, 1);
+        ModalField<K1, K2, K3> u(BoundaryCondition::Neumann, filterSpanwise, bundle, 0);
+        ModalField<K1, K2, K3> w(BoundaryCondition::Dirichlet, filterSpanwise, bundle, 1);
+        REQUIRE(U.Interleaved());
+        REQUIRE(w.Interleaved());
+
+        U.SetValue(Rough, flowParams.L1, flowParams.L2, flowParams.L3);
+        W.SetValue([](stratifloat x, stratifloat y, stratifloat z) { return Rough(x, y, 2*z); }, flowParams.L1, flowParams.L2, flowParams.L3);
+
+        // copies have their own storage
+        NodalField<K1, K2, K3> separateU(U);
+        NodalField<K1, K2, K3> separateW(W);
+        REQUIRE(!separateW.Interleaved());
+        ModalField<K1, K2, K3> separateu(BoundaryCondition::Neumann, filterSpanwise, K1, K2, K3, compact);
+        ModalField<K1, K2, K3> separatew(BoundaryCondition::Dirichlet, filterSpanwise, K1, K2, K3, compact);
+
+        bundle.ToModal();
+        separateU.ToModal(separateu);
+        separateW.ToModal(separatew);
+
+        stratifloat scale = InnerProd(separatew, separatew, flowParams.L3);
+        CHECK(scale > 0);
+        separateu -= u;
+        separatew -= w;
+        CHECK(InnerProd(separateu, separateu, flowParams.L3) < 100*std::numeric_limits<stratifloat>::epsilon()*scale);
+        CHECK(InnerProd(separatew, separatew, flowParams.L3) < 100*std::numeric_limits<stratifloat>::epsilon()*scale);
+
+        // zeroing one field of the bundle leaves the other
+        u.Zero();
+        CHECK(InnerProd(w, w, flowParams.L3) == Approx(scale));
+
+        w.ToNodal(separateW);
+        bundle.ToNodal();
+        CHECK(U.Max() == 0);
+        stratifloat nodalScale = W.Max();
+        CHECK(nodalScale > 0);
+        separateW -= W;
+        CHECK(separateW.Max() < 100*std::numeric_limits<stratifloat>::epsilon()*nodalScale);
+    }
+}
+
+TEST_CASE("Compact modal storage matches the full layout in 2D")
+{
+    CheckCompactMatchesFull<32, 1, 64>(false);
+}
+
+TEST_CASE("Compact modal storage matches the full layout in 3D")
+{
+    CheckCompactMatchesFull<24, 12, 32>(true);
+    CheckCompactMatchesFull<24, 12, 32>(false);
+}
+
+TEST_CASE("A bundle transforms its fields as they would be separately")
+{
+    CheckBundleMatchesSeparate<32, 1, 64>(false, true);
+    CheckBundleMatchesSeparate<32, 1, 64>(false, false);
+    CheckBundleMatchesSeparate<24, 12, 32>(true, true);
+    CheckBundleMatchesSeparate<24, 12, 32>(true, false);
+    CheckBundleMatchesSeparate<24, 12, 32>(false, true);
+}
+
+TEST_CASE("The processes' stacks cover every stack once, in order")
+{
+    // sizes which don't divide evenly into blocks or between the processes
+    for (int parts=1; parts<=5; parts++)
+    {
+        std::vector<int> owners(37, -1);
+        for (int part=0; part<parts; part++)
+        {
+            OwnedStacks stacks(owners.size(), part, parts);
+            for (int n=0; n<stacks.Count(); n++)
+            {
+                CHECK(stacks.Index(stacks[n]) == n);
+                CHECK(owners[stacks[n]] == -1);
+                CHECK((n == 0 || stacks[n] > stacks[n-1]));
+                owners[stacks[n]] = part;
+            }
+        }
+        CHECK(std::count(owners.begin(), owners.end(), -1) == 0);
+        for (int part=0; part<parts; part++)
+        {
+            for (unsigned int j1=0; j1<owners.size(); j1++)
+            {
+                CHECK((OwnedStacks(owners.size(), part, parts).Index(j1) >= 0) == (owners[j1] == part));
+            }
+        }
+
+        // the rows which the dealiasing removes aren't anyone's
+        std::vector<int> rowOwners(19, -1);
+        for (int part=0; part<parts; part++)
+        {
+            OwnedRows rows(6, 14, rowOwners.size(), part, parts);
+            for (int n=0; n<rows.Count(); n++)
+            {
+                CHECK(rows.Index(rows[n]) == n);
+                CHECK(rowOwners[rows[n]] == -1);
+                CHECK((n == 0 || rows[n] > rows[n-1]));
+                rowOwners[rows[n]] = part;
+            }
+        }
+        CHECK(std::count(rowOwners.begin()+6, rowOwners.begin()+14, -1) == 8);
+        CHECK(std::count(rowOwners.begin(), rowOwners.end(), -1) == 8);
+        for (int part=0; part<parts; part++)
+        {
+            for (unsigned int j2=0; j2<rowOwners.size(); j2++)
+            {
+                CHECK((OwnedRows(6, 14, rowOwners.size(), part, parts).Index(j2) >= 0) == (rowOwners[j2] == part));
+            }
+        }
+    }
+}
+
+TEST_CASE("The tangent linear evolution matches a finite difference")
+{
+    StateVector x;
+    SetSmooth(x, complex(1e-2, 3e-3), complex(1e-3, -2e-4), complex(1e-3, 5e-3));
+
+    // this isn't divergence free, so the tangent evolution has to project it first, as FullEvolve does
+    StateVector direction;
+    SetSmooth(direction, complex(3e-3, -1e-2), 0, complex(1e-2, 5e-3));
+
+    stratifloat T = 0.5;
+    Trajectory trajectory;
+    StateVector Fx;
+    x.FullEvolve(T, Fx, false, false, false, StateVector::solver, &trajectory);
+
+    StateVector tangent;
+    direction.TangentEvolve(trajectory, tangent);
+
+    // large enough that rounding errors in the evolutions are small next to the difference
+    stratifloat eps = std::cbrt(std::numeric_limits<stratifloat>::epsilon());
+    StateVector perturbed = x;
+    perturbed.MulAdd(eps, direction);
+
+    Trajectory perturbedTrajectory;
+    StateVector Fperturbed;
+    perturbed.FullEvolve(T, Fperturbed, false, false, false, StateVector::solver, &perturbedTrajectory);
+
+    // the timesteps depend on the state, so the difference is only meaningful if the perturbation keeps them
+    REQUIRE(perturbedTrajectory.Steps() == trajectory.Steps());
+
+    StateVector difference = Fperturbed - Fx;
+    difference *= 1/eps;
+    difference -= tangent;
+
+    CHECK(difference.Norm() < 100*eps*tangent.Norm());
+}
@@ -1,5 +1,13 @@
+#pragma once
+
 #include "Eigen.h"
+#include "Constants.h"
+#include "BandedMatrix.h"
+#include "GridSizes.h"
+
+#include <vector>
 
+// N may be Dynamic, in which case the size is taken from the matrix given to compute
 template<typename T, int N>
 class Tridiagonal
 {
@@ -7,59 +15,175 @@ public:
     Tridiagonal()
     {
         a.setZero();
-        b.setZero();
+        r.setZero();
         C.setZero();
     }
 
-    void compute(const MatrixX& A)
+    // only the main diagonal and those either side of it are used
+    void compute(const BandedMatrix<T>& A)
     {
-        assert(A.rows() == N && A.cols() == N);
+        assert((N == Dynamic || A.rows() == N) && A.cols() == A.rows());
+
+        int n = A.rows();
+        a.resize(n);
+        r.resize(n);
+        C.resize(n);
 
-        a.tail(N-1) = A.diagonal(-1);
-        b = A.diagonal(0);
-        C.head(N-1) = A.diagonal(1);
+        a(0) = 0;
+        a.tail(n-1) = A.diagonal(-1).matrix();
+        Matrix<T, N, 1> b = A.diagonal(0).matrix();
+        C.head(n-1) = A.diagonal(1).matrix();
+        C(n-1) = 0;
 
-        C(0) = C(0)/b(0);
-        for (int j=1; j<N-1; j++)
+        // store reciprocals of the pivots so that solving needs no divisions
+        r(0) = 1/b(0);
+        C(0) = C(0)*r(0);
+        for (int j=1; j<n; j++)
         {
-            C(j) = C(j)/(b(j)-a(j)*C(j-1));
+            r(j) = 1/(b(j)-a(j)*C(j-1));
+
+            if (j<n-1)
+            {
+                C(j) = C(j)*r(j);
+            }
         }
     }
 
     template<typename R>
     Matrix<R, N, 1> solve(const Matrix<R, N, 1>& d) const
     {
-        Matrix<R, N, 1> x;
-
-        Matrix<R, N, 1> D;
+        Matrix<R, N, 1> x(rows());
+        solve(d.data(), x.data());
+        return x;
+    }
 
+    // d and x may be the same array
+    // R can be complex, in which case real and imaginary parts are solved together
+    template<typename R>
+    void solve(const R* d, R* x) const
+    {
         // from wikipedia, Thomas algorithm
 
+        int n = rows();
+
         // forward pass
-        D(0) = d(0)/b(0);
-        for (int j=1; j<N; j++)
+        x[0] = d[0]*r(0);
+        for (int j=1; j<n; j++)
         {
-            D(j) = (d(j) - a(j)*D(j-1))/(b(j)-a(j)*C(j-1));
+            x[j] = (d[j] - a(j)*x[j-1])*r(j);
         }
 
         // backward pass
-        x(N-1) = D(N-1);
-        for (int j=N-2; j>=0; j--)
+        for (int j=n-2; j>=0; j--)
         {
-            x(j) = D(j) - C(j)*x(j+1);
+            x[j] -= C(j)*x[j+1];
         }
+    }
 
-        return x;
+    // solves up to TridiagonalBatch independent systems in lockstep, one in each simd lane
+    // the forward pass gathers the systems so that the lanes are the fastest varying index,
+    // and the backward pass scatters the solutions back
+    template<typename R>
+    static void solveBatch(const Tridiagonal* const solvers[], const R* const d[], R* const x[], int count)
+    {
+        // if the size is only known at runtime, the loops still get a fixed trip count for the hot sizes
+        WithVerticalSize<N>(solvers[0]->rows(), [&](auto size)
+        {
+            solveBatchOfSize<decltype(size)::value>(solvers, d, x, count);
+        });
     }
 
-    int rows()
+    int rows() const
     {
-        return N;
+        return r.size();
     }
 
 private:
+    template<int K, typename R>
+    static void solveBatchOfSize(const Tridiagonal* const solvers[], const R* const d[], R* const x[], int count)
+    {
+        assert(count <= TridiagonalBatch);
+
+        constexpr int B = TridiagonalBatch;
+        using Lanes = Array<T, B, 1>;
+
+        // a complex right hand side is swept as its real and imaginary parts, which share the coefficients
+        constexpr int P = sizeof(R)/sizeof(T);
+
+        const int n = K == Dynamic ? solvers[0]->rows() : K;
+
+        // the forward pass is kept with the lanes as the fastest varying index, part p of element j at (j*P+p)*B
+        static thread_local std::vector<T, aligned_allocator<T>> forward;
+        forward.resize(n*P*B);
+        auto stored = [](T* at)
+        {
+            return Map<Lanes, Aligned16>(at);
+        };
+
+        // the lanes past count repeat the first system, and aren't written back
+        const T* in[B];
+        T* out[B];
+        const Tridiagonal* lane[B];
+        for (int l=0; l<B; l++)
+        {
+            lane[l] = solvers[l < count ? l : 0];
+            in[l] = reinterpret_cast<const T*>(d[l < count ? l : 0]);
+            out[l] = reinterpret_cast<T*>(x[l < count ? l : 0]);
+        }
+
+        // each step gathers one element of every lane's right hand side and coefficients
+        Lanes lower;
+        Lanes reciprocal;
+        Lanes upper;
+        Lanes previous[P];
+        for (int p=0; p<P; p++)
+        {
+            // a(0) is zero, so this doesn't contribute to the first step
+            previous[p].setZero();
+        }
+        for (int j=0; j<n; j++)
+        {
+            for (int l=0; l<B; l++)
+            {
+                lower(l) = lane[l]->a(j);
+                reciprocal(l) = lane[l]->r(j);
+            }
+
+            for (int p=0; p<P; p++)
+            {
+                Lanes value;
+                for (int l=0; l<B; l++)
+                {
+                    value(l) = in[l][j*P+p];
+                }
+
+                previous[p] = (value - lower*previous[p])*reciprocal;
+                stored(&forward[(j*P+p)*B]) = previous[p];
+            }
+        }
+
+        // C(n-1) is zero, so the last step of the backward pass just copies the forward pass
+        for (int j=n-1; j>=0; j--)
+        {
+            for (int l=0; l<B; l++)
+            {
+                upper(l) = lane[l]->C(j);
+            }
+
+            for (int p=0; p<P; p++)
+            {
+                previous[p] = stored(&forward[(j*P+p)*B]) - upper*previous[p];
+
+                for (int l=0; l<count; l++)
+                {
+                    out[l][j*P+p] = previous[p](l);
+                }
+            }
+        }
+    }
+
     // as per wikipedia
     Matrix<T, N, 1> a; // lower
-    Matrix<T, N, 1> b; // diagonal
+    Matrix<T, N, 1> r; // reciprocal of the transformed diagonal
     Matrix<T, N, 1> C; // transformed upper
-};
\ No newline at end of file
+};